@@ -0,0 +1,193 @@
+/*
+ * Host stand-in for the Arduino core, used by the "native" PlatformIO
+ * environment so the listener firmware can be compiled, run and profiled
+ * on Linux.  Only the parts of the API that main.cpp uses are provided.
+ * Hardware calls are recorded in nativeHal so they can be reported when
+ * the program exits.
+ */
+#ifndef NATIVE_HAL_ARDUINO_H
+#define NATIVE_HAL_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <string>
+#include <functional>
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t sint8;
+typedef int16_t sint16;
+typedef int32_t sint32;
+
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT 0x00
+#define OUTPUT 0x01
+
+#define DEC 10
+#define HEX 16
+
+//ESP8266 D1 mini pin names
+#define D0 16
+#define D1 5
+#define D2 4
+#define D3 0
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+#define LED_BUILTIN 2
+
+#define PROGMEM
+#define PSTR(s) (s)
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+
+// Counters for everything the firmware asks the "hardware" to do
+typedef struct
+  {
+  unsigned long digitalWrites=0;
+  unsigned long delays=0;
+  unsigned long delayMs=0;
+  unsigned long serialBytesOut=0;
+  unsigned long restarts=0;
+  } nativeHalCounters;
+extern nativeHalCounters nativeHal;
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+class Print;
+
+class Printable
+  {
+  public:
+    virtual ~Printable() {}
+    virtual size_t printTo(Print& p) const = 0;
+  };
+
+class String;
+
+class Print
+  {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str) { return str==NULL?0:write((const uint8_t *)str, strlen(str)); }
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+
+    size_t printf(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+    size_t print(const __FlashStringHelper *s) { return write((const char *)s); }
+    size_t print(const String &s);
+    size_t print(const char s[]) { return write(s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n, int base=DEC) { return print((unsigned long)n, base); }
+    size_t print(int n, int base=DEC) { return print((long)n, base); }
+    size_t print(unsigned int n, int base=DEC) { return print((unsigned long)n, base); }
+    size_t print(long n, int base=DEC);
+    size_t print(unsigned long n, int base=DEC);
+    size_t print(long long n, int base=DEC) { return print((long)n, base); }
+    size_t print(unsigned long long n, int base=DEC) { return print((unsigned long)n, base); }
+    size_t print(double n, int digits=2);
+    size_t print(const Printable &x) { return x.printTo(*this); }
+
+    size_t println() { return write("\r\n"); }
+    template <typename T> size_t println(const T &x) { size_t n=print(x); return n+println(); }
+    template <typename T> size_t println(const T &x, int base) { size_t n=print(x, base); return n+println(); }
+  };
+
+class Stream : public Print
+  {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() { return -1; }
+    void setTimeout(unsigned long) {}
+  };
+
+// Minimal Arduino String, backed by std::string
+class String
+  {
+  public:
+    String(const char *s="") : str(s==NULL?"":s) {}
+    String(const std::string &s) : str(s) {}
+    String(char c) : str(1, c) {}
+    String(int n, int base=DEC) { fromLong(n, base); }
+    String(unsigned int n, int base=DEC) { fromUnsigned(n, base); }
+    String(long n, int base=DEC) { fromLong(n, base); }
+    String(unsigned long n, int base=DEC) { fromUnsigned(n, base); }
+    const char *c_str() const { return str.c_str(); }
+    unsigned int length() const { return str.length(); }
+    bool reserve(unsigned int size) { str.reserve(size); return true; }
+    void replace(const String &find, const String &replace);
+    String &operator+=(const String &s) { str+=s.str; return *this; }
+    String &operator+=(const char *s) { str+=s; return *this; }
+    String &operator+=(char c) { str+=c; return *this; }
+    friend String operator+(const String &a, const String &b) { return String(a.str+b.str); }
+    friend String operator+(const String &a, const char *b) { return String(a.str+b); }
+    friend String operator+(const char *a, const String &b) { return String(a+b.str); }
+    bool operator==(const char *s) const { return str==s; }
+    bool operator==(const String &s) const { return str==s.str; }
+  private:
+    void fromLong(long n, int base) { if (n<0 && base==DEC) { str="-"; fromUnsigned(-n, base, true); } else fromUnsigned(n, base); }
+    void fromUnsigned(unsigned long n, int base, bool append=false);
+    std::string str;
+  };
+
+class HardwareSerial : public Stream
+  {
+  public:
+    void begin(unsigned long) {}
+    int available() override;
+    int read() override;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    operator bool() const { return true; }
+  };
+extern HardwareSerial Serial;
+
+// Stand-in for the ESP object.  restart() ends the host program.
+class EspClass
+  {
+  public:
+    void restart();
+    uint32_t getFreeHeap();
+    uint32_t getMaxFreeBlockSize();
+    uint8_t getHeapFragmentation();
+    uint32_t getChipId() { return 0x00c0ffee; }
+  };
+extern EspClass ESP;
+
+// Called by the native main between loop() iterations
+void nativeHalPoll();
+void nativeHalReport();
+bool nativeHalFinished();
+
+// For the tests: stop the clock following the host's and move it by hand,
+// running ppm parts per million fast.  delay() then moves it instead of
+// sleeping.  nativeRealtimeMicros() is the true time, for the NTP server.
+void nativeClockManual(double ppm);
+void nativeClockAdvance(unsigned long ms);
+unsigned long long nativeRealtimeMicros();
+
+#endif
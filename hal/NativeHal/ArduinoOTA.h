@@ -0,0 +1,37 @@
+#ifndef NATIVE_HAL_ARDUINOOTA_H
+#define NATIVE_HAL_ARDUINOOTA_H
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#define U_FLASH 0
+#define U_FS 100
+
+typedef enum
+  {
+  OTA_AUTH_ERROR,
+  OTA_BEGIN_ERROR,
+  OTA_CONNECT_ERROR,
+  OTA_RECEIVE_ERROR,
+  OTA_END_ERROR
+  } ota_error_t;
+
+// Stand-in for OTA updates; handle() only counts calls
+class ArduinoOTAClass
+  {
+  public:
+    void onStart(std::function<void(void)> fn) { startCallback=fn; }
+    void onEnd(std::function<void(void)> fn) { endCallback=fn; }
+    void onProgress(std::function<void(unsigned int, unsigned int)> fn) { progressCallback=fn; }
+    void onError(std::function<void(ota_error_t)> fn) { errorCallback=fn; }
+    void begin() {}
+    void handle() { handleCalls++; }
+    int getCommand() { return U_FLASH; }
+    unsigned long handleCalls=0;
+  private:
+    std::function<void(void)> startCallback;
+    std::function<void(void)> endCallback;
+    std::function<void(unsigned int, unsigned int)> progressCallback;
+    std::function<void(ota_error_t)> errorCallback;
+  };
+extern ArduinoOTAClass ArduinoOTA;
+#endif
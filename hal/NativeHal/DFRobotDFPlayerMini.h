@@ -0,0 +1,58 @@
+/*
+ * Host stand-in for the DFRobot DFPlayer Mini.  Every command is recorded,
+ * and a DFPlayerPlayFinished event is reported NATIVE_TRACK_MS
+ * milliseconds (default 1500) after each play().
+ */
+#ifndef NATIVE_HAL_DFROBOTDFPLAYERMINI_H
+#define NATIVE_HAL_DFROBOTDFPLAYERMINI_H
+#include <Arduino.h>
+
+#define DFPLAYER_EQ_NORMAL 0
+#define DFPLAYER_DEVICE_SD 2
+
+#define TimeOut 0
+#define WrongStack 1
+#define DFPlayerCardInserted 2
+#define DFPlayerCardRemoved 3
+#define DFPlayerCardOnline 4
+#define DFPlayerPlayFinished 5
+#define DFPlayerError 6
+#define DFPlayerUSBInserted 7
+#define DFPlayerUSBRemoved 8
+#define DFPlayerUSBOnline 9
+#define DFPlayerCardUSBOnline 10
+#define DFPlayerFeedBack 11
+
+#define Busy 1
+#define Sleeping 2
+#define SerialWrongStack 3
+#define CheckSumNotMatch 4
+#define FileIndexOut 5
+#define FileMismatch 6
+#define Advertise 7
+
+class DFRobotDFPlayerMini
+  {
+  public:
+    bool begin(Stream &stream, bool isACK=true, bool doReset=true);
+    void setTimeOut(unsigned long) {}
+    void play(int fileNumber=1);
+    void stop();
+    void volume(uint8_t volume) { currentVolume=volume; }
+    void EQ(uint8_t) {}
+    void outputDevice(uint8_t) {}
+    int readFileCounts() { return 16; }
+    bool available();
+    uint8_t readType() { return eventType; }
+    uint16_t read() { return eventValue; }
+
+    unsigned long plays=0;
+    int lastTrack=0;
+    uint8_t currentVolume=0;
+  private:
+    bool playing=false;
+    unsigned long playStarted=0;
+    uint8_t eventType=0;
+    uint16_t eventValue=0;
+  };
+#endif
@@ -0,0 +1,53 @@
+/*
+ * Host stand-in for the ESP8266 flash-backed EEPROM emulation.  If
+ * NATIVE_EEPROM names a file, the contents are loaded from it by begin()
+ * and written back by commit(), so settings survive a simulated restart.
+ */
+#ifndef NATIVE_HAL_EEPROM_H
+#define NATIVE_HAL_EEPROM_H
+#include <Arduino.h>
+
+class EEPROMClass
+  {
+  public:
+    void begin(size_t size);
+    uint8_t read(int address) { return (address>=0 && (size_t)address<size)?data[address]:0; }
+    void write(int address, uint8_t value)
+      {
+      if (address>=0 && (size_t)address<size && data[address]!=value)
+        {
+        data[address]=value;
+        dirty=true;
+        }
+      }
+    bool commit();
+    void end() {}
+    size_t length() { return size; }
+    uint8_t *getDataPtr() { dirty=true; return data; }
+
+    template<typename T> T &get(int address, T &t)
+      {
+      if (address>=0 && address+sizeof(T)<=size)
+        memcpy((uint8_t *)&t, data+address, sizeof(T));
+      return t;
+      }
+
+    template<typename T> const T &put(int address, const T &t)
+      {
+      if (address>=0 && address+sizeof(T)<=size && memcmp(data+address, (const uint8_t *)&t, sizeof(T))!=0)
+        {
+        memcpy(data+address, (const uint8_t *)&t, sizeof(T));
+        dirty=true;
+        }
+      return t;
+      }
+
+    unsigned long commits=0;      // calls to commit()
+    unsigned long sectorWrites=0; // commits that actually rewrote the flash sector
+  private:
+    uint8_t data[4096];
+    size_t size=0;
+    bool dirty=false;
+  };
+extern EEPROMClass EEPROM;
+#endif
@@ -0,0 +1,53 @@
+/*
+ * Host stand-in for the ESP8266 WiFi stack.  The "network" comes up as
+ * soon as begin() is called unless NATIVE_WIFI_FAIL is set in the
+ * environment.
+ */
+#ifndef NATIVE_HAL_ESP8266WIFI_H
+#define NATIVE_HAL_ESP8266WIFI_H
+#include <Arduino.h>
+#include <IPAddress.h>
+
+typedef enum
+  {
+  WL_IDLE_STATUS=0,
+  WL_NO_SSID_AVAIL=1,
+  WL_CONNECTED=3,
+  WL_CONNECT_FAILED=4,
+  WL_DISCONNECTED=6
+  } wl_status_t;
+
+typedef enum
+  {
+  WIFI_OFF=0,
+  WIFI_STA=1
+  } WiFiMode_t;
+
+class Client : public Stream
+  {
+  };
+
+class WiFiClient : public Client
+  {
+  public:
+    int available() override { return 0; }
+    int read() override { return -1; }
+    size_t write(uint8_t) override { return 1; }
+    using Print::write;
+  };
+
+class WiFiClass
+  {
+  public:
+    bool mode(WiFiMode_t) { return true; }
+    wl_status_t begin(const char *ssid, const char *passphrase=NULL);
+    wl_status_t status();
+    IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+    int32_t RSSI() { return -42; }
+    bool hostname(const char *) { return true; }
+    unsigned long beginCalls=0;
+  private:
+    wl_status_t currentStatus=WL_IDLE_STATUS;
+  };
+extern WiFiClass WiFi;
+#endif
@@ -0,0 +1,30 @@
+#ifndef NATIVE_HAL_IPADDRESS_H
+#define NATIVE_HAL_IPADDRESS_H
+#include <Arduino.h>
+
+class IPAddress : public Printable
+  {
+  public:
+    IPAddress(uint8_t a=0, uint8_t b=0, uint8_t c=0, uint8_t d=0) { octets[0]=a; octets[1]=b; octets[2]=c; octets[3]=d; }
+    uint8_t operator[](int i) const { return octets[i]; }
+    String toString() const
+      {
+      char buf[16];
+      snprintf(buf, sizeof(buf), "%u.%u.%u.%u", octets[0], octets[1], octets[2], octets[3]);
+      return String(buf);
+      }
+    size_t printTo(Print &p) const override
+      {
+      size_t n=0;
+      for (int i=0;i<4;i++)
+        {
+        if (i>0)
+          n+=p.print('.');
+        n+=p.print(octets[i], DEC);
+        }
+      return n;
+      }
+  private:
+    uint8_t octets[4];
+  };
+#endif
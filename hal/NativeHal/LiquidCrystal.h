@@ -0,0 +1,31 @@
+/*
+ * Host stand-in for an HD44780 character display.  It keeps a copy of the
+ * screen and counts the bus traffic the firmware generates.
+ */
+#ifndef NATIVE_HAL_LIQUIDCRYSTAL_H
+#define NATIVE_HAL_LIQUIDCRYSTAL_H
+#include <Arduino.h>
+
+class LiquidCrystal : public Print
+  {
+  public:
+    LiquidCrystal(uint8_t rs, uint8_t enable, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3);
+    void begin(uint8_t cols, uint8_t rows);
+    void clear();
+    void home() { setCursor(0, 0); }
+    void setCursor(uint8_t col, uint8_t row);
+    size_t write(uint8_t c) override;
+    using Print::write;
+    void dump();
+
+    unsigned long clears=0;
+    unsigned long cursorMoves=0;
+    unsigned long charsWritten=0;
+  private:
+    uint8_t columns=16;
+    uint8_t rows=2;
+    uint8_t col=0;
+    uint8_t row=0;
+    char screen[4][41];
+  };
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Host stand-in for the ESP8266 LittleFS file system.  Files live in the
+ * directory named by NATIVE_FS, so they survive a simulated restart.  If
+ * NATIVE_FS isn't set a fresh temporary directory is used for each run.
+ * Only the parts of the FS API that main.cpp uses are provided.
+ */
+#ifndef NATIVE_HAL_LITTLEFS_H
+#define NATIVE_HAL_LITTLEFS_H
+#include <Arduino.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum SeekMode
+  {
+  SeekSet=0,
+  SeekCur=1,
+  SeekEnd=2
+  };
+
+struct FSInfo
+  {
+  size_t totalBytes;
+  size_t usedBytes;
+  size_t blockSize;
+  size_t pageSize;
+  size_t maxOpenFiles;
+  size_t maxPathLength;
+  };
+
+class File : public Stream
+  {
+  public:
+    File() {}
+    File(FILE *f, const std::string &name) : handle(f, fclose), path(name) {}
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    int available() override;
+    int read() override;
+    size_t read(uint8_t *buffer, size_t size);
+    bool seek(uint32_t pos, SeekMode mode=SeekSet);
+    size_t position() const;
+    size_t size() const;
+    void close() { handle.reset(); }
+    const char *fullName() const { return path.c_str(); }
+    operator bool() const { return handle!=nullptr; }
+  private:
+    std::shared_ptr<FILE> handle;
+    std::string path;
+  };
+
+class Dir
+  {
+  public:
+    Dir() {}
+    Dir(const std::string &directory, const std::vector<std::string> &names) : dir(directory), entries(names) {}
+    bool next() { return ++current<(int)entries.size(); }
+    String fileName() const { return String(entries[current].c_str()); }
+    size_t fileSize() const;
+  private:
+    std::string dir;
+    std::vector<std::string> entries;
+    int current=-1;
+  };
+
+class FS
+  {
+  public:
+    bool begin();
+    void end() {}
+    bool format();
+    File open(const char *path, const char *mode);
+    bool exists(const char *path);
+    bool remove(const char *path);
+    bool mkdir(const char *path);
+    Dir openDir(const char *path);
+    bool info(FSInfo &info);
+
+    unsigned long fileWrites=0;   // write() calls on open files
+    unsigned long bytesWritten=0;
+    unsigned long filesRemoved=0;
+  private:
+    std::string hostPath(const char *path);
+    std::string root;
+    bool mounted=false;
+  };
+extern FS LittleFS;
+#endif
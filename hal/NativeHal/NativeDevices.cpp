@@ -0,0 +1,781 @@
+/*
+ * Host stand-ins for the peripherals and libraries the listener uses.
+ */
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <LittleFS.h>
+#include <ESP8266WiFi.h>
+#include <ArduinoOTA.h>
+#include <LiquidCrystal.h>
+#include <WiFiUdp.h>
+#include <TimeLib.h>
+#include <DFRobotDFPlayerMini.h>
+#include <PubSubClient.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+WiFiClass WiFi;
+ArduinoOTAClass ArduinoOTA;
+EEPROMClass EEPROM;
+FS LittleFS;
+PubSubClient *nativeBroker=NULL;
+static LiquidCrystal *nativeLcd=NULL;
+static DFRobotDFPlayerMini *nativePlayer=NULL;
+
+/************************
+ * WiFi
+ ************************/
+
+wl_status_t WiFiClass::begin(const char *ssid, const char *passphrase)
+  {
+  (void)ssid;
+  (void)passphrase;
+  beginCalls++;
+  currentStatus=getenv("NATIVE_WIFI_FAIL")?WL_CONNECT_FAILED:WL_CONNECTED;
+  return currentStatus;
+  }
+
+wl_status_t WiFiClass::status()
+  {
+  return currentStatus;
+  }
+
+/************************
+ * EEPROM
+ ************************/
+
+void EEPROMClass::begin(size_t newSize)
+  {
+  size=newSize>sizeof(data)?sizeof(data):newSize;
+  memset(data, 0xff, sizeof(data)); //erased flash
+  const char *path=getenv("NATIVE_EEPROM");
+  if (path!=NULL)
+    {
+    FILE *f=fopen(path, "rb");
+    if (f!=NULL)
+      {
+      size_t got=fread(data, 1, size, f);
+      (void)got;
+      fclose(f);
+      }
+    }
+  dirty=false;
+  }
+
+bool EEPROMClass::commit()
+  {
+  commits++;
+  if (!dirty)
+    return true;
+  sectorWrites++;
+  dirty=false;
+  const char *path=getenv("NATIVE_EEPROM");
+  if (path!=NULL)
+    {
+    FILE *f=fopen(path, "wb");
+    if (f==NULL)
+      return false;
+    fwrite(data, 1, size, f);
+    fclose(f);
+    }
+  return true;
+  }
+
+/************************
+ * LittleFS
+ ************************/
+
+#define NATIVE_FS_BYTES (1024*1024) //size of the file system partition being simulated
+#define NATIVE_FS_BLOCK 4096
+
+size_t File::write(const uint8_t *buffer, size_t size)
+  {
+  if (!handle)
+    return 0;
+  LittleFS.fileWrites++;
+  LittleFS.bytesWritten+=size;
+  size_t done=fwrite(buffer, 1, size, handle.get());
+  fflush(handle.get());
+  return done;
+  }
+
+int File::available()
+  {
+  if (!handle)
+    return 0;
+  return (int)(size()-position());
+  }
+
+int File::read()
+  {
+  uint8_t c;
+  return read(&c, 1)==1?c:-1;
+  }
+
+size_t File::read(uint8_t *buffer, size_t size)
+  {
+  if (!handle)
+    return 0;
+  return fread(buffer, 1, size, handle.get());
+  }
+
+bool File::seek(uint32_t pos, SeekMode mode)
+  {
+  if (!handle)
+    return false;
+  int whence=mode==SeekSet?SEEK_SET:(mode==SeekCur?SEEK_CUR:SEEK_END);
+  return fseek(handle.get(), (long)pos, whence)==0;
+  }
+
+size_t File::position() const
+  {
+  return handle?(size_t)ftell(handle.get()):0;
+  }
+
+size_t File::size() const
+  {
+  struct stat st;
+  if (!handle || fstat(fileno(handle.get()), &st)!=0)
+    return 0;
+  return (size_t)st.st_size;
+  }
+
+size_t Dir::fileSize() const
+  {
+  struct stat st;
+  std::string path=dir+"/"+entries[current];
+  return stat(path.c_str(), &st)==0?(size_t)st.st_size:0;
+  }
+
+std::string FS::hostPath(const char *path)
+  {
+  return root+(path[0]=='/'?"":"/")+path;
+  }
+
+bool FS::begin()
+  {
+  if (mounted)
+    return true;
+  const char *dir=getenv("NATIVE_FS");
+  if (dir!=NULL)
+    {
+    ::mkdir(dir, 0755);
+    root=dir;
+    }
+  else
+    {
+    char tmpl[]="/tmp/nativefs-XXXXXX";
+    if (mkdtemp(tmpl)==NULL)
+      return false;
+    root=tmpl;
+    }
+  struct stat st;
+  mounted=stat(root.c_str(), &st)==0 && S_ISDIR(st.st_mode);
+  return mounted;
+  }
+
+bool FS::format()
+  {
+  if (root.empty())
+    return false;
+  std::string cmd="rm -rf '"+root+"'/*";
+  return system(cmd.c_str())==0;
+  }
+
+File FS::open(const char *path, const char *mode)
+  {
+  if (!mounted)
+    return File();
+  std::string host=hostPath(path);
+  if (mode[0]!='r') //like LittleFS, create the directories on the way to a new file
+    {
+    for (size_t i=root.length()+1;i<host.length();i++)
+      if (host[i]=='/')
+        ::mkdir(host.substr(0, i).c_str(), 0755);
+    }
+  std::string hostMode=std::string(mode)+"b";
+  FILE *f=fopen(host.c_str(), hostMode.c_str());
+  return f==NULL?File():File(f, path);
+  }
+
+bool FS::exists(const char *path)
+  {
+  struct stat st;
+  return mounted && stat(hostPath(path).c_str(), &st)==0;
+  }
+
+bool FS::remove(const char *path)
+  {
+  if (!mounted || unlink(hostPath(path).c_str())!=0)
+    return false;
+  filesRemoved++;
+  return true;
+  }
+
+bool FS::mkdir(const char *path)
+  {
+  return mounted && ::mkdir(hostPath(path).c_str(), 0755)==0;
+  }
+
+Dir FS::openDir(const char *path)
+  {
+  std::vector<std::string> names;
+  std::string host=hostPath(path);
+  DIR *d=mounted?opendir(host.c_str()):NULL;
+  if (d!=NULL)
+    {
+    struct dirent *entry;
+    while ((entry=readdir(d))!=NULL)
+      if (entry->d_name[0]!='.')
+        names.push_back(entry->d_name);
+    closedir(d);
+    }
+  return Dir(host, names);
+  }
+
+bool FS::info(FSInfo &info)
+  {
+  if (!mounted)
+    return false;
+  size_t used=0;
+  std::vector<std::string> pending={root};
+  while (!pending.empty()) //every file takes whole blocks
+    {
+    std::string dir=pending.back();
+    pending.pop_back();
+    DIR *d=opendir(dir.c_str());
+    if (d==NULL)
+      continue;
+    struct dirent *entry;
+    while ((entry=readdir(d))!=NULL)
+      {
+      if (entry->d_name[0]=='.')
+        continue;
+      std::string path=dir+"/"+entry->d_name;
+      struct stat st;
+      if (stat(path.c_str(), &st)!=0)
+        continue;
+      if (S_ISDIR(st.st_mode))
+        pending.push_back(path);
+      else
+        used+=(st.st_size+NATIVE_FS_BLOCK-1)/NATIVE_FS_BLOCK*NATIVE_FS_BLOCK;
+      }
+    closedir(d);
+    }
+  info.totalBytes=NATIVE_FS_BYTES;
+  info.usedBytes=used;
+  info.blockSize=NATIVE_FS_BLOCK;
+  info.pageSize=256;
+  info.maxOpenFiles=5;
+  info.maxPathLength=32;
+  return true;
+  }
+
+/************************
+ * LCD
+ ************************/
+
+LiquidCrystal::LiquidCrystal(uint8_t rs, uint8_t enable, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3)
+  {
+  (void)rs; (void)enable; (void)d0; (void)d1; (void)d2; (void)d3;
+  memset(screen, ' ', sizeof(screen));
+  nativeLcd=this;
+  }
+
+void LiquidCrystal::begin(uint8_t cols, uint8_t lines)
+  {
+  columns=cols>40?40:cols;
+  rows=lines>4?4:lines;
+  clear();
+  }
+
+void LiquidCrystal::clear()
+  {
+  clears++;
+  memset(screen, ' ', sizeof(screen));
+  col=0;
+  row=0;
+  }
+
+void LiquidCrystal::setCursor(uint8_t newCol, uint8_t newRow)
+  {
+  cursorMoves++;
+  col=newCol;
+  row=newRow<rows?newRow:rows-1;
+  }
+
+size_t LiquidCrystal::write(uint8_t c)
+  {
+  charsWritten++;
+  if (col<columns)
+    screen[row][col]=c;
+  col++;
+  return 1;
+  }
+
+void LiquidCrystal::dump()
+  {
+  for (int r=0;r<rows;r++)
+    fprintf(stderr, "  lcd[%d] |%.*s|\n", r, columns, screen[r]);
+  }
+
+/************************
+ * UDP and the pretend NTP server
+ ************************/
+
+unsigned long WiFiUDP::ntpRequests=0;
+unsigned long WiFiUDP::ntpAnswers=0;
+
+int WiFiUDP::beginPacket(const char *host, uint16_t port)
+  {
+  (void)host;
+  outgoing.clear();
+  outgoingPort=port;
+  return 1;
+  }
+
+size_t WiFiUDP::write(const uint8_t *buffer, size_t size)
+  {
+  outgoing.insert(outgoing.end(), buffer, buffer+size);
+  return size;
+  }
+
+static void putNtpTimestamp(uint8_t *field, uint64_t seconds, uint32_t fraction)
+  {
+  for (int i=0;i<4;i++)
+    {
+    field[i]=(seconds>>(24-8*i))&0xff;
+    field[4+i]=(fraction>>(24-8*i))&0xff;
+    }
+  }
+
+int WiFiUDP::endPacket()
+  {
+  if (outgoingPort!=123 || outgoing.size()<48)
+    return 1; //nobody listening
+  ntpRequests++;
+  const char *answers=getenv("NATIVE_NTP_ANSWERS");
+  if (answers!=NULL && ntpRequests>strtoul(answers, NULL, 10))
+    return 1; //the server is down
+  const char *delayMs=getenv("NATIVE_NTP_DELAY_MS");
+  reply r;
+  r.due=millis()+(delayMs?strtoul(delayMs, NULL, 10):20);
+  r.data.assign(48, 0);
+  r.data[0]=0x24; //no leap second, version 4, server
+  r.data[1]=2;    //stratum
+  memcpy(&r.data[24], &outgoing[40], 8); //originate is the request's transmit
+  uint64_t now=nativeRealtimeMicros();
+  uint64_t seconds=now/1000000+2208988800ULL; //NTP counts from 1900
+  uint32_t fraction=(uint32_t)(((now%1000000)<<32)/1000000ULL);
+  putNtpTimestamp(&r.data[32], seconds, fraction); //receive
+  putNtpTimestamp(&r.data[40], seconds, fraction); //transmit
+  replies.push_back(r);
+  ntpAnswers++;
+  return 1;
+  }
+
+int WiFiUDP::parsePacket()
+  {
+  if (replies.empty() || (long)(millis()-replies.front().due)<0)
+    return 0;
+  incoming=replies.front().data;
+  readPosition=0;
+  replies.pop_front();
+  return incoming.size();
+  }
+
+int WiFiUDP::read()
+  {
+  if (readPosition>=incoming.size())
+    return -1;
+  return incoming[readPosition++];
+  }
+
+int WiFiUDP::read(unsigned char *buffer, size_t size)
+  {
+  size_t count=0;
+  while (count<size && readPosition<incoming.size())
+    buffer[count++]=incoming[readPosition++];
+  return count;
+  }
+
+/************************
+ * TimeLib
+ ************************/
+
+void breakTime(unsigned long timeInput, tmElements_t &tm)
+  {
+  time_t t=(time_t)timeInput;
+  struct tm parts;
+  gmtime_r(&t, &parts);
+  tm.Second=parts.tm_sec;
+  tm.Minute=parts.tm_min;
+  tm.Hour=parts.tm_hour;
+  tm.Wday=parts.tm_wday+1;
+  tm.Day=parts.tm_mday;
+  tm.Month=parts.tm_mon+1;
+  tm.Year=parts.tm_year-70;
+  }
+
+unsigned long makeTime(const tmElements_t &tm)
+  {
+  struct tm parts;
+  memset(&parts, 0, sizeof(parts));
+  parts.tm_sec=tm.Second;
+  parts.tm_min=tm.Minute;
+  parts.tm_hour=tm.Hour;
+  parts.tm_mday=tm.Day;
+  parts.tm_mon=tm.Month-1;
+  parts.tm_year=tm.Year+70;
+  return (unsigned long)timegm(&parts);
+  }
+
+int hour(unsigned long t) { tmElements_t tm; breakTime(t, tm); return tm.Hour; }
+int minute(unsigned long t) { tmElements_t tm; breakTime(t, tm); return tm.Minute; }
+int second(unsigned long t) { tmElements_t tm; breakTime(t, tm); return tm.Second; }
+int day(unsigned long t) { tmElements_t tm; breakTime(t, tm); return tm.Day; }
+int weekday(unsigned long t) { tmElements_t tm; breakTime(t, tm); return tm.Wday; }
+int month(unsigned long t) { tmElements_t tm; breakTime(t, tm); return tm.Month; }
+int year(unsigned long t) { tmElements_t tm; breakTime(t, tm); return tm.Year+1970; }
+
+/************************
+ * MP3 player
+ ************************/
+
+static unsigned long trackLengthMs()
+  {
+  const char *len=getenv("NATIVE_TRACK_MS");
+  return len==NULL?1500:strtoul(len, NULL, 10);
+  }
+
+bool DFRobotDFPlayerMini::begin(Stream &stream, bool isACK, bool doReset)
+  {
+  (void)stream;
+  (void)isACK;
+  (void)doReset;
+  nativePlayer=this;
+  return getenv("NATIVE_PLAYER_FAIL")==NULL;
+  }
+
+void DFRobotDFPlayerMini::play(int fileNumber)
+  {
+  plays++;
+  lastTrack=fileNumber;
+  playing=true;
+  playStarted=millis();
+  if (getenv("NATIVE_VERBOSE"))
+    fprintf(stderr, "[native] %lu ms: play(%d)\n", millis(), fileNumber);
+  }
+
+void DFRobotDFPlayerMini::stop()
+  {
+  playing=false;
+  }
+
+bool DFRobotDFPlayerMini::available()
+  {
+  if (playing && millis()-playStarted>=trackLengthMs())
+    {
+    playing=false;
+    eventType=DFPlayerPlayFinished;
+    eventValue=lastTrack;
+    return true;
+    }
+  return false;
+  }
+
+/************************
+ * MQTT client and broker
+ ************************/
+
+typedef struct
+  {
+  std::string topic;
+  std::string payload;
+  uint8_t qos;
+  uint16_t id;  //packet id, 0 until it is delivered
+  bool dup;
+  } pendingMessage;
+static std::deque<pendingMessage> pendingMessages;
+static pendingMessage lastDelivered;
+typedef struct
+  {
+  std::string filter;
+  uint8_t qos;
+  } subscription;
+static std::vector<subscription> subscriptions;
+
+// Same rules the broker uses to decide if a filter covers a topic
+static bool filterMatches(const char *filter, const char *topic)
+  {
+  while (*filter && *topic)
+    {
+    if (*filter=='#')
+      return true;
+    if (*filter=='+')
+      {
+      while (*topic && *topic!='/')
+        topic++;
+      filter++;
+      continue;
+      }
+    if (*filter!=*topic)
+      return false;
+    filter++;
+    topic++;
+    }
+  if (*filter=='/' && filter[1]=='#' && filter[2]=='\0')
+    return true;
+  return *filter=='\0' && *topic=='\0';
+  }
+
+PubSubClient::PubSubClient(Client &client)
+  {
+  (void)client;
+  setBufferSize(MQTT_MAX_PACKET_SIZE);
+  nativeBroker=this;
+  }
+
+PubSubClient::~PubSubClient()
+  {
+  free(buffer);
+  }
+
+PubSubClient &PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE)
+  {
+  this->callback=callback;
+  return *this;
+  }
+
+bool PubSubClient::setBufferSize(uint16_t size)
+  {
+  if (size==0)
+    return false;
+  uint8_t *newBuffer=(uint8_t *)realloc(buffer, size);
+  if (newBuffer==NULL)
+    return false;
+  buffer=newBuffer;
+  bufferSize=size;
+  return true;
+  }
+
+bool PubSubClient::connect(const char *id, const char *user, const char *pass, const char *willTopic,
+                           uint8_t willQos, bool willRetain, const char *willMessage, bool cleanSession)
+  {
+  (void)id; (void)user; (void)pass; (void)willTopic; (void)willQos; (void)willRetain; (void)willMessage;
+  connects++;
+  const char *failures=getenv("NATIVE_MQTT_FAIL_CONNECTS"); //the broker is down for this many attempts
+  if (getenv("NATIVE_MQTT_FAIL") || (failures!=NULL && connects<=strtoul(failures, NULL, 10)))
+    return false;
+  if (cleanSession)
+    subscriptions.clear();
+  isConnected=true;
+  return true;
+  }
+
+void PubSubClient::disconnect()
+  {
+  isConnected=false;
+  }
+
+bool PubSubClient::publish(const char *topic, const char *payload, bool retained)
+  {
+  return publish(topic, (const uint8_t *)payload, payload==NULL?0:strlen(payload), retained);
+  }
+
+bool PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int plength, bool retained)
+  {
+  if (!isConnected || 5+2+strlen(topic)+plength>bufferSize)
+    return false;
+  publishes++;
+  publishedBytes+=plength;
+  if (getenv("NATIVE_VERBOSE"))
+    fprintf(stderr, "[native] publish%s %s: %.*s\n", retained?" (retained)":"", topic, (int)plength, (const char *)payload);
+  return true;
+  }
+
+bool PubSubClient::beginPublish(const char *topic, unsigned int plength, bool retained)
+  {
+  if (!isConnected)
+    return false;
+  publishes++;
+  streamRemaining=plength;
+  if (getenv("NATIVE_VERBOSE"))
+    fprintf(stderr, "[native] publish%s %s (%u bytes streamed): ", retained?" (retained)":"", topic, plength);
+  return true;
+  }
+
+size_t PubSubClient::write(uint8_t c)
+  {
+  return write(&c, 1);
+  }
+
+size_t PubSubClient::write(const uint8_t *data, size_t size)
+  {
+  if (!isConnected)
+    return 0;
+  publishedBytes+=size;
+  streamRemaining=size>streamRemaining?0:streamRemaining-size;
+  if (getenv("NATIVE_VERBOSE"))
+    fwrite(data, 1, size, stderr);
+  return size;
+  }
+
+int PubSubClient::endPublish()
+  {
+  if (getenv("NATIVE_VERBOSE"))
+    fputc('\n', stderr);
+  bool complete=streamRemaining==0;
+  streamRemaining=0;
+  return isConnected && complete?1:0;
+  }
+
+bool PubSubClient::subscribe(const char *topic, uint8_t qos)
+  {
+  if (!isConnected || qos>1)
+    return false;
+  subscribes++;
+  for (size_t i=0;i<subscriptions.size();i++)
+    {
+    if (subscriptions[i].filter==topic)
+      {
+      subscriptions[i].qos=qos;
+      return true;
+      }
+    }
+  subscriptions.push_back({topic, qos});
+  return true;
+  }
+
+bool PubSubClient::unsubscribe(const char *topic)
+  {
+  if (!isConnected)
+    return false;
+  unsubscribes++;
+  for (size_t i=0;i<subscriptions.size();i++)
+    {
+    if (subscriptions[i].filter==topic)
+      {
+      subscriptions.erase(subscriptions.begin()+i);
+      break;
+      }
+    }
+  return true;
+  }
+
+bool PubSubClient::isSubscribed(const char *topic)
+  {
+  for (size_t i=0;i<subscriptions.size();i++)
+    if (subscriptions[i].filter==topic)
+      return true;
+  return false;
+  }
+
+void PubSubClient::inject(const char *topic, const char *payload, uint8_t qos)
+  {
+  pendingMessages.push_back({topic, payload, qos, 0, false});
+  }
+
+// As if the broker never got our PUBACK for the last QoS 1 message
+void PubSubClient::redeliver()
+  {
+  if (lastDelivered.id==0)
+    return;
+  pendingMessage msg=lastDelivered;
+  msg.dup=true;
+  pendingMessages.push_back(msg);
+  }
+
+// Deliver one waiting message per call, laid out in the buffer the way
+// PubSubClient 2.8 does it: header, remaining length, the topic moved down
+// one byte and terminated, the packet id for QoS>0, then the payload.  It 
+// arrives at the lower of its own QoS and the subscription's.
+bool PubSubClient::loop()
+  {
+  if (!isConnected)
+    return false;
+  if (pendingMessages.empty())
+    return true;
+  pendingMessage msg=pendingMessages.front();
+  pendingMessages.pop_front();
+
+  bool wanted=false;
+  uint8_t subscribedQos=0;
+  for (size_t i=0;i<subscriptions.size();i++)
+    {
+    if (filterMatches(subscriptions[i].filter.c_str(), msg.topic.c_str()))
+      {
+      wanted=true;
+      subscribedQos=std::max(subscribedQos, subscriptions[i].qos);
+      }
+    }
+  msg.qos=std::min(msg.qos, subscribedQos);
+  unsigned int tl=msg.topic.length();
+  unsigned int idLength=msg.qos>0?2:0;
+  unsigned int remaining=2+tl+idLength+msg.payload.length();
+  unsigned int llen=remaining<128?1:remaining<16384?2:3;
+  if (!wanted || callback==NULL)
+    return true;
+  if (1+llen+remaining>bufferSize)
+    {
+    dropped++;
+    return true;
+    }
+  buffer[0]=0x30|(msg.dup?0x08:0)|(msg.qos<<1);
+  memset(buffer+1, 0, llen);
+  char *topic=(char *)buffer+llen+2;
+  memcpy(topic, msg.topic.c_str(), tl);
+  topic[tl]='\0';
+  uint8_t *payload=buffer+llen+3+tl;
+  if (idLength>0)
+    {
+    if (msg.id==0)
+      {
+      msg.id=nextMsgId;
+      nextMsgId=nextMsgId==0xffff?1:nextMsgId+1;
+      }
+    payload[0]=msg.id>>8;
+    payload[1]=msg.id&0xff;
+    payload+=idLength;
+    lastDelivered=msg;
+    }
+  memcpy(payload, msg.payload.data(), msg.payload.length());
+  delivered++;
+  callback(topic, payload, msg.payload.length());
+  return true;
+  }
+
+/************************
+ * Report
+ ************************/
+
+void nativeHalReport()
+  {
+  fflush(stdout);
+  fprintf(stderr, "\n[native] ---- hardware activity ----\n");
+  fprintf(stderr, "  uptime %lu ms, delay() calls %lu (%lu ms), serial bytes out %lu\n",
+          millis(), nativeHal.delays, nativeHal.delayMs, nativeHal.serialBytesOut);
+  fprintf(stderr, "  eeprom commits %lu, sector writes %lu\n", EEPROM.commits, EEPROM.sectorWrites);
+  fprintf(stderr, "  file writes %lu (%lu bytes), files removed %lu\n",
+          LittleFS.fileWrites, LittleFS.bytesWritten, LittleFS.filesRemoved);
+  if (nativeBroker!=NULL)
+    fprintf(stderr, "  mqtt connects %lu, subscribes %lu, unsubscribes %lu, delivered %lu, dropped %lu, publishes %lu (%lu bytes)\n",
+            nativeBroker->connects, nativeBroker->subscribes, nativeBroker->unsubscribes,
+            nativeBroker->delivered, nativeBroker->dropped, nativeBroker->publishes, nativeBroker->publishedBytes);
+  if (nativePlayer!=NULL)
+    fprintf(stderr, "  mp3 plays %lu, last track %d, volume %u\n",
+            nativePlayer->plays, nativePlayer->lastTrack, nativePlayer->currentVolume);
+  if (nativeLcd!=NULL)
+    {
+    fprintf(stderr, "  lcd clears %lu, cursor moves %lu, chars written %lu\n",
+            nativeLcd->clears, nativeLcd->cursorMoves, nativeLcd->charsWritten);
+    nativeLcd->dump();
+    }
+  fprintf(stderr, "  wifi begin calls %lu, ota handle calls %lu\n", WiFi.beginCalls, ArduinoOTA.handleCalls);
+  fprintf(stderr, "  ntp requests %lu, answered %lu\n", WiFiUDP::ntpRequests, WiFiUDP::ntpAnswers);
+  }
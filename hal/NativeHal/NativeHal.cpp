@@ -0,0 +1,365 @@
+/*
+ * Host stand-in for the Arduino core plus the program entry point for the
+ * "native" environment.  main() runs setup() and then loop() until stdin
+ * reaches end-of-file and the firmware has been idle for NATIVE_LINGER_MS
+ * milliseconds (default 2000).  Lines read from stdin are handed to the
+ * firmware as serial input, except lines starting with '@', which are
+ * published to it as MQTT messages: "@topic payload".  A "\n" in the
+ * payload becomes a line break, for multi-line payloads.  Messages are 
+ * published at QoS 1, or QoS 0 if written "@-topic payload".  A line of 
+ * just "@!" delivers the last QoS 1 message again, as a duplicate.  Set 
+ * NATIVE_CLOCK_PPM to make millis() and micros() run that many parts per 
+ * million fast (or slow, if negative), like a real crystal.  Tests can 
+ * take the clock over with nativeClockManual() and nativeClockAdvance().
+ */
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <chrono>
+#include <thread>
+#include <deque>
+
+void setup();
+void loop();
+
+nativeHalCounters nativeHal;
+HardwareSerial Serial;
+EspClass ESP;
+
+static const auto bootTime=std::chrono::steady_clock::now();
+static std::deque<uint8_t> serialInput;
+static std::deque<std::string> serialLines;
+static std::string stdinLine;
+static bool stdinEof=false;
+static unsigned long stdinEofAt=0;
+
+extern PubSubClient *nativeBroker; //the client that receives injected messages
+
+static bool clockIsManual=false;
+static long long manualMicros=0;  //true time since boot while the clock is manual
+static double clockRate=1.0+(getenv("NATIVE_CLOCK_PPM")?atof(getenv("NATIVE_CLOCK_PPM")):0.0)/1e6;
+static long long rateSetAt=0;     //true time when the rate last changed...
+static long long clockAtRateSet=0;//...and what the clock read then, so it doesn't jump
+
+static long long trueMicros()
+  {
+  if (clockIsManual)
+    return manualMicros;
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-bootTime).count();
+  }
+
+static long long clockMicros()
+  {
+  return clockAtRateSet+(long long)((trueMicros()-rateSetAt)*clockRate);
+  }
+
+void nativeClockManual(double ppm)
+  {
+  clockAtRateSet=clockMicros();
+  manualMicros=trueMicros();
+  rateSetAt=manualMicros;
+  clockIsManual=true;
+  clockRate=1.0+ppm/1e6;
+  }
+
+void nativeClockAdvance(unsigned long ms)
+  {
+  manualMicros+=ms*1000LL;
+  }
+
+unsigned long long nativeRealtimeMicros()
+  {
+  static unsigned long long bootRealtime=0; //so the manual clock has a date
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  unsigned long long realtime=now.tv_sec*1000000ULL+now.tv_nsec/1000;
+  if (bootRealtime==0)
+    bootRealtime=realtime-trueMicros();
+  return clockIsManual?bootRealtime+manualMicros:realtime;
+  }
+
+unsigned long millis()
+  {
+  return clockMicros()/1000;
+  }
+
+unsigned long micros()
+  {
+  return clockMicros();
+  }
+
+void delay(unsigned long ms)
+  {
+  nativeHal.delays++;
+  nativeHal.delayMs+=ms;
+  if (clockIsManual)
+    nativeClockAdvance(ms);
+  else
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+  }
+
+void delayMicroseconds(unsigned int us)
+  {
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+  }
+
+void yield()
+  {
+  }
+
+void pinMode(uint8_t pin, uint8_t mode)
+  {
+  (void)pin;
+  (void)mode;
+  }
+
+void digitalWrite(uint8_t pin, uint8_t val)
+  {
+  (void)pin;
+  (void)val;
+  nativeHal.digitalWrites++;
+  }
+
+int digitalRead(uint8_t pin)
+  {
+  (void)pin;
+  return LOW;
+  }
+
+long random(long howbig)
+  {
+  return howbig<=0?0:rand()%howbig;
+  }
+
+long random(long howsmall, long howbig)
+  {
+  return howsmall>=howbig?howsmall:howsmall+random(howbig-howsmall);
+  }
+
+void randomSeed(unsigned long seed)
+  {
+  srand(seed);
+  }
+
+/************************
+ * Print and String
+ ************************/
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+  {
+  size_t n=0;
+  while (size--)
+    n+=write(*buffer++);
+  return n;
+  }
+
+size_t Print::print(const String &s)
+  {
+  return write(s.c_str(), s.length());
+  }
+
+size_t Print::print(long n, int base)
+  {
+  if (n<0 && base==DEC)
+    return print('-')+print((unsigned long)-n, base);
+  return print((unsigned long)n, base);
+  }
+
+size_t Print::print(unsigned long n, int base)
+  {
+  return print(String(n, base));
+  }
+
+size_t Print::print(double n, int digits)
+  {
+  char buf[40];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return write(buf);
+  }
+
+size_t Print::printf(const char *format, ...)
+  {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  int len=vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len<0)
+    return 0;
+  return write((const uint8_t *)buf, (size_t)len<sizeof(buf)?len:sizeof(buf)-1);
+  }
+
+void String::replace(const String &find, const String &replace)
+  {
+  if (find.str.empty())
+    return;
+  size_t pos=0;
+  while ((pos=str.find(find.str, pos))!=std::string::npos)
+    {
+    str.replace(pos, find.str.length(), replace.str);
+    pos+=replace.str.length();
+    }
+  }
+
+void String::fromUnsigned(unsigned long n, int base, bool append)
+  {
+  char buf[33];
+  char *p=buf+sizeof(buf)-1;
+  *p='\0';
+  if (base<2)
+    base=10;
+  do
+    {
+    int digit=n%base;
+    *--p=digit<10?'0'+digit:'a'+digit-10;
+    n/=base;
+    } while (n>0);
+  if (append)
+    str+=p;
+  else
+    str=p;
+  }
+
+/************************
+ * Serial port
+ ************************/
+
+// Collect whatever stdin has for us without blocking
+static void pollStdin()
+  {
+  while (!stdinEof)
+    {
+    struct pollfd pfd={0, POLLIN, 0};
+    if (poll(&pfd, 1, 0)<=0)
+      break;
+    char c;
+    ssize_t n=::read(0, &c, 1);
+    if (n<=0)
+      {
+      stdinEof=true;
+      stdinEofAt=millis();
+      break;
+      }
+    stdinLine+=c;
+    if (c=='\n')
+      {
+      if (stdinLine.compare(0, 2, "@!")==0)
+        {
+        if (nativeBroker!=NULL)
+          nativeBroker->redeliver();
+        }
+      else if (stdinLine[0]=='@')
+        {
+        uint8_t qos=stdinLine[1]=='-'?0:1;
+        std::string msg=stdinLine.substr(2-qos, stdinLine.find_last_not_of("\r\n")-(1-qos));
+        size_t space=msg.find(' ');
+        std::string topic=msg.substr(0, space);
+        std::string payload=space==std::string::npos?"":msg.substr(space+1);
+        for (size_t at=payload.find("\\n"); at!=std::string::npos; at=payload.find("\\n", at+1))
+          payload.replace(at, 2, "\n");
+        if (nativeBroker!=NULL)
+          nativeBroker->inject(topic.c_str(), payload.c_str(), qos);
+        }
+      else
+        serialLines.push_back(stdinLine);
+      stdinLine.clear();
+      }
+    }
+  }
+
+int HardwareSerial::available()
+  {
+  return serialInput.size();
+  }
+
+int HardwareSerial::read()
+  {
+  if (serialInput.empty())
+    return -1;
+  int c=serialInput.front();
+  serialInput.pop_front();
+  return c;
+  }
+
+size_t HardwareSerial::write(uint8_t c)
+  {
+  nativeHal.serialBytesOut++;
+  fputc(c, stdout);
+  return 1;
+  }
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+  {
+  nativeHal.serialBytesOut+=size;
+  return fwrite(buffer, 1, size, stdout);
+  }
+
+/************************
+ * ESP object
+ ************************/
+
+void EspClass::restart()
+  {
+  nativeHal.restarts++;
+  Serial.println("\n[native] ESP.restart() called, exiting.");
+  nativeHalReport();
+  exit(0);
+  }
+
+uint32_t EspClass::getFreeHeap()
+  {
+  return 40000;
+  }
+
+// The host heap is nothing like the ESP8266's, so these are only plausible
+// numbers for the reports
+uint32_t EspClass::getMaxFreeBlockSize()
+  {
+  return 36000;
+  }
+
+uint8_t EspClass::getHeapFragmentation()
+  {
+  return 10;
+  }
+
+/************************
+ * Program entry
+ ************************/
+
+// Serial input is released one line per loop() pass, the way a person
+// typing (or a terminal pasting at 115200 baud) would deliver it.
+void nativeHalPoll()
+  {
+  pollStdin();
+  if (serialInput.empty() && !serialLines.empty())
+    {
+    serialInput.insert(serialInput.end(), serialLines.front().begin(), serialLines.front().end());
+    serialLines.pop_front();
+    }
+  }
+
+bool nativeHalFinished()
+  {
+  unsigned long linger=getenv("NATIVE_LINGER_MS")?strtoul(getenv("NATIVE_LINGER_MS"), NULL, 10):2000;
+  return stdinEof && serialInput.empty() && serialLines.empty() && millis()-stdinEofAt>=linger;
+  }
+
+#ifndef PIO_UNIT_TESTING //the tests have their own
+int main()
+  {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  nativeHalPoll();
+  setup();
+  stdinEofAt=millis(); //linger is measured from the end of setup() at the earliest
+  while (!nativeHalFinished())
+    {
+    loop();
+    nativeHalPoll();
+    }
+  nativeHalReport();
+  return 0;
+  }
+#endif
@@ -0,0 +1,71 @@
+/*
+ * Host stand-in for PubSubClient.  It plays the part of both the client
+ * and the broker: messages injected from the native main (stdin lines
+ * starting with '@') are delivered to the callback if they match a
+ * subscription, laid out in the receive buffer the same way the real
+ * library does it.  Publishes are counted and echoed when NATIVE_VERBOSE
+ * is set.  NATIVE_MQTT_FAIL makes every connect fail, and 
+ * NATIVE_MQTT_FAIL_CONNECTS=<n> only the first n.
+ */
+#ifndef NATIVE_HAL_PUBSUBCLIENT_H
+#define NATIVE_HAL_PUBSUBCLIENT_H
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+#define MQTT_MAX_PACKET_SIZE 256
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+#define MQTT_CONNECTION_TIMEOUT     -4
+#define MQTT_CONNECTION_LOST        -3
+#define MQTT_CONNECT_FAILED         -2
+#define MQTT_DISCONNECTED           -1
+#define MQTT_CONNECTED               0
+
+class PubSubClient : public Print
+  {
+  public:
+    PubSubClient(Client &client);
+    ~PubSubClient();
+    PubSubClient &setServer(const char *domain, uint16_t port) { (void)domain; (void)port; return *this; }
+    PubSubClient &setCallback(MQTT_CALLBACK_SIGNATURE);
+    bool setBufferSize(uint16_t size);
+    uint16_t getBufferSize() { return bufferSize; }
+
+    bool connect(const char *id, const char *user, const char *pass, const char *willTopic,
+                 uint8_t willQos, bool willRetain, const char *willMessage, bool cleanSession=true);
+    void disconnect();
+    bool connected() { return isConnected; }
+    int state() { return isConnected?MQTT_CONNECTED:MQTT_DISCONNECTED; }
+
+    bool publish(const char *topic, const char *payload, bool retained=false);
+    bool publish(const char *topic, const uint8_t *payload, unsigned int plength, bool retained=false);
+    bool beginPublish(const char *topic, unsigned int plength, bool retained);
+    int endPublish();
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+
+    bool subscribe(const char *topic, uint8_t qos=0);
+    bool unsubscribe(const char *topic);
+    bool loop();
+
+    // broker side of the stand-in
+    void inject(const char *topic, const char *payload, uint8_t qos=1);
+    void redeliver();
+    unsigned long connects=0;
+    unsigned long publishes=0;
+    unsigned long publishedBytes=0;
+    unsigned long subscribes=0;
+    unsigned long unsubscribes=0;
+    unsigned long delivered=0;
+    unsigned long dropped=0;
+  private:
+    bool isSubscribed(const char *topic);
+    MQTT_CALLBACK_SIGNATURE;
+    uint8_t *buffer=NULL;
+    uint16_t bufferSize=0;
+    bool isConnected=false;
+    unsigned int streamRemaining=0;
+    uint16_t nextMsgId=1;
+  };
+#endif
@@ -0,0 +1,19 @@
+#ifndef NATIVE_HAL_SOFTWARESERIAL_H
+#define NATIVE_HAL_SOFTWARESERIAL_H
+#include <Arduino.h>
+
+// Stand-in for the bit-banged serial port to the MP3 player
+class SoftwareSerial : public Stream
+  {
+  public:
+    SoftwareSerial(int8_t rxPin, int8_t txPin) { (void)rxPin; (void)txPin; }
+    void begin(int32_t baud) { rate=baud; }
+    int32_t baudRate() { return rate; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    size_t write(uint8_t) override { return 1; }
+    using Print::write;
+  private:
+    int32_t rate=0;
+  };
+#endif
@@ -0,0 +1,28 @@
+#ifndef NATIVE_HAL_TIMELIB_H
+#define NATIVE_HAL_TIMELIB_H
+#include <Arduino.h>
+#include <time.h>
+
+typedef unsigned long time_t_compat;
+
+typedef struct
+  {
+  uint8_t Second;
+  uint8_t Minute;
+  uint8_t Hour;
+  uint8_t Wday;   // day of week, sunday is day 1
+  uint8_t Day;
+  uint8_t Month;
+  uint8_t Year;   // offset from 1970
+  } tmElements_t;
+
+void breakTime(unsigned long timeInput, tmElements_t &tm);
+unsigned long makeTime(const tmElements_t &tm);
+int hour(unsigned long t);
+int minute(unsigned long t);
+int second(unsigned long t);
+int day(unsigned long t);
+int weekday(unsigned long t);
+int month(unsigned long t);
+int year(unsigned long t);
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Host stand-in for a UDP socket.  Nothing goes out on the network; instead
+ * packets sent to port 123 are answered by a pretend NTP server that reads
+ * the host's clock, or the true time of the manual clock in the tests.  The
+ * answer arrives NATIVE_NTP_DELAY_MS milliseconds (default 20) after the
+ * request.  Set NATIVE_NTP_ANSWERS=<n> to have the server stop answering
+ * after n requests, 0 for an outage from the start.
+ */
+#ifndef NATIVE_HAL_WIFIUDP_H
+#define NATIVE_HAL_WIFIUDP_H
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <deque>
+#include <vector>
+
+class UDP : public Stream
+  {
+  };
+
+class WiFiUDP : public UDP
+  {
+  public:
+    uint8_t begin(uint16_t) { return 1; }
+    void stop() { replies.clear(); incoming.clear(); }
+    int beginPacket(const char *host, uint16_t port);
+    int endPacket();
+    int parsePacket();
+    int available() override { return incoming.size()-readPosition; }
+    int read() override;
+    int read(unsigned char *buffer, size_t size);
+    size_t write(uint8_t c) override { outgoing.push_back(c); return 1; }
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+
+    static unsigned long ntpRequests;
+    static unsigned long ntpAnswers;
+  private:
+    typedef struct
+      {
+      unsigned long due; //millis()
+      std::vector<uint8_t> data;
+      } reply;
+    std::vector<uint8_t> outgoing;
+    uint16_t outgoingPort=0;
+    std::deque<reply> replies;
+    std::vector<uint8_t> incoming;
+    size_t readPosition=0;
+  };
+#endif
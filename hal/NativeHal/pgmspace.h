@@ -0,0 +1,9 @@
+// Host stand-in: program memory is ordinary memory on Linux.
+#ifndef NATIVE_HAL_PGMSPACE_H
+#define NATIVE_HAL_PGMSPACE_H
+#include <string.h>
+#define pgm_read_byte(addr) (*(const unsigned char *)(addr))
+#define strcpy_P strcpy
+#define strlen_P strlen
+#define memcpy_P memcpy
+#endif
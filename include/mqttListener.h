@@ -10,7 +10,21 @@
 #define FLASHLED_ON HIGH
 #define FLASHLED_OFF LOW
 #define WIFI_CONNECTION_ATTEMPTS 150
-#define VALID_SETTINGS_FLAG 0xDAB0
+#define WIFI_CHECK_MS 500            //time between checks while connecting to wifi
+#define MQTT_RETRY_MS 1000           //time between MQTT connection attempts, doubled after each failure...
+#define MQTT_RETRY_MAX_MS 60000      //...up to this
+#define BOOT_STEP_MS 10              //time between startup steps
+#define BOOT_PLAYER_RETRY_MS 2000    //wait before trying the mp3 player again
+#define MAX_TASKS 12                 //room in the task scheduler
+#define FIRMWARE_VERSION "2.0.0"     //reported in the telemetry
+#define VALID_SETTINGS_FLAG 0xDAB2 //settings are complete, and the flag of the last fixed layout in EEPROM
+#define RULE_TABLE_SETTINGS_FLAG 0xDAB1 //settings from before rate limits, the same but without the rate table
+#define TLV_SETTINGS_FLAG 0xDAC0     //settings stored as tag-length-value records
+#define SETTINGS_VERSION 1           //schema of the records, for when a tag has to change meaning
+#define SETTINGS_STORE_SIZE 4096     //bytes of EEPROM, the most the ESP8266 emulation allows
+#define SETTINGS_COMMIT_MS 1000      //changes are written to flash once none have come for this long
+#define SETTINGS_ALL 0xFF            //for saveSettings() when everything may have changed
+#define LEGACY_SETTINGS_FLAG 0xDAB0 //settings from before the rule table, four fixed topics
 #define SSID_SIZE 100
 #define PASSWORD_SIZE 50
 #define ADDRESS_SIZE 30
@@ -19,36 +33,168 @@
 #define MQTT_CLIENTID_SIZE 25
 #define DEFAULT_MQTT_BROKER_PORT 1883
 #define MQTT_MAX_TOPIC_SIZE 100
-#define MQTT_MAX_MESSAGE_SIZE 15
+#define MQTT_MAX_MESSAGE_SIZE 63    //longest rule message, with room for globs and ranges
+#define JSON_PATH_SIZE 15          //longest JSON field name, or dotted path of them
+#define MQTT_MAX_COMMAND_SIZE 127  //longest command accepted on the command topic
 #define HISTORY_BUFFER_SIZE 30
+#define HISTORY_DIR "/history"          //where the history log's segment files are kept
+#define HISTORY_SEGMENTS 16             //segment files kept, the oldest is deleted to make room
+#define HISTORY_SEGMENT_RECORDS 512     //8 byte records per segment file
+#define HISTORY_RECORD_MARK 0xA5        //records without this were torn by a power failure
+#define HISTORY_QUERY_MAX 200           //most records sent in reply to a date range query
+#define HISTORY_PENDING 16              //alerts held for the log until the clock is set
+#define MAX_RULES 32        //topic/message rules, no more than 32. How many fit in EEPROM depends on their length
+#define RULE_HASH_SLOTS 32  //buckets in the payload hash, must be a power of 2
 #define DEFAULT_MQTT_TOPIC "esp8266/mqttListener"
 #define MQTT_CLIENT_ID_ROOT "mqttListener"
 #define MQTT_TOPIC_RSSI "rssi"
 #define MQTT_TOPIC_STATUS "status"
+#define MQTT_TOPIC_TELEMETRY "telemetry"
+#define TELEMETRY_MS 300000      //how often the telemetry is published
+#define PROFILE_BUDGET_US 20000 //a section of loop() taking longer than this is a stall...
+#define PROFILE_QUICK_BUDGET_US 5000 //...or this for the sections that should never wait on anything
+#define LATENCY_BUCKETS 24       //bucket n counts times from 2^n to 2^(n+1)-1 microseconds, the last one everything longer
 #define DISPLAY_ROWS 2
 #define DISPLAY_COLUMNS 16
+#define LCD_FLUSH_MS 20          //how often changes to the display are sent to the LCD
+#define LCD_FLUSH_MAX_CHARS 16   //most characters sent to the LCD in one flush
 #define DEFAULT_MQTT_LWT_MESSAGE "disconnected"
 #define MQTT_TOPIC_COMMAND_REQUEST "command"
 #define DEFAULT_GMT_OFFSET -6
-#define REPEAT_LIMIT_MS 10000  //won't process repeated messages unless this much time between them
+#define NTP_SERVER "pool.ntp.org"
+#define NTP_PORT 123
+#define NTP_LOCAL_PORT 2390      //where the answers come back to
+#define NTP_PACKET_SIZE 48
+#define NTP_REFRESH_MS 43200000  //time between syncs once we have the time
+#define NTP_POLL_MS 10           //how often to look for the answer
+#define NTP_TIMEOUT_MS 2000      //give up on an answer after this long
+#define NTP_RETRY_MIN_MS 4000    //wait after the first failure, doubled for each one after...
+#define NTP_RETRY_MAX_MS 3600000 //...up to this
+#define NTP_DRIFT_MIN_MS 60000   //syncs closer together than this are too short to measure drift
+#define NTP_MAX_DRIFT_PPM 2000   //no crystal is this bad, so more than this is a bad measurement
+#define NTP_REBASE_MS 3600000    //fold the elapsed time into the base this often, before millis() can roll over
+#define CLOCK_TICK_MARGIN_MS 10  //the clock ticks this long after each second starts, more than drift can move it in a second
+#define REPEAT_LIMIT_MS 10000  //won't process repeated QoS 0 messages unless this much time between them
+#define MQTT_SUBSCRIBE_QOS 1   //at least once, so alerts aren't lost
+#define RECENT_PACKET_IDS 16   //QoS 1 messages remembered to catch redeliveries
+#define REDELIVERY_HASH_BYTES 32 //of a payload, with its length, are enough to tell a redelivery
 #define DEFAULT_VOLUME 10 //all the way up
-#define MQTT_BUFFER_SIZE (5+(DISPLAY_COLUMNS*DISPLAY_ROWS)+1)*HISTORY_BUFFER_SIZE
+#define PLAY_QUEUE_SIZE 8       //alerts waiting for the mp3 player
+#define PLAY_MIN_MS 500         //end-of-play reports sooner than this after starting are stale
+#define PLAY_TIMEOUT_MS 30000   //stop waiting for the end of a track after this long
+#define MQTT_CHUNK_SIZE 64 //replies are streamed to the broker this many bytes at a time
+#define MQTT_BUFFER_SIZE 1024 //largest incoming message, a batch of settings needs the room
+#define BATCH_ACK_SIZE 200    //reply to a batch of settings, the list of keys is cut short to fit
+#define SERIAL_RING_SIZE 256  //bytes from the serial port waiting to be made into lines, a power of 2
+#define SERIAL_BATCH_SIZE 1024 //a batch of settings pasted into the serial port
+#define SUBSCRIPTION_POOL_SIZE 1024 //text of the topics we're subscribed to
+#define TOPIC_TRIE_MAX_NODES 48    //one node per distinct topic segment across all filters
+#define TOPIC_TRIE_POOL_SIZE 400   //text of the distinct segments, not null terminated
+#define BENCHMARK_ITERATIONS 10000 //for the "benchmark" command
+#define SETTING_HASH_BITS 6        //the setting name hash table has 2^this slots
 
 //prototypes
 void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length);
+boolean payloadIs(const char* payload, unsigned int length, const char* text);
+boolean appendBounded(char* buffer, size_t size, size_t* used, const char* text, size_t length);
+void writeHistory(Print& out);
+void writeHistoryRange(Print& out);
+boolean setHistoryRange(const char* range);
+boolean historyStoreBegin();
+boolean appendHistoryRecord(uint8 ruleNumber, unsigned long timestamp);
+void writePendingRecords();
+void writeSettings(Print& out);
+size_t settingsLength();
+size_t settingsDump(Print* out);
+void writeStatus(Print& out);
+void writeRestarting(Print& out);
+boolean publishStream(const char* topic, void (*writer)(Print&), boolean retain, size_t (*measure)()=NULL);
+boolean queueTrack(uint8 track, unsigned long arrivedMicros);
+void servicePlayer();
+void adjustVolume(int volume);
+boolean compileTopicTrie();
+void compilePayloadIndex();
+uint32 matchTopic(const char* topic);
+int findRule(const char* topic, const char* payload, unsigned int length);
+void readFixedConnection();
+void readFixedSettings(boolean withRates);
+void migrateLegacySettings();
+boolean settingsAreSane();
+void setSettingDefaults(boolean everything);
+boolean ruleAllows(int ruleNumber, boolean debounce);
+uint16 packetId(const char* topic, const byte* payload);
+boolean isRedelivery(uint16 id, const char* topic, const char* message, unsigned int length);
+void writeRuleCounts(Print& out);
+void benchmarkTopicMatch(const char* topic);
+void benchmarkPayloadMatch(const char* payload);
+uint32 matchPayload(uint32 candidates, const char* payload, unsigned int length);
+boolean parseThousandths(const char* text, unsigned int length, long long* value);
+boolean parseWholeNumber(const char* value, long long* number);
 unsigned long myMillis();
-bool processCommand(String cmd);
+unsigned long long utcMillis();
+unsigned long localTime();
+void ntpTask();
+void requestTimeSync();
+void writeTimeStatus(Print& out);
+boolean updateClock();
+void clockTask();
+void scheduleClockTick();
+void sampleHeap();
+void writeHeapStatus(Print& out);
+bool processCommand(char* cmd);
+void subscriptionsChanged(int ruleNumber);
+void clockChanged(int ruleNumber);
+void volumeChanged(int ruleNumber);
+void rateChanged(int ruleNumber);
+boolean resetMqttIdAction(const char* value);
+boolean historyAction(const char* value);
+boolean timeAction(const char* value);
+boolean profileAction(const char* value);
+boolean benchmarkAction(const char* value);
+boolean benchmarkPayloadAction(const char* value);
+boolean factoryDefaultsAction(const char* value);
+boolean resetAction(const char* value);
 void checkForCommand();
+void serialCommand(char* line);
+boolean readSerialLine();
 bool connectToWiFi();
 void showSettings();
 void mqttReconnect(); 
+uint32 mqttJitter(unsigned long range);
+void writeMqttStatus(Print& out);
 void showSub(char* topic, bool subgood);
+const char* ruleSubscription(int ruleNumber);
+uint32 subscriptionSetHash();
+uint32 sessionTopics();
+void rememberSessionTopics(uint32 hash);
+boolean subscriptionsSyncInPlace();
+void syncSubscriptions();
+int latencyBucket(unsigned long micros);
+void recordLatency(int stage, unsigned long micros);
+void writeTelemetry(Print& out);
+void telemetryTask();
+unsigned long profileSection(int section, unsigned long start);
+void writeProfile(Print& out);
+void resetProfile();
 void initializeSettings();
 void loadSettings();
-bool saveSettings();
+bool saveSettings(uint8 changed=SETTINGS_ALL, int ruleNumber=-1);
+boolean settingsComplete();
+boolean readSettings();
+void commitSettings();
+boolean revertSettings();
+boolean applyBatch(const char* lines, unsigned int length);
+void writeBatchAck(Print& out);
 void incomingData(); 
 void setup(); 
 void loop();
+void bootTask();
+void wifiTask();
+boolean scheduleTask(void (*function)(), unsigned long interval, boolean repeat);
+void cancelTask(void (*function)());
+void runTasks();
+void flushDisplay();
+void requestRestart(unsigned long ms);
 
 
 // int notePitchHz[12][9]={
@@ -12,13 +12,14 @@
  */ 
 #include <Arduino.h>
 #include <string.h>
+#include <errno.h>
 #include <PubSubClient.h> 
 #include <EEPROM.h>
+#include <LittleFS.h>
 #include <pgmspace.h>
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
 #include <LiquidCrystal.h>
-#include <NTPClient.h>
 #include <TimeLib.h>
 #include "SoftwareSerial.h"
 #include "DFRobotDFPlayerMini.h"
@@ -35,10 +36,48 @@ char *stack_start;// initial stack size
 WiFiClient wifiClient;
 PubSubClient mqttClient(wifiClient);
 
+//Reconnecting to the broker.  After each failed attempt the wait doubles, up 
+//to a limit, and each device picks its own point in the second half of it so
+//that a whole fleet doesn't come back to a restarted broker at the same moment.
+boolean mqttWasConnected=false;
+unsigned long mqttLastAttempt=0;   //millis()
+unsigned long mqttWait=0;          //from the last attempt to the next one
+unsigned long mqttAttempts=0;
+unsigned long mqttConnects=0;
+unsigned long mqttDisconnects=0;   //connections lost or dropped
+unsigned int mqttFailuresInRow=0;
+int mqttLastState=MQTT_CONNECTED;  //the client's state() after the last failure
+unsigned long mqttConnectedAt=0;   //millis()
+uint32 mqttJitterState=0;
+char mqttServer[ADDRESS_SIZE+1]="";
+uint16 mqttServerPort=0;
+
 LiquidCrystal lcd(D0,D1,D2,D5,D6,D7); //RS, Enable, Data4, Data5, Data6, Data7 on display
 
-// These are the settings that get stored in EEPROM.  They are all in one struct which
-// makes it easier to store and retrieve.
+// A rule says what to do when a message arrives: if the topic matches the topic
+// filter and the payload matches the message, show the description on the LCD and
+// play the track.  QoS 0 repeats of the same rule within the debounce time of the 
+// last alert are ignored, as are any beyond the rule's rate limit.
+typedef struct
+  {
+  char topic[MQTT_MAX_TOPIC_SIZE+1]="";
+  char message[MQTT_MAX_MESSAGE_SIZE+1]="";   //exact payload, or "*" for any payload
+  char description[DISPLAY_COLUMNS+1]="";     //for the LCD
+  uint8 track=0;                              //mp3 file number, 0 means use the rule number
+  unsigned long debounceMs=REPEAT_LIMIT_MS;
+  } rule;
+
+// A token bucket rate limit for a rule: no more than count alerts in any period of
+// seconds.  A count of 0 means no limit.
+typedef struct
+  {
+  uint8 count=0;
+  uint16 seconds=0;
+  } rateLimit;
+
+// These are the settings.  They are all in one struct which makes them easier to
+// pass around.  They are stored as tag-length-value records, so the struct is free
+// to change; the fixed layouts it used to be written in are frozen further down.
 typedef struct 
   {
   unsigned int validConfig=0; 
@@ -48,32 +87,366 @@ typedef struct
   int brokerPort=DEFAULT_MQTT_BROKER_PORT;
   char mqttUsername[USERNAME_SIZE+1]="";
   char mqttUserPassword[PASSWORD_SIZE+1]="";
-  char mqttTopic1[MQTT_MAX_TOPIC_SIZE+1]="";
-  char mqttTopic2[MQTT_MAX_TOPIC_SIZE+1]="";
-  char mqttTopic3[MQTT_MAX_TOPIC_SIZE+1]="";
-  char mqttTopic4[MQTT_MAX_TOPIC_SIZE+1]="";
-  char mqttMessage1[MQTT_MAX_MESSAGE_SIZE+1]="";
-  char mqttMessage2[MQTT_MAX_MESSAGE_SIZE+1]="";
-  char mqttMessage3[MQTT_MAX_MESSAGE_SIZE+1]="";
-  char mqttMessage4[MQTT_MAX_MESSAGE_SIZE+1]="";
-  char description1[DISPLAY_COLUMNS+1]=""; //for the LCD
-  char description2[DISPLAY_COLUMNS+1]="";
-  char description3[DISPLAY_COLUMNS+1]="";
-  char description4[DISPLAY_COLUMNS+1]="";
   char mqttLWTMessage[MQTT_MAX_MESSAGE_SIZE+1]="";
   char commandTopic[MQTT_MAX_TOPIC_SIZE+1]=DEFAULT_MQTT_TOPIC;
   boolean debug=false;
   char mqttClientId[MQTT_CLIENTID_SIZE+1]=""; //will be the same across reboots
   int gmtOffset=0; // -6 for CST
   int volume=DEFAULT_VOLUME;
+  rule rules[MAX_RULES];
+  rateLimit rates[MAX_RULES];   //after the rules so settings saved without it still load
+  char jsonPaths[MAX_RULES][JSON_PATH_SIZE+1]; //newer than any fixed layout, so it isn't in them
   } conf;
+static_assert(MAX_RULES<=32,"rules are kept in 32 bit masks");
+
+// The settings are stored in EEPROM as a header followed by tag-length-value
+// records: a tag byte, a rule index byte (0 for settings that aren't part of a
+// rule), a length byte and the value.  Empty strings and rules that aren't in use
+// aren't stored at all.  Unknown tags are skipped and missing ones keep their
+// defaults, so settings survive a firmware update that adds or drops some.
+// Tags must never be renumbered.
+enum settingTags
+  {
+  TAG_END=0,
+  TAG_SSID=1,
+  TAG_WIFI_PASSWORD=2,
+  TAG_BROKER_ADDRESS=3,
+  TAG_BROKER_PORT=4,
+  TAG_MQTT_USERNAME=5,
+  TAG_MQTT_PASSWORD=6,
+  TAG_LWT_MESSAGE=7,
+  TAG_COMMAND_TOPIC=8,
+  TAG_DEBUG=9,
+  TAG_CLIENT_ID=10,
+  TAG_GMT_OFFSET=11,
+  TAG_VOLUME=12,
+  TAG_RULE_TOPIC=32,
+  TAG_RULE_MESSAGE=33,
+  TAG_RULE_DESCRIPTION=34,
+  TAG_RULE_TRACK=35,
+  TAG_RULE_DEBOUNCE=36,
+  TAG_RULE_RATE=37,
+  TAG_RULE_JSON=38
+  };
+
+typedef struct
+  {
+  uint16 flag;        //TLV_SETTINGS_FLAG
+  uint8 version;      //SETTINGS_VERSION when written
+  uint8 reserved;
+  uint32 generation;  //goes up by one with every commit
+  uint16 length;      //bytes of records that follow the header
+  uint16 checksum;    //Fletcher-16 of the records
+  } settingsHeader;
+
+// The last bytes of the sector hold a hash of the topics that the broker's
+// session for us is subscribed to.  It isn't a setting: it is kept apart from
+// the records so that it never takes a commit or a generation of its own.
+typedef struct
+  {
+  uint16 flag;        //SESSION_RECORD_FLAG
+  uint16 reserved;
+  uint32 topics;      //from subscriptionSetHash()
+  } sessionRecord;
+#define SESSION_RECORD_FLAG 0x5E55
+#define SETTINGS_RECORDS_END (SETTINGS_STORE_SIZE-(int)sizeof(sessionRecord))
+
+#define TLV_RECORD_OVERHEAD 3
+
+// The fixed EEPROM layouts from before the tag-length-value store, with the
+// sizes they were written with.  They are only read, by readFixedSettings(),
+// to bring the settings forward when a device is updated, so they never change.
+#define FIXED_SSID_SIZE 100
+#define FIXED_PASSWORD_SIZE 50
+#define FIXED_ADDRESS_SIZE 30
+#define FIXED_USERNAME_SIZE 50
+#define FIXED_CLIENTID_SIZE 25
+#define FIXED_TOPIC_SIZE 100
+#define FIXED_MESSAGE_SIZE 15
+#define FIXED_DESCRIPTION_SIZE 16
+#define FIXED_RULES 20
+
+// Before there was a rule table, LEGACY_SETTINGS_FLAG
+typedef struct
+  {
+  unsigned int validConfig;
+  char ssid[FIXED_SSID_SIZE+1];
+  char wifiPassword[FIXED_PASSWORD_SIZE+1];
+  char brokerAddress[FIXED_ADDRESS_SIZE+1];
+  int brokerPort;
+  char mqttUsername[FIXED_USERNAME_SIZE+1];
+  char mqttUserPassword[FIXED_PASSWORD_SIZE+1];
+  char mqttTopic1[FIXED_TOPIC_SIZE+1];
+  char mqttTopic2[FIXED_TOPIC_SIZE+1];
+  char mqttTopic3[FIXED_TOPIC_SIZE+1];
+  char mqttTopic4[FIXED_TOPIC_SIZE+1];
+  char mqttMessage1[FIXED_MESSAGE_SIZE+1];
+  char mqttMessage2[FIXED_MESSAGE_SIZE+1];
+  char mqttMessage3[FIXED_MESSAGE_SIZE+1];
+  char mqttMessage4[FIXED_MESSAGE_SIZE+1];
+  char description1[FIXED_DESCRIPTION_SIZE+1];
+  char description2[FIXED_DESCRIPTION_SIZE+1];
+  char description3[FIXED_DESCRIPTION_SIZE+1];
+  char description4[FIXED_DESCRIPTION_SIZE+1];
+  char mqttLWTMessage[FIXED_MESSAGE_SIZE+1];
+  char commandTopic[FIXED_TOPIC_SIZE+1];
+  boolean debug;
+  char mqttClientId[FIXED_CLIENTID_SIZE+1];
+  int gmtOffset;
+  int volume;
+  } legacyConf;
+
+// The rule table, RULE_TABLE_SETTINGS_FLAG, and then with rate limits after it,
+// VALID_SETTINGS_FLAG
+typedef struct
+  {
+  char topic[FIXED_TOPIC_SIZE+1];
+  char message[FIXED_MESSAGE_SIZE+1];
+  char description[FIXED_DESCRIPTION_SIZE+1];
+  uint8 track;
+  unsigned long debounceMs;
+  } fixedRule;
+
+typedef struct
+  {
+  uint8 count;
+  uint16 seconds;
+  } fixedRate;
+
+typedef struct
+  {
+  unsigned int validConfig;
+  char ssid[FIXED_SSID_SIZE+1];
+  char wifiPassword[FIXED_PASSWORD_SIZE+1];
+  char brokerAddress[FIXED_ADDRESS_SIZE+1];
+  int brokerPort;
+  char mqttUsername[FIXED_USERNAME_SIZE+1];
+  char mqttUserPassword[FIXED_PASSWORD_SIZE+1];
+  char mqttLWTMessage[FIXED_MESSAGE_SIZE+1];
+  char commandTopic[FIXED_TOPIC_SIZE+1];
+  boolean debug;
+  char mqttClientId[FIXED_CLIENTID_SIZE+1];
+  int gmtOffset;
+  int volume;
+  fixedRule rules[FIXED_RULES];
+  fixedRate rates[FIXED_RULES]; //not in the RULE_TABLE_SETTINGS_FLAG layout
+  } fixedConf;
+static_assert(offsetof(legacyConf,mqttUserPassword)==offsetof(fixedConf,mqttUserPassword),
+              "the fixed layouts start the same");
 
 conf settings; //all settings in one struct makes it easier to store in EEPROM
 boolean settingsAreValid=false;
+uint32 settingsGeneration=0;  //of the settings last committed to EEPROM
+uint32 dirtySettings=0;       //bit n set means tag n changed since the last commit
+uint32 dirtyRules=0;          //bit n set means rule n changed since the last commit
+boolean unknownCommand=false; //set by processCommand() when it doesn't know the name
+boolean strictValues=false;   //set while a batch is applied, so bad values are refused...
+boolean badValue=false;       //...and processCommand() sets this when one is
+int refusedRule=-1;           //set by commitSettings() when a rule wouldn't fit in EEPROM
+
+// Everything processCommand() knows how to do, in one table.  A setting names a
+// field in the settings, or in each rule for the ones that are followed by a rule
+// number ("topic3"), along with its limits, default and help text.  An action is
+// a command that does something instead.  The settings reply, the help, the
+// defaults, the EEPROM records and the checks in saveSettings() and at startup
+// are all worked out from this table, in its order.
+enum settingTypes {SETTING_TEXT, SETTING_NUMBER, SETTING_BOOL, SETTING_RATE, SETTING_ACTION};
+#define SETTING_RULE 0x01       //one for each rule, the name is followed by the rule number
+#define SETTING_REQUIRED 0x02   //can't run without it
+#define SETTING_RESTART 0x04    //takes effect after a restart
+#define SETTING_CONFIRM 0x08    //an action that has to be given "yes"
+#define SETTING_NOT_IN_BATCH 0x10 //an action, not a setting, so it isn't allowed in a batch
+#define SETTING_RULE_TABLE 0x20 //a rule setting kept in its own array in conf, outside the rule
+typedef struct
+  {
+  const char* name;
+  uint8 type;       //settingTypes
+  uint8 flags;
+  uint8 tag;        //the TLV tag, which is also how saveSettings() is told what changed
+  uint16 offset;    //of the field in conf, or in rule for rule fields, or of the array in conf
+  uint8 size;       //longest text, or bytes in a number
+  long min;         //range of a number
+  long max;
+  long defaultNumber;
+  const char* defaultText;
+  const char* help; //what the value is, or for an action how to use it
+  void (*changed)(int ruleNumber);       //called after the setting is stored, may be NULL
+  boolean (*action)(const char* value);  //does an action, returns true if a restart is needed
+  } settingDescriptor;
+
+#define TEXT_SETTING(name,tag,field,def,flags,help,changed) \
+  {name,SETTING_TEXT,flags,tag,offsetof(conf,field),sizeof(conf::field)-1,0,0,0,def,help,changed,NULL}
+#define NUMBER_SETTING(name,tag,field,min,max,def,flags,help,changed) \
+  {name,SETTING_NUMBER,flags,tag,offsetof(conf,field),sizeof(conf::field),min,max,def,"",help,changed,NULL}
+#define RULE_TEXT_SETTING(name,tag,field,help,changed) \
+  {name,SETTING_TEXT,SETTING_RULE,tag,offsetof(rule,field),sizeof(rule::field)-1,0,0,0,"",help,changed,NULL}
+#define RULE_NUMBER_SETTING(name,tag,field,min,max,def,help) \
+  {name,SETTING_NUMBER,SETTING_RULE,tag,offsetof(rule,field),sizeof(rule::field),min,max,def,"",help,NULL,NULL}
+#define ACTION(name,flags,help,action) {name,SETTING_ACTION,flags,0,0,0,0,0,0,"",help,NULL,action}
+
+constexpr settingDescriptor settingTable[]=
+  {
+  TEXT_SETTING("ssid",TAG_SSID,ssid,"",SETTING_REQUIRED|SETTING_RESTART,"wifi ssid",NULL),
+  TEXT_SETTING("wifipass",TAG_WIFI_PASSWORD,wifiPassword,"",SETTING_REQUIRED|SETTING_RESTART,"wifi password",NULL),
+  TEXT_SETTING("broker",TAG_BROKER_ADDRESS,brokerAddress,"",SETTING_REQUIRED|SETTING_RESTART,
+               "address of MQTT broker",NULL),
+  NUMBER_SETTING("brokerPort",TAG_BROKER_PORT,brokerPort,1,65535,DEFAULT_MQTT_BROKER_PORT,SETTING_RESTART,
+                 "port number MQTT broker",NULL),
+  TEXT_SETTING("userName",TAG_MQTT_USERNAME,mqttUsername,"",SETTING_RESTART,"user ID for MQTT broker",NULL),
+  TEXT_SETTING("userPass",TAG_MQTT_PASSWORD,mqttUserPassword,"",SETTING_RESTART,"user password for MQTT broker",NULL),
+  TEXT_SETTING("lwtMessage",TAG_LWT_MESSAGE,mqttLWTMessage,DEFAULT_MQTT_LWT_MESSAGE,SETTING_REQUIRED|SETTING_RESTART,
+               "status message to send when power is removed",NULL),
+  RULE_TEXT_SETTING("topic",TAG_RULE_TOPIC,topic,"MQTT topic for which to subscribe",subscriptionsChanged),
+  RULE_TEXT_SETTING("message",TAG_RULE_MESSAGE,message,
+                    "a message for the topic, * for any, abc* *abc or a?c* for text, >80 >=80 <80 <=80 or 10..20 "
+                    "for a number",NULL), //rules are recompiled when saved
+  {"json",SETTING_TEXT,SETTING_RULE|SETTING_RULE_TABLE,TAG_RULE_JSON,offsetof(conf,jsonPaths),JSON_PATH_SIZE,0,0,0,"",
+   "a field of a JSON payload to match the message against, like state or update.state",NULL},
+  RULE_TEXT_SETTING("description",TAG_RULE_DESCRIPTION,description,"what to display when the message is received",NULL),
+  RULE_NUMBER_SETTING("track",TAG_RULE_TRACK,track,0,255,0,"mp3 file to play, 0 for the rule number"),
+  RULE_NUMBER_SETTING("debounce",TAG_RULE_DEBOUNCE,debounceMs,0,0x7FFFFFFF,REPEAT_LIMIT_MS,
+                      "milliseconds to ignore QoS 0 repeats"),
+  {"rate",SETTING_RATE,SETTING_RULE|SETTING_RULE_TABLE,TAG_RULE_RATE,offsetof(conf,rates),sizeof(rateLimit),0,0,0,"",
+   "<most alerts>/<seconds>, 0 for no limit",rateChanged,NULL}, //shows the form of the value, so it isn't put in <>
+  NUMBER_SETTING("gmtOffset",TAG_GMT_OFFSET,gmtOffset,-23,23,DEFAULT_GMT_OFFSET,0,"Time offset from GMT",clockChanged),
+  NUMBER_SETTING("volume",TAG_VOLUME,volume,0,10,DEFAULT_VOLUME,0,"Speaker volume 0-10",volumeChanged),
+  {"debug",SETTING_BOOL,0,TAG_DEBUG,offsetof(conf,debug),sizeof(conf::debug),0,1,false,"",
+   "print debug messages to serial port",NULL,NULL},
+  TEXT_SETTING("commandTopic",TAG_COMMAND_TOPIC,commandTopic,DEFAULT_MQTT_TOPIC,SETTING_REQUIRED,
+               "mqtt message for commands to this device",subscriptionsChanged),
+  ACTION("resetmqttid",SETTING_CONFIRM,"\"resetmqttid=yes\" to regenerate the MQTT client ID",resetMqttIdAction),
+  ACTION("factorydefaults",SETTING_CONFIRM|SETTING_NOT_IN_BATCH,"\"factorydefaults=yes\" to reset all settings",
+         factoryDefaultsAction),
+  ACTION("reset",SETTING_CONFIRM|SETTING_NOT_IN_BATCH,"\"reset=yes\" to restart",resetAction),
+  ACTION("benchmark",SETTING_NOT_IN_BATCH,"\"benchmark=<topic>\" to time topic matching",benchmarkAction),
+  ACTION("benchmarkpayload",SETTING_NOT_IN_BATCH,"\"benchmarkpayload=<payload>\" to time payload matching",
+         benchmarkPayloadAction),
+  ACTION("time",SETTING_NOT_IN_BATCH,"\"time\" to see how the clock is doing, \"time=sync\" to sync it now",timeAction),
+  ACTION("profile",SETTING_NOT_IN_BATCH,
+         "\"profile\" to see where the time goes in loop(), \"profile=reset\" to start over",profileAction),
+  ACTION("history",SETTING_NOT_IN_BATCH,"\"history=<yyyy-mm-dd>[,<yyyy-mm-dd>]\" to list alerts from the log",
+         historyAction)
+  };
+constexpr int SETTING_COUNT=sizeof(settingTable)/sizeof(settingTable[0]);
+static_assert(SETTING_COUNT<127,"setting numbers have to fit in the hash table");
+
+// Setting names are looked up with a perfect hash: the compiler tries seeds for
+// an FNV-1a hash until it finds one that gives every name in the table its own
+// slot, so finding a name takes one hash and one string compare.
+constexpr uint32 settingHashStep(uint32 hash, char c)
+  {
+  return (hash^(uint8)c)*16777619UL;
+  }
+
+constexpr uint32 settingHashStart(uint32 seed)
+  {
+  return 2166136261UL^seed;
+  }
+
+constexpr uint32 settingHashSlot(uint32 hash)
+  {
+  return hash>>(32-SETTING_HASH_BITS);
+  }
+
+constexpr uint32 settingNameSlot(const char* name, uint32 seed)
+  {
+  uint32 hash=settingHashStart(seed);
+  while (*name!='\0')
+    hash=settingHashStep(hash,*name++);
+  return settingHashSlot(hash);
+  }
+
+constexpr uint32 findSettingHashSeed()
+  {
+  for (uint32 seed=1;seed<100000;seed++)
+    {
+    bool used[1<<SETTING_HASH_BITS]={};
+    bool collided=false;
+    for (int i=0;i<SETTING_COUNT && !collided;i++)
+      {
+      uint32 slot=settingNameSlot(settingTable[i].name,seed);
+      collided=used[slot];
+      used[slot]=true;
+      }
+    if (!collided)
+      return seed;
+    }
+  return 0;
+  }
+constexpr uint32 settingHashSeed=findSettingHashSeed();
+static_assert(settingHashSeed!=0,"no perfect hash for the setting names, increase SETTING_HASH_BITS");
+
+typedef struct
+  {
+  sint8 setting[1<<SETTING_HASH_BITS]; //index in settingTable, -1 for none
+  } settingHashTable;
+
+constexpr settingHashTable buildSettingHashTable()
+  {
+  settingHashTable table={};
+  for (int i=0;i<(1<<SETTING_HASH_BITS);i++)
+    table.setting[i]=-1;
+  for (int i=0;i<SETTING_COUNT;i++)
+    table.setting[settingNameSlot(settingTable[i].name,settingHashSeed)]=i;
+  return table;
+  }
+constexpr settingHashTable settingSlots=buildSettingHashTable();
+
+// And by TLV tag, for reading them back from EEPROM
+#define SETTING_TAG_SLOTS 64
+typedef struct
+  {
+  sint8 setting[SETTING_TAG_SLOTS]; //index in settingTable, -1 for none
+  } settingTagTable;
+
+constexpr settingTagTable buildSettingTagTable()
+  {
+  settingTagTable table={};
+  for (int i=0;i<SETTING_TAG_SLOTS;i++)
+    table.setting[i]=-1;
+  for (int i=0;i<SETTING_COUNT;i++)
+    {
+    if (settingTable[i].type!=SETTING_ACTION)
+      table.setting[settingTable[i].tag]=i;
+    }
+  return table;
+  }
+constexpr settingTagTable settingsByTag=buildSettingTagTable();
+static_assert(TAG_RULE_JSON<SETTING_TAG_SLOTS,"setting tags have to fit in the tag table");
+
+/// @brief Find a setting or action from its hash, making sure it is the one named
+const settingDescriptor* lookupSetting(uint32 hash, const char* name, size_t length)
+  {
+  int index=settingSlots.setting[settingHashSlot(hash)];
+  if (index<0)
+    return NULL;
+  const settingDescriptor* setting=&settingTable[index];
+  if (strncmp(setting->name,name,length)!=0 || setting->name[length]!='\0')
+    return NULL;
+  return setting;
+  }
+
+/// @brief Find a setting or action by name, which doesn't have to be terminated
+const settingDescriptor* findSetting(const char* name, size_t length)
+  {
+  uint32 hash=settingHashStart(settingHashSeed);
+  for (size_t i=0;i<length;i++)
+    hash=settingHashStep(hash,name[i]);
+  return lookupSetting(hash,name,length);
+  }
+char batchAck[BATCH_ACK_SIZE]=""; //the reply to the last batch of settings
+
+//The topics the broker has been asked to send us, one after another with a null
+//after each.  The command topic is always the first.  Kept so that when the rules
+//change, the subscriptions can be brought up to date without reconnecting.
+char subscriptions[SUBSCRIPTION_POOL_SIZE];
+size_t subscriptionsUsed=0;
+boolean subscriptionsOverflowed=false; //some topics didn't fit, so they can't be dropped
 boolean setupOK=false;
 
-//This structure is for the in-memory message history.  It will vanish when the 
-//device is restarted. For now it only contains the topic number and the date code.
+//This structure is for the in-memory message history.  It is a cache of the newest
+//records in the history log on flash, and is reloaded from there at startup.
+//For now it only contains the rule number and the date code.
 //A future change may be to add the actual topic and message received.
 typedef struct
   {
@@ -84,53 +457,298 @@ histEntry history[HISTORY_BUFFER_SIZE]; //circular buffer for histEntry objects
 uint8 histPointer=0;                    //points to next spot for history entry
 uint16 histEntryCount=0;                //contains the total number of history entries
 
-String commandString = "";     // a String to hold incoming commands from serial
-bool commandComplete = false;  // goes true when enter is pressed
+//The history log on flash is a set of numbered segment files in HISTORY_DIR.
+//Records are only ever appended. When a segment is full a new one is started
+//and the oldest is deleted, so the log keeps moving through the free blocks
+//that LittleFS hands out and no part of the flash is written more than another.
+//The records in a segment are in time order, and the span of each segment is
+//kept in RAM so that a date range query only opens the segments that overlap it
+//and finds its starting point in each with a binary search.
+typedef struct
+  {
+  uint32 timestamp;
+  uint8 ruleNumber;
+  uint8 mark;       //HISTORY_RECORD_MARK
+  uint16 reserved;
+  } logRecord;
+static_assert(sizeof(logRecord)==8,"history log records must stay 8 bytes");
+
+typedef struct
+  {
+  uint32 sequence;  //names the file, one higher for each new segment
+  uint32 first;     //timestamp of the first record
+  uint32 last;      //timestamp of the last record
+  uint16 count;     //records in the file
+  } logSegment;
+logSegment logSegments[HISTORY_SEGMENTS]; //oldest first
+uint8 logSegmentCount=0;
+boolean historyStoreOK=false;
+//Alerts that came before the clock was set.  They wait here for the time so
+//they can go into the log in order, instead of looking like the clock went back.
+typedef struct
+  {
+  uint8 ruleNumber;
+  unsigned long arrived; //millis()
+  } pendingRecord;
+pendingRecord pendingRecords[HISTORY_PENDING];
+uint8 pendingRecordCount=0;
+unsigned long historyFrom=0;            //the date range for writeHistoryRange()
+unsigned long historyTo=0;
+
+//What each rule has done since startup. Times are from millis() and are only
+//ever compared by subtraction, so the 49 day rollover doesn't matter.
+typedef struct
+  {
+  boolean alerted=false;        //lastAlert is meaningless until there has been one
+  unsigned long lastAlert=0;    //the debounce time is measured from here
+  uint8 tokens=0;               //alerts left in the rate limit bucket
+  unsigned long lastRefill=0;   //when the bucket last gained a token
+  unsigned long alerts=0;
+  unsigned long debounced=0;    //repeats ignored because of the debounce time
+  unsigned long rateLimited=0;  //repeats ignored because the bucket was empty
+  } ruleState;
+ruleState ruleStates[MAX_RULES];
+
+// Bytes from the serial port wait in a ring buffer until a whole line has come
+// in, then the line is framed into serialLine for processCommand().  Positions
+// run freely and wrap, so head-tail is the number of bytes waiting.
+char serialRing[SERIAL_RING_SIZE];
+uint16 serialHead=0;            //where the next byte goes
+uint16 serialScan=0;            //bytes before this are known not to end a line
+uint16 serialTail=0;            //start of the line being framed
+boolean serialDiscarding=false; //dropping the rest of a line that was too long
+char serialLine[MQTT_MAX_COMMAND_SIZE+1];
+unsigned long serialLines=0;
+unsigned long serialOverruns=0; //lines, or batches of them, too long to keep
+static_assert((SERIAL_RING_SIZE&(SERIAL_RING_SIZE-1))==0,"the serial ring size must be a power of 2");
+static_assert(SERIAL_RING_SIZE>MQTT_MAX_COMMAND_SIZE+1,"the serial ring must hold the longest command");
+
+// A block of settings pasted between a "batch" line and an "end" line is applied
+// all at once, the same as a batch sent over MQTT.
+char serialBatch[SERIAL_BATCH_SIZE];
+size_t serialBatchUsed=0;
+boolean serialBatching=false;
+boolean serialBatchTooBig=false;
+
+// Replies are written twice, once to measure them and once to send them, and both
+// have to come out the same length.  Anything in a reply that depends on the time
+// uses this instead of millis(), which is set once when the reply is started.
+unsigned long replyMillis=0;
+
+// The heap, sampled once a second.  Nothing in the steady state should allocate,
+// so the largest free block shouldn't shrink once the device has started.  Replies
+// use the last sample, since they are written twice and have to come out the same.
+uint32 heapFree=0;
+uint32 heapBlock=0;
+uint8 heapFragmentation=0;
+uint32 heapFreeLowest=0xFFFFFFFF;
+uint32 heapBlockLowest=0xFFFFFFFF;  //largest free block
+uint8 heapFragmentationWorst=0;      //percent
 
 char clockTime[DISPLAY_COLUMNS+1]="";
+unsigned long clockEpoch=0;  //the local time in clockTime, 0 until it has been set
+tmElements_t clockFields;    //and the same broken down
 
+//The time is the UTC time of the last sync plus the millis() since then,
+//corrected for how fast or slow our crystal turned out to be.  Syncing is
+//done a step at a time by ntpTask so that loop() never waits on the network.
 WiFiUDP ntpUDP;
-NTPClient timeClient(ntpUDP, "pool.ntp.org");
+enum ntpStates {NTP_IDLE, NTP_WAITING};
+ntpStates ntpState=NTP_IDLE;
+boolean timeIsSet=false;
+unsigned long long baseUtcMs=0;   //UTC milliseconds since 1970 at baseMillis
+unsigned long baseMillis=0;
+unsigned long long sinceSyncMs=0; //millis() from the last sync to baseMillis
+long driftPpm=0;                  //how much faster than real time millis() runs
+long lastSyncOffset=0;            //how far off we were at the last sync, ms
+unsigned long ntpSentAt=0;        //millis() when the request went out
+uint8 ntpToken[8];                //comes back in the answer so we know it's ours
+unsigned long ntpSyncs=0;
+unsigned long ntpFailures=0;      //in a row
 
 SoftwareSerial mySoftwareSerial(D4, D3); // RX, TX
 DFRobotDFPlayerMini myDFPlayer;
 
+//Tracks waiting to be played.  Alerts are queued here by the MQTT callback and
+//sent to the mp3 player one at a time from loop(), each one after the previous
+//one reports that it has finished, so a second alert doesn't cut off the first.
+typedef struct
+  {
+  uint8 track=0;
+  unsigned long queuedAt=0;      //millis() when it was queued
+  unsigned long arrivedMicros=0; //micros() when the message that queued it arrived
+  } playRequest;
+playRequest playQueue[PLAY_QUEUE_SIZE]; //circular buffer
+uint8 playQueueHead=0;      //next one to play
+uint8 playQueueCount=0;
+boolean playerBusy=false;   //a track is playing
+uint8 playingTrack=0;
+unsigned long playStartedAt=0;
+unsigned long playWaitLast=0;  //ms the last track waited in the queue
+unsigned long playWaitMax=0;   //longest wait so far
+unsigned long playCoalesced=0; //alerts for a track that was already waiting
+unsigned long playDropped=0;   //alerts that didn't fit in the queue
+
 char lastLastLine[DISPLAY_COLUMNS+1]="";
 
-/// @brief Show a message on the LCD, with optional timestamp.
+//The LCD is slow to talk to, so show() only changes what should be on it in
+//frameBuffer.  flushDisplay() runs as a task and sends just the characters that
+//differ from lcdShadow, which is what the LCD is showing now.
+char frameBuffer[DISPLAY_ROWS][DISPLAY_COLUMNS];
+char lcdShadow[DISPLAY_ROWS][DISPLAY_COLUMNS];
+boolean frameChanged=false;
+uint8 lcdColumn=DISPLAY_COLUMNS; //where the LCD's cursor is, so it's only moved when needed
+uint8 lcdRow=0;
+
+//Startup steps that wait on the network or the mp3 player are done by bootTask()
+enum bootSteps {BOOT_IDLE, BOOT_WIFI, BOOT_WAIT_WIFI, BOOT_TIME, BOOT_WAIT_TIME, BOOT_MQTT, 
+                BOOT_PLAYER, BOOT_PLAYER_RETRY, BOOT_DONE};
+bootSteps bootStep=BOOT_IDLE;
+
+enum wifiStates {WIFI_IDLE, WIFI_CONNECTING, WIFI_CONNECTED};
+wifiStates wifiState=WIFI_IDLE;
+int wifiAttempts=0;
+
+unsigned long worstLoopMicros=0; //longest pass through loop() since startup completed
+
+//How long each stage of handling an alert takes, as histograms with a bucket for
+//each power of two microseconds, and what happened to the incoming messages.
+//They are published now and then as telemetry so firmware versions can be compared.
+enum latencyStages {STAGE_MATCH,     //message arrived until its rule was found
+                    STAGE_HISTORY,   //adding it to the history
+                    STAGE_LCD,       //sending changes to the LCD
+                    STAGE_AUDIO,     //message arrived until its track was sent to the player
+                    STAGE_COUNT};
+const char* const stageNames[STAGE_COUNT]={"match","history","lcd","audio"};
+uint32 latency[STAGE_COUNT][LATENCY_BUCKETS];
+unsigned long messagesMatched=0;    //alerts announced
+unsigned long messagesSuppressed=0; //matched a rule but debounced or rate limited
+unsigned long messagesUnmatched=0;  //not for the command topic and no rule matched
+unsigned long messagesRedelivered=0; //QoS 1 messages we had already handled
+
+//The last few QoS 1 messages, to recognize the broker sending one again. The 
+//broker may reuse a packet id once it has been acknowledged, so a hash of the 
+//message has to match too.
+typedef struct
+  {
+  uint16 id;
+  uint32 hash;
+  } recentPacket;
+recentPacket recentPackets[RECENT_PACKET_IDS];
+uint8 recentPacketNext=0;
+
+//Where the time goes in loop().  Each section's times go in a histogram like the
+//ones above, so that the 99th percentile can be estimated without keeping them all.
+enum loopSections {SECTION_TASKS, SECTION_MQTT, SECTION_SERIAL, SECTION_OTA, 
+                   SECTION_PLAYER, SECTION_COUNT};
+const char* const sectionNames[SECTION_COUNT]={"tasks","mqtt","serial","ota","player"};
+const unsigned long sectionBudgets[SECTION_COUNT]={PROFILE_BUDGET_US,PROFILE_BUDGET_US,
+    PROFILE_QUICK_BUDGET_US,PROFILE_QUICK_BUDGET_US,PROFILE_QUICK_BUDGET_US};
+typedef struct
+  {
+  unsigned long calls;
+  unsigned long long totalMicros;
+  unsigned long maxMicros;
+  unsigned long stalls;       //times it went over its budget
+  uint32 histogram[LATENCY_BUCKETS];
+  } sectionProfile;
+sectionProfile profile[SECTION_COUNT];
+int lastStallSection=-1;
+unsigned long lastStallMicros=0;
+unsigned long lastStallAt=0;    //millis()
+
+/*
+ * A very small cooperative scheduler.  Anything that used to wait with delay()
+ * is now a task that loop() runs when its time comes, so that MQTT, serial and
+ * OTA keep being serviced in the meantime.  A function can only be scheduled
+ * once; scheduling it again just changes its timing.
+ */
+typedef void (*taskFunction)();
+typedef struct
+  {
+  taskFunction function=NULL;
+  unsigned long interval=0;  //ms between runs, or until the only run
+  unsigned long lastRun=0;   //millis() when it last ran or was scheduled
+  boolean repeat=false;
+  } task;
+task tasks[MAX_TASKS];
+
+/// @brief Put text in the frame buffer, starting at the left of a row
+void frameText(int row, const char* text)
+  {
+  if (row<0 || row>=DISPLAY_ROWS)
+    return;
+  size_t len=strlen(text);
+  if (len>DISPLAY_COLUMNS)
+    len=DISPLAY_COLUMNS;
+  memcpy(frameBuffer[row],text,len);
+  frameChanged=true;
+  }
+
+/// @brief Show a message on the LCD, with optional timestamp.  The LCD itself is
+/// updated a little later by flushDisplay().
 /// @param msg - message to display
 /// @param showTimestamp - show the timestamp on line 0
 /// @param clear - clear the display first
 /// @param lineNumber - put message on this line (0=based)
 void show(char* msg, boolean showTimestamp, boolean clear=false, int lineNumber=1)
   {
-  if (clear) 
+  if (clear || showTimestamp) 
     {
-    lcd.clear();
+    memset(frameBuffer,' ',sizeof(frameBuffer));
+    frameChanged=true;
     lastLastLine[0]='\0'; // clear the last line buffer too
-    delay(500);
     } 
 
   if (showTimestamp)
-    {
-    lcd.clear();
-    lastLastLine[0]='\0'; // clear the last line buffer too    
-    lcd.setCursor(0, 0);
-    lcd.print(clockTime); //current timestamp
-    }
+    frameText(0,clockTime); //current timestamp
 
   if (strlen(msg)>0)
     {
     char buf[DISPLAY_COLUMNS+1];
     strncpy(buf,msg,DISPLAY_COLUMNS); //make sure message is not too long
     buf[DISPLAY_COLUMNS]='\0';
-    lcd.setCursor(0,lineNumber);
-    lcd.print(buf);
+    frameText(lineNumber,buf);
     if (lineNumber==DISPLAY_ROWS-1)
       strcpy(lastLastLine,buf); //save the bottom line for scroll
     }
   }
 
+/*
+ * Send the characters that have changed in the frame buffer to the LCD.  At most
+ * LCD_FLUSH_MAX_CHARS go each time so that a full redraw is spread over a few
+ * passes through loop() instead of holding everything else up.
+ */
+void flushDisplay()
+  {
+  if (!frameChanged)
+    return;
+  unsigned long start=micros();
+  int budget=LCD_FLUSH_MAX_CHARS;
+  for (uint8 row=0;row<DISPLAY_ROWS;row++)
+    {
+    for (uint8 col=0;col<DISPLAY_COLUMNS;col++)
+      {
+      char c=frameBuffer[row][col];
+      if (c==lcdShadow[row][col])
+        continue;
+      if (budget--==0)
+        {
+        recordLatency(STAGE_LCD,micros()-start);
+        return; //the rest goes next time
+        }
+      if (row!=lcdRow || col!=lcdColumn)
+        lcd.setCursor(col,row);
+      lcd.write((uint8_t)c);
+      lcdShadow[row][col]=c;
+      lcdRow=row;
+      lcdColumn=col+1; //the LCD moves the cursor along by itself
+      }
+    }
+  frameChanged=false;
+  recordLatency(STAGE_LCD,micros()-start);
+  }
+
 void scrollDisplay()
   {
   char buf[DISPLAY_COLUMNS+1];
@@ -139,7 +757,7 @@ void scrollDisplay()
   show(buf,false,true,0);
   }
 
-void addHistoryEntry(uint8 topicNumber, unsigned long timestamp)
+void cacheHistoryEntry(uint8 topicNumber, unsigned long timestamp)
   {
   history[histPointer]={topicNumber,timestamp};
   if (++histPointer >= HISTORY_BUFFER_SIZE)
@@ -148,65 +766,461 @@ void addHistoryEntry(uint8 topicNumber, unsigned long timestamp)
     histEntryCount=HISTORY_BUFFER_SIZE; //it's the max we can hold
   }
 
+void addHistoryEntry(uint8 topicNumber, unsigned long timestamp)
+  {
+  cacheHistoryEntry(topicNumber,timestamp);
+  if (!appendHistoryRecord(topicNumber,timestamp))
+    Serial.println("************ Failure when writing the history log!");
+  }
+
+void segmentPath(char* path, uint32 sequence)
+  {
+  sprintf(path,HISTORY_DIR "/%08lx",(unsigned long)sequence);
+  }
+
+boolean readLogRecord(File& f, uint16 index, logRecord* rec)
+  {
+  return f.seek(index*sizeof(logRecord),SeekSet)
+      && f.read((uint8_t*)rec,sizeof(logRecord))==sizeof(logRecord)
+      && rec->mark==HISTORY_RECORD_MARK;
+  }
 
-boolean refreshTime()
+/*
+ * Mount the file system, find the segments of the history log and note the
+ * time span of each, then load the newest records into the RAM cache.
+ */
+boolean historyStoreBegin()
   {
-  boolean ok=true;
-  Serial.print(timeClient.getFormattedTime());
-  Serial.print("\tRefreshing time...");
-  if (WiFi.status() != WL_CONNECTED)
+  if (!LittleFS.begin())
     {
-    Serial.println("Abort, WiFi not connected.");
-    ok=false;
+    Serial.println("Formatting the file system for the history log...");
+    if (!LittleFS.format() || !LittleFS.begin())
+      return false;
     }
-  else
+
+  //keep the newest HISTORY_SEGMENTS, in order. Any others are left over from
+  //a build that kept more of them, and are deleted once the directory is read.
+  uint32 stale[HISTORY_SEGMENTS];
+  uint8 staleCount=0;
+  logSegmentCount=0;
+  Dir dir=LittleFS.openDir(HISTORY_DIR);
+  while (dir.next())
+    {
+    uint32 sequence=strtoul(dir.fileName().c_str(),NULL,16);
+    if (logSegmentCount==HISTORY_SEGMENTS)
+      {
+      uint32 older=sequence<logSegments[0].sequence?sequence:logSegments[0].sequence;
+      if (staleCount<HISTORY_SEGMENTS)
+        stale[staleCount++]=older;
+      if (older==sequence)
+        continue;
+      memmove(&logSegments[0],&logSegments[1],--logSegmentCount*sizeof(logSegment));
+      }
+    int i=logSegmentCount++;
+    while (i>0 && logSegments[i-1].sequence>sequence)
+      {
+      logSegments[i]=logSegments[i-1];
+      i--;
+      }
+    logSegments[i]={sequence,0,0,0};
+    }
+
+  char path[24];
+  for (int i=0;i<staleCount;i++)
+    {
+    segmentPath(path,stale[i]);
+    LittleFS.remove(path);
+    }
+
+  logRecord rec;
+  for (int i=0;i<logSegmentCount;i++)
     {
-    connectToWiFi(); //may need to connect to the wifi
-    if (settingsAreValid && WiFi.status() == WL_CONNECTED)
+    logSegment* seg=&logSegments[i];
+    segmentPath(path,seg->sequence);
+    File f=LittleFS.open(path,"r");
+    if (!f)
+      continue;
+    seg->count=f.size()/sizeof(logRecord); //a torn record at the end is overwritten by the next one
+    if (seg->count>0 && readLogRecord(f,0,&rec))
+      seg->first=rec.timestamp;
+    for (int j=seg->count-1;j>=0;j--)
       {
-      bool timeGood=timeClient.update();
-      if (timeGood)
+      if (readLogRecord(f,j,&rec))
         {
-        timeClient.setTimeOffset(settings.gmtOffset*3600);
-        Serial.println("done.");
-        Serial.print("Time is ");
-        Serial.println(timeClient.getFormattedTime());
+        seg->last=rec.timestamp;
+        break;
         }
-      else
+      }
+    f.close();
+    }
+
+  //warm the RAM cache with the newest records
+  int skip=HISTORY_BUFFER_SIZE;
+  int first=logSegmentCount;
+  while (first>0 && skip>0)
+    skip-=logSegments[--first].count;
+  skip=skip<0?-skip:0;
+  for (int i=first;i<logSegmentCount;i++)
+    {
+    segmentPath(path,logSegments[i].sequence);
+    File f=LittleFS.open(path,"r");
+    for (int j=skip;f && j<logSegments[i].count;j++)
+      {
+      if (readLogRecord(f,j,&rec))
+        cacheHistoryEntry(rec.ruleNumber,rec.timestamp);
+      }
+    skip=0;
+    }
+
+  historyStoreOK=true;
+  return true;
+  }
+
+/// @brief Start a new segment of the history log, deleting the oldest if there's no room
+/// @return the new segment, or NULL if it couldn't be created
+logSegment* startLogSegment()
+  {
+  char path[24];
+  uint32 sequence=logSegmentCount>0?logSegments[logSegmentCount-1].sequence+1:1;
+  if (logSegmentCount==HISTORY_SEGMENTS)
+    {
+    segmentPath(path,logSegments[0].sequence);
+    LittleFS.remove(path);
+    memmove(&logSegments[0],&logSegments[1],--logSegmentCount*sizeof(logSegment));
+    }
+  segmentPath(path,sequence);
+  File f=LittleFS.open(path,"w");
+  if (!f)
+    return NULL;
+  f.close();
+  logSegments[logSegmentCount]={sequence,0,0,0};
+  return &logSegments[logSegmentCount++];
+  }
+
+/// @brief Add a record to the end of the history log on flash.  A record
+/// from before the clock was set is held until it is, by writePendingRecords().
+/// @param ruleNumber the rule that was matched, starting at 1
+/// @param timestamp when it happened, 0 if the clock isn't set
+/// @return true if it was written or is being held
+boolean appendHistoryRecord(uint8 ruleNumber, unsigned long timestamp)
+  {
+  if (!historyStoreOK)
+    return false;
+  if (timestamp==0)
+    {
+    if (pendingRecordCount>=HISTORY_PENDING)
+      return false;
+    pendingRecords[pendingRecordCount++]={ruleNumber,millis()};
+    return true;
+    }
+  logSegment* seg=logSegmentCount>0?&logSegments[logSegmentCount-1]:NULL;
+  if (seg==NULL 
+      || seg->count>=HISTORY_SEGMENT_RECORDS
+      || (seg->count>0 && timestamp<seg->last)) //the clock went back, segments must stay in order
+    {
+    seg=startLogSegment();
+    if (seg==NULL)
+      return false;
+    }
+
+  char path[24];
+  segmentPath(path,seg->sequence);
+  File f=LittleFS.open(path,"r+");
+  logRecord rec={(uint32)timestamp,ruleNumber,HISTORY_RECORD_MARK,0};
+  boolean ok=f 
+      && f.seek(seg->count*sizeof(logRecord),SeekSet)
+      && f.write((const uint8_t*)&rec,sizeof(rec))==sizeof(rec);
+  f.close();
+  if (ok)
+    {
+    if (seg->count==0)
+      seg->first=timestamp;
+    seg->last=timestamp;
+    seg->count++;
+    }
+  return ok;
+  }
+
+/// @brief Write the records held while the clock wasn't set, dated by how
+/// long ago they came in.  Called once the clock is set.
+void writePendingRecords()
+  {
+  unsigned long now=localTime();
+  unsigned long nowMillis=millis();
+  for (int i=0;i<pendingRecordCount;i++)
+    {
+    unsigned long age=(nowMillis-pendingRecords[i].arrived)/1000;
+    if (!appendHistoryRecord(pendingRecords[i].ruleNumber,now>age?now-age:1))
+      Serial.println("************ Failure when writing the history log!");
+    }
+  pendingRecordCount=0;
+  }
+
+/// @brief The current UTC time in milliseconds, 0 if we don't have it yet
+unsigned long long utcMillis()
+  {
+  if (!timeIsSet)
+    return 0;
+  unsigned long elapsed=millis()-baseMillis;
+  return baseUtcMs+elapsed-(long long)elapsed*driftPpm/1000000;
+  }
+
+/// @brief The local time in seconds, for the clock and the history log
+unsigned long localTime()
+  {
+  if (!timeIsSet)
+    return 0;
+  return utcMillis()/1000+settings.gmtOffset*3600;
+  }
+
+/// @brief Move the base time up to now, so the millis() since then never
+/// gets near rolling over, even if the NTP server is gone for weeks.
+void rebaseTime()
+  {
+  unsigned long now=millis();
+  baseUtcMs=utcMillis();
+  sinceSyncMs+=now-baseMillis;
+  baseMillis=now;
+  }
+
+/// @brief Get the time from the server as soon as possible
+void requestTimeSync()
+  {
+  if (ntpState==NTP_IDLE)
+    scheduleTask(ntpTask,0,false);
+  }
+
+/// @brief The server didn't answer. Try again later, waiting twice as long 
+/// each time up to a limit.
+void ntpFailed(const char* why)
+  {
+  ntpUDP.stop();
+  ntpState=NTP_IDLE;
+  ntpFailures++;
+  unsigned long wait=NTP_RETRY_MAX_MS;
+  if (ntpFailures<=20 && (NTP_RETRY_MIN_MS<<(ntpFailures-1))<NTP_RETRY_MAX_MS)
+    wait=NTP_RETRY_MIN_MS<<(ntpFailures-1);
+  if (settings.debug)
+    Serial.printf("Time sync failed (%s), retrying in %lu s\n",why,wait/1000);
+  scheduleTask(ntpTask,wait,false);
+  }
+
+/// @brief Read a 64 bit NTP timestamp as milliseconds since 1970
+unsigned long long ntpTimestampMs(const uint8* field)
+  {
+  unsigned long seconds=(unsigned long)field[0]<<24 | (unsigned long)field[1]<<16 
+                       | (unsigned long)field[2]<<8 | field[3];
+  unsigned long fraction=(unsigned long)field[4]<<24 | (unsigned long)field[5]<<16 
+                        | (unsigned long)field[6]<<8 | field[7];
+  return (seconds-2208988800UL)*1000ULL+(((unsigned long long)fraction*1000)>>32);
+  }
+
+/*
+ * A good answer came from the server.  The time it gives is as of when it
+ * sent it, so half the round trip is added.  If we already had the time, the
+ * difference between what we thought it was and what it is, over the time 
+ * since the last sync, is how far off our drift estimate is.  Half of that is 
+ * applied, so one bad measurement can't throw it far.
+ */
+void ntpApply(const uint8* packet)
+  {
+  unsigned long now=millis();
+  unsigned long roundTrip=now-ntpSentAt;
+  unsigned long long serverMs=ntpTimestampMs(&packet[40])+roundTrip/2;
+  if (timeIsSet)
+    {
+    long long offset=(long long)(serverMs-utcMillis());
+    unsigned long long localMs=sinceSyncMs+(now-baseMillis);
+    lastSyncOffset=offset;
+    if (localMs>=NTP_DRIFT_MIN_MS)
+      {
+      long estimate=driftPpm-(long)(offset*1000000/(long long)localMs);
+      if (estimate>-NTP_MAX_DRIFT_PPM && estimate<NTP_MAX_DRIFT_PPM)
+        driftPpm=(driftPpm+estimate)/2;
+      }
+    }
+  baseUtcMs=serverMs;
+  baseMillis=now;
+  sinceSyncMs=0;
+  timeIsSet=true;
+  ntpSyncs++;
+  ntpFailures=0;
+  if (settings.debug)
+    Serial.printf("Time synced, off by %ld ms, round trip %lu ms, drift %ld ppm\n",
+                  lastSyncOffset,roundTrip,driftPpm);
+  }
+
+/*
+ * Sync the time with the NTP server, one step per call.  While waiting for 
+ * the answer this runs every few milliseconds, otherwise it sleeps until the 
+ * next sync is due.
+ */
+void ntpTask()
+  {
+  switch (ntpState)
+    {
+    case NTP_IDLE:
+      {
+      if (WiFi.status() != WL_CONNECTED)
+        {
+        ntpFailed("no WiFi");
+        break;
+        }
+      uint8 packet[NTP_PACKET_SIZE];
+      memset(packet,0,sizeof(packet));
+      packet[0]=0x23;   //no leap second warning, version 4, client
+      ntpSentAt=millis();
+      for (int i=0;i<8;i++)
+        ntpToken[i]=(i<4?ntpSentAt>>(8*i):random(256))&0xff;
+      memcpy(&packet[40],ntpToken,sizeof(ntpToken)); //our transmit time, which is only checked for a match
+      ntpUDP.begin(NTP_LOCAL_PORT);
+      if (!ntpUDP.beginPacket(NTP_SERVER,NTP_PORT) 
+          || ntpUDP.write(packet,sizeof(packet))!=sizeof(packet)
+          || !ntpUDP.endPacket())
+        {
+        ntpFailed("can't send");
+        break;
+        }
+      ntpState=NTP_WAITING;
+      scheduleTask(ntpTask,NTP_POLL_MS,true);
+      break;
+      }
+
+    case NTP_WAITING:
+      {
+      int size=ntpUDP.parsePacket();
+      if (size>=NTP_PACKET_SIZE)
         {
-        Serial.println("***** Unable to refresh time *****");
-        ok=false;
+        uint8 packet[NTP_PACKET_SIZE];
+        ntpUDP.read(packet,sizeof(packet));
+        if ((packet[0]&0x07)==4                //from a server
+            && (packet[0]>>6)!=3               //that is synchronized
+            && packet[1]>=1 && packet[1]<=15   //stratum
+            && memcmp(&packet[24],ntpToken,sizeof(ntpToken))==0) //in answer to us
+          {
+          ntpApply(packet);
+          writePendingRecords(); //if there are any from before the first sync
+          ntpUDP.stop();
+          ntpState=NTP_IDLE;
+          scheduleTask(ntpTask,NTP_REFRESH_MS,false);
+          updateClock();
+          break;
+          }
         }
+      if (millis()-ntpSentAt>=NTP_TIMEOUT_MS)
+        ntpFailed("timeout");
+      break;
       }
     }
-  return ok;
-  } 
+  }
+
+/// @brief Where the time came from and how good it is
+void writeTimeStatus(Print& out)
+  {
+  if (!timeIsSet)
+    out.print("time not set");
+  else
+    out.printf("time synced %lu s ago, last off by %ld ms, drift %ld ppm",
+               (unsigned long)((sinceSyncMs+(replyMillis-baseMillis))/1000),lastSyncOffset,driftPpm);
+  out.printf(", %lu syncs, %lu failures",ntpSyncs,ntpFailures);
+  }
 
+/// @brief Write a two digit number into a buffer, no terminator
+void put2Digits(char* buffer, int value)
+  {
+  buffer[0]='0'+value/10;
+  buffer[1]='0'+value%10;
+  }
 
+/*
+ * Bring clockTime up to date.  Normally a second has passed since the last 
+ * time, so the second is just added to the fields we already have.  Anything 
+ * else (startup, a missed tick, a new time from the server) works the date out 
+ * from scratch.  Either way there is no String or sprintf involved.
+ */
 boolean updateClock()
   {
-  static unsigned long lastTime=0;
-  unsigned long currentTime=timeClient.getEpochTime();
-  boolean ok=true;
+  unsigned long currentTime=localTime();
+  boolean ok=timeIsSet;
 
-  if (settingsAreValid && currentTime != lastTime)
+  if (settingsAreValid && ok && currentTime != clockEpoch)
     {
-    //Update the time every 12 hours, or if we just powered up
-    if (currentTime%43200 ==0 || timeClient.getEpochTime() < 100000)
+    if (clockEpoch==0 || currentTime!=clockEpoch+1)
+      breakTime(currentTime,clockFields);
+    else if (++clockFields.Second==60)
       {
-      ok=refreshTime();
+      clockFields.Second=0;
+      if (++clockFields.Minute==60)
+        {
+        clockFields.Minute=0;
+        if (++clockFields.Hour==24)
+          breakTime(currentTime,clockFields); //new day
+        }
       }
-    lastTime=currentTime;
+    clockEpoch=currentTime;
 
-    unsigned long today=timeClient.getEpochTime();
-    char datebuff[32];
-    sprintf(datebuff,"%02d/%02d %s",month(today),day(today),timeClient.getFormattedTime().c_str());
-    strncpy(clockTime,datebuff,DISPLAY_COLUMNS);
-    clockTime[DISPLAY_COLUMNS]='\0';
+    //"mm/dd hh:mm:ss"
+    put2Digits(&clockTime[0],clockFields.Month);
+    clockTime[2]='/';
+    put2Digits(&clockTime[3],clockFields.Day);
+    clockTime[5]=' ';
+    put2Digits(&clockTime[6],clockFields.Hour);
+    clockTime[8]=':';
+    put2Digits(&clockTime[9],clockFields.Minute);
+    clockTime[11]=':';
+    put2Digits(&clockTime[12],clockFields.Second);
+    clockTime[14]='\0';
     }
   return ok;
   }
 
+/// @brief Keep track of the worst the heap has been
+void sampleHeap()
+  {
+  heapFree=ESP.getFreeHeap();
+  heapBlock=ESP.getMaxFreeBlockSize();
+  heapFragmentation=ESP.getHeapFragmentation();
+  if (heapFree<heapFreeLowest)
+    heapFreeLowest=heapFree;
+  if (heapBlock<heapBlockLowest)
+    heapBlockLowest=heapBlock;
+  if (heapFragmentation>heapFragmentationWorst)
+    heapFragmentationWorst=heapFragmentation;
+  }
+
+/// @brief Write the heap now and at its worst
+void writeHeapStatus(Print& out)
+  {
+  out.printf("heap free %lu (lowest %lu), largest block %lu (lowest %lu), fragmentation %u%% (worst %u%%)",
+             (unsigned long)heapFree,(unsigned long)heapFreeLowest,
+             (unsigned long)heapBlock,(unsigned long)heapBlockLowest,
+             heapFragmentation,heapFragmentationWorst);
+  }
+
+/// @brief Schedule the clock's next tick for just after the next second of
+/// the corrected time starts.  A fixed 1000 ms would slowly slide against the
+/// seconds as the drift correction moves them, and each time it crossed one
+/// the clock would show a second twice or skip one.
+void scheduleClockTick()
+  {
+  unsigned long wait=1000;
+  if (timeIsSet)
+    wait=1000-utcMillis()%1000+CLOCK_TICK_MARGIN_MS;
+  scheduleTask(clockTask,wait,false);
+  }
+
+/// @brief The once a second tick.  It schedules its own next run, lined up
+/// with the seconds of the clock rather than with millis().
+void clockTask()
+  {
+  sampleHeap();
+  if (timeIsSet && millis()-baseMillis>=NTP_REBASE_MS)
+    rebaseTime();
+  if (setupOK)
+    updateClock();
+  scheduleClockTick();
+  }
+
 void printStackSize(char id)
   {
   char stack;
@@ -215,11 +1229,19 @@ void printStackSize(char id)
   Serial.println (stack_start - &stack);
   }
 
+/// @brief Replace every copy of field in rawString with value, in place.  The
+/// buffer has to have room for the result.
 char* fixup(char* rawString, const char* field, const char* value)
   {
-  String rs=String(rawString);
-  rs.replace(field,String(value));
-  strcpy(rawString,rs.c_str());
+  size_t fieldLength=strlen(field);
+  size_t valueLength=strlen(value);
+  char* p=fieldLength>0?strstr(rawString,field):NULL;
+  while (p!=NULL)
+    {
+    memmove(p+valueLength,p+fieldLength,strlen(p+fieldLength)+1);
+    memcpy(p,value,valueLength);
+    p=strstr(p+valueLength,field);
+    }
   printStackSize('F');
   return rawString;
   }
@@ -299,11 +1321,82 @@ void printDetail(uint8_t type, int value){
 }
 
 
-/// @brief Compare two char strings, with allowances for '+' and '#'
+/// @brief Queue a track to be played when the player is free. Doesn't talk to
+/// the player, so it is safe to call from the MQTT callback.
+/// @param track the mp3 file number
+/// @param arrivedMicros when the message for the alert arrived, for the telemetry
+/// @return false if the queue was full and the track was dropped
+boolean queueTrack(uint8 track, unsigned long arrivedMicros)
+  {
+  for (uint8 i=0;i<playQueueCount;i++)
+    {
+    if (playQueue[(playQueueHead+i)%PLAY_QUEUE_SIZE].track==track)
+      {
+      playCoalesced++; //already waiting, once is enough
+      return true;
+      }
+    }
+  if (playQueueCount>=PLAY_QUEUE_SIZE)
+    {
+    playDropped++;
+    Serial.println("************ Play queue is full, alert dropped!");
+    return false;
+    }
+  playRequest* request=&playQueue[(playQueueHead+playQueueCount)%PLAY_QUEUE_SIZE];
+  request->track=track;
+  request->queuedAt=millis();
+  request->arrivedMicros=arrivedMicros;
+  playQueueCount++;
+  return true;
+  }
+
+/// @brief Handle events from the mp3 player and start the next queued track 
+/// when the last one is finished.  Called from loop().
+void servicePlayer()
+  {
+  if (myDFPlayer.available())
+    {
+    uint8_t type=myDFPlayer.readType();
+    int value=myDFPlayer.read();
+    printDetail(type,value); //Print the detail message from DFPlayer for different errors and states.
+
+    //The player sometimes reports the end of a track twice, so a report that
+    //comes right after a track was started is for the previous one.
+    if (playerBusy && millis()-playStartedAt>=PLAY_MIN_MS
+        && (type==DFPlayerPlayFinished || type==DFPlayerError))
+      playerBusy=false;
+    }
+
+  if (playerBusy && millis()-playStartedAt>=PLAY_TIMEOUT_MS)
+    {
+    Serial.print("************ No end of play from track ");
+    Serial.println(playingTrack);
+    playerBusy=false; //the event got lost, carry on
+    }
+
+  if (!playerBusy && playQueueCount>0)
+    {
+    playRequest* request=&playQueue[playQueueHead];
+    playQueueHead=(playQueueHead+1)%PLAY_QUEUE_SIZE;
+    playQueueCount--;
+    playingTrack=request->track;
+    playStartedAt=millis();
+    playWaitLast=playStartedAt-request->queuedAt;
+    if (playWaitLast>playWaitMax)
+      playWaitMax=playWaitLast;
+    playerBusy=true;
+    myDFPlayer.play(playingTrack);
+    recordLatency(STAGE_AUDIO,micros()-request->arrivedMicros);
+    }
+  }
+
+/// @brief Compare two char strings, with allowances for '+' and '#'. Incoming
+/// messages are matched with the topic trie below; this is the reference it
+/// is benchmarked against and the fallback if the trie can't be built.
 /// @param preciseTopic The incoming mqtt topic
 /// @param mqttTopic The stored topic, possibly with wildcard characters
 /// @return true if they match
-boolean mqttCompare(char* preciseTopic, char* mqttTopic)
+boolean mqttCompare(const char* preciseTopic, const char* mqttTopic)
   {
   char mTopic[MQTT_MAX_TOPIC_SIZE]; 
   char pTopic[MQTT_MAX_TOPIC_SIZE];
@@ -326,13 +1419,20 @@ boolean mqttCompare(char* preciseTopic, char* mqttTopic)
       Serial.print(preciseParsed);
       Serial.print("\"...");
       }
-    if (strcmp(mqttParsed,"#")==0)
+    if (mqttParsed!=NULL && strcmp(mqttParsed,"#")==0)
       {
       if (settings.debug)
         Serial.println("# found at end of topic, we're done.");
       break; // # can only appear at the end of a topic. We're done.
       }
 
+    else if (mqttParsed==NULL || preciseParsed==NULL) //one has more levels than the other
+      {
+      if (settings.debug)
+        Serial.println("Not a match.");
+      return false;
+      }
+
     else if (strcmp(mqttParsed,plus)!=0 && strcmp(mqttParsed,pound)!=0
       && strcmp(preciseParsed,mqttParsed)!=0)
       {
@@ -357,371 +1457,1649 @@ boolean mqttCompare(char* preciseTopic, char* mqttTopic)
   }
 
 /*
-Convert the history buffer from a binary format to something that
-is readable by humans.  Parameter is a buffer that's big enough to
-hold all of the text that could be generated.
+The configured topic filters are compiled into a trie of topic segments so
+that an incoming topic can be checked against all of them in a single pass,
+in place, without copying or tokenizing it. Each node holds one segment of
+one or more filters. Bit N of a node's "rules" mask is set when filter N+1
+ends at that node, and bit N of its "multiRules" mask is set when filter N+1
+ends with a "#" right after it. Node 0 is the root and has no segment.
+The trie is rebuilt whenever the settings are loaded or saved.
 */
-void buildReadableHistory(char* buffer)
+typedef struct
   {
-  if (histEntryCount==0)
+  uint16 segment=0;       //offset of the segment text in trieSegments
+  uint8 segmentLength=0;
+  boolean wildcard=false; //segment is "+"
+  uint8 firstChild=0;     //zero means none, the root can't be anyone's child
+  uint8 nextSibling=0;
+  uint32 rules=0;         //filters that end at this node
+  uint32 multiRules=0;    //filters that end with "#" below this node
+  } trieNode;
+trieNode topicTrie[TOPIC_TRIE_MAX_NODES];
+uint8 trieNodeCount=0;
+char trieSegments[TOPIC_TRIE_POOL_SIZE];
+uint16 trieSegmentsUsed=0;
+boolean trieIsValid=false;
+
+/// @brief Find the child of a trie node that holds a segment, adding it if needed
+/// @return the index of the child node, or -1 if the trie is full
+int trieChild(uint8 parent, const char* segment, unsigned int length)
+  {
+  for (uint8 c=topicTrie[parent].firstChild; c!=0; c=topicTrie[c].nextSibling)
     {
-    strcpy(buffer, "\nNo history yet.");
+    if (topicTrie[c].segmentLength==length 
+        && memcmp(trieSegments+topicTrie[c].segment,segment,length)==0)
+      return c;
     }
-  else
-    {
-    char datebuff[32];
-    unsigned int tempPointer=0;
-    if (histEntryCount>=HISTORY_BUFFER_SIZE)
-      tempPointer=histPointer; //it's a circular buffer
+  if (trieNodeCount>=TOPIC_TRIE_MAX_NODES 
+      || trieSegmentsUsed+length>TOPIC_TRIE_POOL_SIZE)
+    return -1;
 
-    strcpy(buffer,"");
-    for (int i=0;i<histEntryCount;i++)
+  uint8 child=trieNodeCount++;
+  topicTrie[child]=trieNode();
+  topicTrie[child].segment=trieSegmentsUsed;
+  topicTrie[child].segmentLength=length;
+  topicTrie[child].wildcard=(length==1 && *segment=='+');
+  memcpy(trieSegments+trieSegmentsUsed,segment,length);
+  trieSegmentsUsed+=length;
+  topicTrie[child].nextSibling=topicTrie[parent].firstChild;
+  topicTrie[parent].firstChild=child;
+  return child;
+  }
+
+/// @brief Add one topic filter to the trie
+/// @param filter the topic filter, possibly with wildcards
+/// @param filterNumber 0-based number of the filter, its bit in the match mask
+/// @return false if the trie is full or the filter is malformed
+boolean trieAddFilter(const char* filter, uint8 filterNumber)
+  {
+  uint32 bit=1UL<<filterNumber;
+  uint8 node=0;
+  const char* segment=filter;
+  while (true)
+    {
+    const char* end=segment;
+    while (*end!='\0' && *end!='/')
+      end++;
+    if (end-segment==1 && *segment=='#')
       {
-      unsigned long thisTime=history[tempPointer].timestamp;
-      sprintf(datebuff,"\n%d. %02d/%02d %02d:%02d:%02d ",i+1,month(thisTime),day(thisTime),hour(thisTime),minute(thisTime),second(thisTime));
-      strcat(buffer,datebuff);
+      topicTrie[node].multiRules|=bit;
+      return *end=='\0'; // # is only legal at the end of a filter
+      }
+    int child=trieChild(node,segment,end-segment);
+    if (child<0)
+      return false;
+    node=child;
+    if (*end=='\0')
+      break;
+    segment=end+1;
+    }
+  topicTrie[node].rules|=bit;
+  return true;
+  }
 
-      switch (history[tempPointer].topicNumber)
-        {
-        case 1:
-          strcat(buffer,settings.description1);
-          break;
-        
-        case 2:
-          strcat(buffer,settings.description2);
-          break;
-        
-        case 3:
-          strcat(buffer,settings.description3);
-          break;
-        
-        case 4:
-          strcat(buffer,settings.description4);
-          break;
-        
-        default:
-          strcat(buffer,"Unknown topic # ");
-          strcat(buffer,String(history[tempPointer].topicNumber).c_str());
-          break;
-        }
-      if (++tempPointer >= HISTORY_BUFFER_SIZE)
-        tempPointer=0; //circular buffer
+/// @brief Rebuild the topic trie from the rule topics
+/// @return true if all of the topics fit
+boolean compileTopicTrie()
+  {
+  topicTrie[0]=trieNode();
+  trieNodeCount=1;
+  trieSegmentsUsed=0;
+  trieIsValid=true;
+  for (uint8 i=0;i<MAX_RULES;i++)
+    {
+    if (strlen(settings.rules[i].topic)>0 && !trieAddFilter(settings.rules[i].topic,i))
+      {
+      Serial.print("************ Unable to compile topic \"");
+      Serial.print(settings.rules[i].topic);
+      Serial.println("\", matching the slow way.");
+      trieIsValid=false;
       }
     }
+  if (settings.debug)
+    {
+    Serial.print("Topic trie has ");
+    Serial.print(trieNodeCount);
+    Serial.print(" nodes and ");
+    Serial.print(trieSegmentsUsed);
+    Serial.println(" bytes of segment text");
+    }
+  return trieIsValid;
   }
 
-/**
- * Handler for incoming MQTT messages.  The payload is the command to perform. 
- * The MQTT response message topic sent is the incoming topic plus the command.
- * The incoming message should be one of mqttMessage1, mqttMessage2, mqttMessage3,
- * mqttMessage4, or one of the implemented commands.
- * 
- * Some of the devices that send these MQTT messages do so rapid-fire with repeats,
- * I guess just to make sure at least one gets through.  This code filters out all
- * but the first one, with at least REPEAT_LIMIT_MS seconds required between one and
- * the previous for it to be announced.
- */
-void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) 
+/// @brief Walk the trie from a node, matching the rest of a topic
+/// @param node the trie node that matched the previous segment
+/// @param segment start of the next topic segment, or NULL if the topic is used up
+/// @param first true at the root, where '$' topics don't match wildcards
+/// @return mask of the filters that match
+uint32 trieWalk(uint8 node, const char* segment, boolean first)
   {
-  static unsigned long noRepeat1=millis(); //these will be set to the current uptime counter plus 
-  static unsigned long noRepeat2=millis(); // the delay time, to keep multiple alerts from occurring.
-  static unsigned long noRepeat3=millis();
-  static unsigned long noRepeat4=millis();
+  boolean system=first && segment!=NULL && *segment=='$';
+  uint32 matched=system?0:topicTrie[node].multiRules;
+  if (segment==NULL)
+    return matched|topicTrie[node].rules;
+
+  const char* end=segment;
+  while (*end!='\0' && *end!='/')
+    end++;
+  unsigned int length=end-segment;
+  const char* next=*end=='/'?end+1:NULL;
+  for (uint8 c=topicTrie[node].firstChild; c!=0; c=topicTrie[c].nextSibling)
+    {
+    if ((topicTrie[c].wildcard && !system)
+        || (topicTrie[c].segmentLength==length 
+            && memcmp(trieSegments+topicTrie[c].segment,segment,length)==0))
+      matched|=trieWalk(c,next,false);
+    }
+  return matched;
+  }
 
+/// @brief Match an incoming topic against the topics of all of the rules
+/// @param topic the incoming mqtt topic
+/// @return mask with bit N set if the topic of rule N+1 matches
+uint32 matchTopic(const char* topic)
+  {
+  uint32 matched=0;
+  if (trieIsValid)
+    matched=trieWalk(0,topic,true);
+  else
+    {
+    for (uint8 i=0;i<MAX_RULES;i++)
+      {
+      if (strlen(settings.rules[i].topic)>0 && mqttCompare(topic,settings.rules[i].topic))
+        matched|=1UL<<i;
+      }
+    }
   if (settings.debug)
     {
-    Serial.println("====================================> Callback works.");
+    Serial.print("Topic match mask is 0x");
+    Serial.println(matched,HEX);
     }
-  payload[length]='\0'; //this should have been done in the caller code, shouldn't have to do it here
-  char charbuf[100];
-  sprintf(charbuf,"%s",payload);
-  char zero[]="\0";
-  char* response=zero;
+  return matched;
+  }
 
-  //The array below was created as a buffer for the settings when responding by MQTT to the 
-  //"settings" command (hence the variable name). It is also used to report the history via
-  //MQTT, so the size was increased to what you see. It is static because it's too big for
-  //the stack and must reside in the heap. The size can be reduced if necessary by making
-  //the history buffer smaller.
-  static char settingsResp[MQTT_BUFFER_SIZE];
+/*
+A rule's message is compiled into a matcher when the rules are saved, so that
+nothing about it has to be worked out again when a message arrives:
+  *           any payload
+  abc         exactly abc, or =abc if abc would otherwise mean something else
+  abc* *abc   a payload that starts or ends with abc
+  a?c*x       a glob, where * is any run of characters and ? any one character
+  >80 >=80 <80 <=80 10..20
+              a number in that range, to the nearest thousandth
+A message that looks like a number test but has no number in it is taken
+exactly, as it always was.  A rule with a JSON path matches its message against
+that field of a JSON payload instead of the whole payload.
 
-  settingsResp[0]='\0';
+Exact payloads are looked up in a small hash table instead of being compared
+one rule at a time, so the cost of a message doesn't grow with the number of
+rules.  The table is chained through payloadEntries, one entry per rule with
+an exact message.  Rules whose message is "*" accept any payload and are kept
+in a mask instead, and the rest are in masks of text and number matchers.
+*/
+enum matcherTypes {MATCH_EXACT, MATCH_ANY, MATCH_PREFIX, MATCH_SUFFIX, MATCH_GLOB, MATCH_NUMBER};
+typedef struct
+  {
+  uint8 type=MATCH_EXACT;
+  uint8 offset=0;       //where the text to match starts in the message
+  uint8 length=0;       //and its length
+  long long low=0;      //the range of a number, in thousandths, inclusive
+  long long high=0;
+  } payloadMatcher;
+#define MATCH_NUMBER_LIMIT 999999999999999LL //thousandths, more digits than this isn't a number we handle
 
-  if (settings.debug)
+typedef struct
+  {
+  uint32 hash=0;
+  uint8 ruleNumber=0; //0-based
+  uint8 next=0;       //1-based index of the next entry in this bucket, 0 at the end
+  } payloadEntry;
+payloadEntry payloadEntries[MAX_RULES];
+uint8 payloadBuckets[RULE_HASH_SLOTS]; //1-based index of the first entry in each bucket
+payloadMatcher payloadMatchers[MAX_RULES];
+uint32 anyPayloadRules=0;  //rules that match any payload
+uint32 exactRules=0;       //rules in the hash table
+uint32 textPatternRules=0; //rules with a prefix, suffix or glob
+uint32 numberRules=0;      //rules that test a number
+uint32 jsonRules=0;        //rules that match a field of a JSON payload
+uint32 activeRules=0;      //rules that have both a topic and a message
+
+/// @brief FNV-1a hash of a payload
+uint32 payloadHash(const char* payload, unsigned int length)
+  {
+  uint32 hash=2166136261UL;
+  for (unsigned int i=0;i<length;i++)
     {
-    Serial.print("========>Topic is \"");
-    Serial.print(reqTopic);
-    Serial.println("\"");
-    Serial.print("========>Payload is \"");
-    Serial.print(charbuf);
-    Serial.println("\".");
+    hash^=(uint8)payload[i];
+    hash*=16777619UL;
     }
+  return hash;
+  }
 
-  boolean needRestart=false;
-  if (strcmp(charbuf,"settings")==0 &&
-      strcmp(reqTopic,settings.commandTopic)==0) //special case, send all settings
+/// @brief Read a number in thousandths.  Spaces around it are allowed, nothing
+/// else is, and digits past the third decimal place are dropped.
+/// @param text the number, doesn't need to be null terminated
+/// @param length the length of text
+/// @param value where to put it
+/// @return false if it isn't a number
+boolean parseThousandths(const char* text, unsigned int length, long long* value)
+  {
+  unsigned int i=0;
+  while (i<length && text[i]==' ')
+    i++;
+  while (length>i && text[length-1]==' ')
+    length--;
+  boolean negative=false;
+  if (i<length && (text[i]=='-' || text[i]=='+'))
+    negative=text[i++]=='-';
+
+  long long number=0;
+  int digits=0;
+  int decimals=-1; //-1 until the decimal point
+  for (;i<length;i++)
     {
-    if (settings.debug)
-      Serial.println("Sending settings...");
-    strcpy(settingsResp,"\nssid=");
-    strcat(settingsResp,settings.ssid);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"wifipass=");
-    strcat(settingsResp,settings.wifiPassword);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"broker=");
-    strcat(settingsResp,settings.brokerAddress);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"brokerPort=");
-    strcat(settingsResp,String(settings.brokerPort).c_str());
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"userName=");
-    strcat(settingsResp,settings.mqttUsername);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"userPass=");
-    strcat(settingsResp,settings.mqttUserPassword);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"topic1=");
-    strcat(settingsResp,settings.mqttTopic1);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"topic2=");
-    strcat(settingsResp,settings.mqttTopic2);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"topic3=");
-    strcat(settingsResp,settings.mqttTopic3);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"topic4=");
-    strcat(settingsResp,settings.mqttTopic4);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"lwtMessage=");
-    strcat(settingsResp,settings.mqttLWTMessage);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"message1=");
-    strcat(settingsResp,settings.mqttMessage1);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"message2=");
-    strcat(settingsResp,settings.mqttMessage2);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"message3=");
-    strcat(settingsResp,settings.mqttMessage3);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"message4=");
-    strcat(settingsResp,settings.mqttMessage4);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"description1=");
-    strcat(settingsResp,settings.description1);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"description2=");
-    strcat(settingsResp,settings.description2);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"description3=");
-    strcat(settingsResp,settings.description3);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"description4=");
-    strcat(settingsResp,settings.description4);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"gmtOffset=");
-    strcat(settingsResp,String(settings.gmtOffset).c_str());
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"volume=");
-    strcat(settingsResp,String(settings.volume).c_str());
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"debug=");
-    strcat(settingsResp,settings.debug?"true":"false");
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"commandTopic=");
-    strcat(settingsResp,settings.commandTopic);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"MQTT client ID=");
-    strcat(settingsResp,settings.mqttClientId);
-    strcat(settingsResp,"\n");
-    strcat(settingsResp,"IP Address=");
-    strcat(settingsResp,WiFi.localIP().toString().c_str());
-    response=settingsResp;
-    }
-  else if (strcmp(charbuf,"history")==0 &&
-      strcmp(reqTopic,settings.commandTopic)==0) //another special case, send message history
+    char c=text[i];
+    if (c=='.' && decimals<0)
+      decimals=0;
+    else if (c<'0' || c>'9')
+      return false;
+    else if (decimals<3)
+      {
+      number=number*10+(c-'0');
+      digits++;
+      if (decimals>=0)
+        decimals++;
+      if (number>MATCH_NUMBER_LIMIT)
+        return false;
+      }
+    }
+  if (digits==0)
+    return false;
+  for (int d=decimals<0?0:decimals;d<3;d++)
+    number*=10;
+  if (number>MATCH_NUMBER_LIMIT)
+    return false;
+  *value=negative?-number:number;
+  return true;
+  }
+
+/// @brief Work out how to match a rule's message
+void compileMatcher(const char* message, payloadMatcher* m)
+  {
+  size_t length=strlen(message);
+  *m=payloadMatcher();
+  m->length=length;
+  if (message[0]=='=' && length>1) //taken exactly, whatever it looks like
     {
-    if (settings.debug)
-      Serial.println("Sending history...");
-    
-    buildReadableHistory(settingsResp);
-    response=settingsResp;
+    m->offset=1;
+    m->length=length-1;
+    return;
     }
-  else if (strcmp(charbuf,"status")==0 &&
-      strcmp(reqTopic,settings.commandTopic)==0) //report that we're alive
+  if (strcmp(message,"*")==0)
     {
-    strcpy(settingsResp,"Ready at ");
-    strcat(settingsResp,WiFi.localIP().toString().c_str());
-    response=settingsResp;
-    }   //check for target messages
-  else if (strlen(settings.mqttMessage1)>0 
-      && mqttCompare(reqTopic,settings.mqttTopic1)==true
-      && (strcmp(charbuf,settings.mqttMessage1)==0 
-        || strcmp(settings.mqttMessage1,"*")==0))
+    m->type=MATCH_ANY;
+    return;
+    }
+
+  //a number test
+  const char* dots=strstr(message,"..");
+  long long number;
+  if (dots!=NULL && dots>message
+      && parseThousandths(message,dots-message,&m->low)
+      && parseThousandths(dots+2,message+length-dots-2,&m->high))
     {
-    if (millis()>noRepeat1)
+    if (m->low>m->high)
       {
-      addHistoryEntry(1,timeClient.getEpochTime());
-      show(settings.description1,true);
-      myDFPlayer.play(1);
+      number=m->low;
+      m->low=m->high;
+      m->high=number;
       }
-    noRepeat1=millis()+REPEAT_LIMIT_MS; //can't do it again for a few seconds
-//    response="OK";
+    m->type=MATCH_NUMBER;
+    return;
     }
-  else if (strlen(settings.mqttMessage2)>0 
-      && mqttCompare(reqTopic,settings.mqttTopic2)==true
-      && (strcmp(charbuf,settings.mqttMessage2)==0 
-        || strcmp(settings.mqttMessage2,"*")==0))
+  if (message[0]=='>' || message[0]=='<')
     {
-    if (millis()>noRepeat2)
+    boolean orEqual=message[1]=='=';
+    int skip=orEqual?2:1;
+    if (parseThousandths(message+skip,length-skip,&number))
       {
-      addHistoryEntry(2,timeClient.getEpochTime());
-      show(settings.description2,true);
-      myDFPlayer.play(2);
+      m->type=MATCH_NUMBER;
+      m->low=-MATCH_NUMBER_LIMIT;
+      m->high=MATCH_NUMBER_LIMIT;
+      if (message[0]=='>')
+        m->low=orEqual?number:number+1;
+      else
+        m->high=orEqual?number:number-1;
+      return;
       }
-    noRepeat2=millis()+REPEAT_LIMIT_MS; //can't do it again for a few seconds
-//    response="OK";
     }
-  else if (strlen(settings.mqttMessage3)>0 
-      && mqttCompare(reqTopic,settings.mqttTopic3)==true
-      && (strcmp(charbuf,settings.mqttMessage3)==0 
-        || strcmp(settings.mqttMessage3,"*")==0))
+
+  //a text pattern
+  const char* star=strchr(message,'*');
+  boolean glob=strchr(message,'?')!=NULL || (star!=NULL && strchr(star+1,'*')!=NULL);
+  if (!glob && star==message+length-1)
     {
-    if (millis()>noRepeat3)
-      {
-      addHistoryEntry(3,timeClient.getEpochTime());
-      show(settings.description3,true);
-      myDFPlayer.play(3);
-      }
-    noRepeat3=millis()+REPEAT_LIMIT_MS; //can't do it again for a few seconds
-//    response="OK";
+    m->type=MATCH_PREFIX;
+    m->length=length-1;
     }
-  else if (strlen(settings.mqttMessage4)>0 
-      && mqttCompare(reqTopic,settings.mqttTopic4)==true
-      && (strcmp(charbuf,settings.mqttMessage4)==0 
-        || strcmp(settings.mqttMessage4,"*")==0))
+  else if (!glob && star==message)
     {
-    if (millis()>noRepeat4)
-      {
-      addHistoryEntry(4,timeClient.getEpochTime());
-      show(settings.description4,true);
-      myDFPlayer.play(4);
-      }
-    noRepeat4=millis()+REPEAT_LIMIT_MS; //don't do it again for a few seconds
-//    response="OK";
+    m->type=MATCH_SUFFIX;
+    m->offset=1;
+    m->length=length-1;
     }
-  else if (strcmp(reqTopic,settings.commandTopic)==0)
+  else if (glob || star!=NULL)
+    m->type=MATCH_GLOB;
+  }
+
+/// @brief Match a glob, where * is any run of characters and ? any one
+boolean globMatch(const char* pattern, unsigned int patternLength, const char* text, unsigned int length)
+  {
+  unsigned int p=0;
+  unsigned int t=0;
+  unsigned int starAt=0;   //just past the last * seen, 0 for none
+  unsigned int retryAt=0;  //where in the text that * would take up next
+  while (t<length)
     {
-    needRestart=processCommand(charbuf);
-    if (needRestart && settingsAreValid)
+    if (p<patternLength && pattern[p]=='*')
       {
-      char tmp[]="OK, restarting";
-      response=tmp;
+      starAt=++p;
+      retryAt=t;
       }
-//    else
-//      response="OK";
+    else if (p<patternLength && (pattern[p]=='?' || pattern[p]==text[t]))
+      {
+      p++;
+      t++;
+      }
+    else if (starAt>0)
+      {
+      p=starAt;        //the last * takes one more character
+      t=++retryAt;
+      }
+    else
+      return false;
     }
-  else
+  while (p<patternLength && pattern[p]=='*')
+    p++;
+  return p==patternLength;
+  }
+
+/// @brief Match a payload against one of the text patterns
+boolean textMatches(const payloadMatcher* m, const char* message, const char* payload, unsigned int length)
+  {
+  const char* text=message+m->offset;
+  switch (m->type)
     {
-    // char badCmd[18];
-    // strcpy(badCmd,"(empty)");
-    // response=badCmd;
+    case MATCH_PREFIX:
+      return length>=m->length && memcmp(payload,text,m->length)==0;
+    case MATCH_SUFFIX:
+      return length>=m->length && memcmp(payload+length-m->length,text,m->length)==0;
+    case MATCH_GLOB:
+      return globMatch(text,m->length,payload,length);
+    default:
+      return false;
     }
+  }
 
-  //prepare the response topic
-  if (response[0]!='\0')
-    { 
-    char topic[MQTT_MAX_TOPIC_SIZE];
-    strcpy(topic,reqTopic);
-    strcat(topic,"/");
-    strcat(topic,charbuf); //the incoming command becomes the topic suffix
-    if (!publish(topic,response,false)) //do not retain
-      Serial.println("************ Failure when publishing status response!");
-    }
-  if (needRestart)
+/// @brief Match a payload against any kind of matcher
+boolean matcherMatches(const payloadMatcher* m, const char* message, const char* payload, unsigned int length)
+  {
+  long long number;
+  switch (m->type)
     {
-    delay(1000); //let all outgoing messages flush through
-    ESP.restart();
+    case MATCH_ANY:
+      return true;
+    case MATCH_EXACT:
+      return m->length==length && memcmp(message+m->offset,payload,length)==0;
+    case MATCH_NUMBER:
+      return parseThousandths(payload,length,&number) && number>=m->low && number<=m->high;
+    default:
+      return textMatches(m,message,payload,length);
     }
   }
 
+/*
+ * JSON payloads are never parsed into anything.  jsonField() makes one pass over
+ * the raw bytes, skipping whole values that aren't on the path without looking
+ * inside them any more than it takes to find their end, and stops at the field.
+ */
+
+/// @brief Skip spaces, tabs and line ends
+unsigned int jsonSpace(const char* json, unsigned int length, unsigned int pos)
+  {
+  while (pos<length && (json[pos]==' ' || json[pos]=='\t' || json[pos]=='\n' || json[pos]=='\r'))
+    pos++;
+  return pos;
+  }
 
-boolean sendMessage(char* topic, char* value)
-  { 
-  boolean success=false;
-  if (!mqttClient.connected())
+/// @brief Find the end of the string that starts at pos, just past its closing quote
+unsigned int jsonStringEnd(const char* json, unsigned int length, unsigned int pos)
+  {
+  for (pos++;pos<length;pos++)
     {
-    Serial.println("Not connected to MQTT broker!");
+    if (json[pos]=='\\')
+      pos++; //whatever is escaped can't end the string
+    else if (json[pos]=='"')
+      return pos+1;
     }
-  else
-    {
-    char topicBuf[MQTT_MAX_TOPIC_SIZE+MQTT_MAX_MESSAGE_SIZE];
-    char reading[18];
-//    boolean success=false; //only for the incoming topic and value
+  return length;
+  }
 
-    //publish the radio strength reading while we're at it
-    strcpy(topicBuf,settings.mqttTopic1);
-    strcat(topicBuf,MQTT_TOPIC_RSSI);
-    sprintf(reading,"%d",WiFi.RSSI()); 
-    success=publish(topicBuf,reading,true); //retain
-    if (!success)
-      Serial.println("************ Failed publishing rssi!");
-    
-    //publish the message
-    strcpy(topicBuf,settings.mqttTopic1);
-    strcat(topicBuf,topic);
-    success=publish(topicBuf,value,true); //retain
-    if (!success)
-      Serial.println("************ Failed publishing "+String(topic)+"! ("+String(success)+")");
+/// @brief Find the end of the value that starts at pos
+unsigned int jsonValueEnd(const char* json, unsigned int length, unsigned int pos)
+  {
+  if (pos<length && json[pos]=='"')
+    return jsonStringEnd(json,length,pos);
+  if (pos<length && (json[pos]=='{' || json[pos]=='['))
+    {
+    int depth=0;
+    while (pos<length)
+      {
+      char c=json[pos];
+      if (c=='"')
+        {
+        pos=jsonStringEnd(json,length,pos);
+        continue;
+        }
+      pos++;
+      if (c=='{' || c=='[')
+        depth++;
+      else if ((c=='}' || c==']') && --depth==0)
+        break;
+      }
+    return pos;
     }
-  return success;
+  while (pos<length && json[pos]!=',' && json[pos]!='}' && json[pos]!=']'
+         && json[pos]!=' ' && json[pos]!='\t' && json[pos]!='\n' && json[pos]!='\r')
+    pos++; //a number, true, false or null
+  return pos;
   }
 
-
-/// @brief Converts a 0-10 range for volume to 0-30 and sends it to the DFPlayer.
-/// @param volume int
-void adjustVolume(int volume)
+/// @brief Find a field in a JSON object.  A string's value is what's between its
+/// quotes, with any escapes left as they are.  Any other value is as written.
+/// @param json the payload, doesn't need to be null terminated
+/// @param length the length of the payload
+/// @param path the name of the field, or names separated by dots for a field in
+/// an object in the object
+/// @param value set to the start of the field's value
+/// @param valueLength set to the length of the value
+/// @return false if the payload isn't an object or doesn't have the field
+boolean jsonField(const char* json, unsigned int length, const char* path,
+                  const char** value, unsigned int* valueLength)
   {
-  if (volume>=0 && volume<=10)
+  unsigned int pos=jsonSpace(json,length,0);
+  if (pos>=length || json[pos]!='{')
+    return false;
+  pos++;
+  size_t nameLength=strcspn(path,".");
+  while (true)
     {
-    int vol=volume*3;
-    myDFPlayer.volume(vol);
+    pos=jsonSpace(json,length,pos);
+    if (pos>=length || json[pos]!='"')
+      return false; //the end of the object, or not JSON
+    unsigned int nameEnd=jsonStringEnd(json,length,pos);
+    boolean found=nameEnd-pos-2==nameLength && memcmp(json+pos+1,path,nameLength)==0;
+    pos=jsonSpace(json,length,nameEnd);
+    if (pos>=length || json[pos]!=':')
+      return false;
+    pos=jsonSpace(json,length,pos+1);
+    if (found && path[nameLength]=='.')
+      {
+      if (pos>=length || json[pos]!='{')
+        return false; //there's nothing inside this field
+      path+=nameLength+1;
+      nameLength=strcspn(path,".");
+      pos++;
+      continue;
+      }
+    unsigned int end=jsonValueEnd(json,length,pos);
+    if (found)
+      {
+      if (end==pos)
+        return false; //no value at all
+      boolean quoted=json[pos]=='"';
+      if (quoted && (end<pos+2 || json[end-1]!='"'))
+        return false; //the string doesn't end
+      *value=json+pos+(quoted?1:0);
+      *valueLength=end-pos-(quoted?2:0);
+      return true;
+      }
+    pos=jsonSpace(json,length,end);
+    if (pos>=length || json[pos]!=',')
+      return false;
+    pos++;
     }
   }
 
-void otaSetup()
+/// @brief Rebuild the payload hash table and matchers from the rule messages
+void compilePayloadIndex()
   {
-  // Port defaults to 3232
-  // ArduinoOTA.setPort(3232);
+  uint8 used=0;
+  memset(payloadBuckets,0,sizeof(payloadBuckets));
+  anyPayloadRules=0;
+  exactRules=0;
+  textPatternRules=0;
+  numberRules=0;
+  jsonRules=0;
+  activeRules=0;
+  for (uint8 i=0;i<MAX_RULES;i++)
+    {
+    rule* r=&settings.rules[i];
+    if (strlen(r->topic)==0 || strlen(r->message)==0)
+      continue;
+    activeRules|=1UL<<i;
+    payloadMatcher* m=&payloadMatchers[i];
+    compileMatcher(r->message,m);
+    if (settings.jsonPaths[i][0]!='\0')
+      jsonRules|=1UL<<i; //matched against the field, one at a time
+    else if (m->type==MATCH_ANY)
+      anyPayloadRules|=1UL<<i;
+    else if (m->type==MATCH_NUMBER)
+      numberRules|=1UL<<i;
+    else if (m->type!=MATCH_EXACT)
+      textPatternRules|=1UL<<i;
+    else
+      {
+      exactRules|=1UL<<i;
+      uint32 hash=payloadHash(r->message+m->offset,m->length);
+      uint8 bucket=hash&(RULE_HASH_SLOTS-1);
+      payloadEntries[used].hash=hash;
+      payloadEntries[used].ruleNumber=i;
+      payloadEntries[used].next=payloadBuckets[bucket];
+      payloadBuckets[bucket]=++used;
+      }
+    }
+  }
 
-  // Hostname defaults to esp3232-[MAC]
-  // ArduinoOTA.setHostname("myesp32");
+/// @brief Find the rules among the candidates whose messages match a payload
+/// @param candidates mask of the rules to try
+/// @param payload the message, doesn't need to be null terminated
+/// @param length the length of the message
+/// @return mask of the rules that match
+uint32 matchPayload(uint32 candidates, const char* payload, unsigned int length)
+  {
+  uint32 matched=candidates&anyPayloadRules;
+  if ((candidates&exactRules)!=0 && length<=MQTT_MAX_MESSAGE_SIZE) //no exact message is longer
+    {
+    uint32 hash=payloadHash(payload,length);
+    for (uint8 e=payloadBuckets[hash&(RULE_HASH_SLOTS-1)]; e!=0; e=payloadEntries[e-1].next)
+      {
+      payloadEntry* entry=&payloadEntries[e-1];
+      uint32 bit=1UL<<entry->ruleNumber;
+      const payloadMatcher* m=&payloadMatchers[entry->ruleNumber];
+      const char* message=settings.rules[entry->ruleNumber].message+m->offset;
+      if (entry->hash==hash && (candidates&bit) 
+          && m->length==length && memcmp(message,payload,length)==0)
+        matched|=bit;
+      }
+    }
 
-  // No authentication by default
-  // ArduinoOTA.setPassword("admin");
+  for (uint32 rules=candidates&textPatternRules;rules!=0;rules&=rules-1)
+    {
+    int i=__builtin_ctz(rules);
+    if (textMatches(&payloadMatchers[i],settings.rules[i].message,payload,length))
+      matched|=1UL<<i;
+    }
 
-  // Password can be set with it's md5 value as well
-  // MD5(admin) = 21232f297a57a5a743894a0e4a801fc3
-  // ArduinoOTA.setPasswordHash("21232f297a57a5a743894a0e4a801fc3");
+  long long number;
+  uint32 rules=candidates&numberRules;
+  if (rules!=0 && parseThousandths(payload,length,&number)) //the payload is only read as a number once
+    {
+    for (;rules!=0;rules&=rules-1)
+      {
+      int i=__builtin_ctz(rules);
+      if (number>=payloadMatchers[i].low && number<=payloadMatchers[i].high)
+        matched|=1UL<<i;
+      }
+    }
 
-  ArduinoOTA.onStart([]() 
+  const char* lastPath=NULL; //rules on the same field share the search for it
+  const char* value=NULL;
+  unsigned int valueLength=0;
+  for (uint32 rules=candidates&jsonRules;rules!=0;rules&=rules-1)
     {
-    String type;
-    if (ArduinoOTA.getCommand() == U_FLASH)
-      type = "sketch";
-    else // U_SPIFFS
-      type = "filesystem";
+    int i=__builtin_ctz(rules);
+    const char* path=settings.jsonPaths[i];
+    if (lastPath==NULL || strcmp(path,lastPath)!=0)
+      {
+      if (!jsonField(payload,length,path,&value,&valueLength))
+        value=NULL;
+      lastPath=path;
+      }
+    if (value!=NULL && matcherMatches(&payloadMatchers[i],settings.rules[i].message,value,valueLength))
+      matched|=1UL<<i;
+    }
+  return matched;
+  }
 
-    // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
-    Serial.println("Start updating " + type);
-    });
+/// @brief Find the rule for an incoming message. If more than one rule 
+/// matches, the lowest numbered one wins.
+/// @param topic the incoming mqtt topic
+/// @param payload the message, doesn't need to be null terminated
+/// @param length the length of the message
+/// @return the 0-based rule number, or -1 if no rule matches
+int findRule(const char* topic, const char* payload, unsigned int length)
+  {
+  uint32 candidates=matchTopic(topic)&activeRules;
+  if (candidates==0)
+    return -1;
+  uint32 matched=matchPayload(candidates,payload,length);
+  return matched==0?-1:__builtin_ctz(matched);
+  }
 
-    ArduinoOTA.onEnd([]() {
-      Serial.println("\nEnd");
-    });
+/// @brief Time the topic trie against mqttCompare() for one topic and
+/// print the results to the serial port.
+/// @param topic the topic to match against the rule topics
+void benchmarkTopicMatch(const char* topic)
+  {
+  if (strlen(topic)==0 || strlen(topic)>=MQTT_MAX_TOPIC_SIZE)
+    {
+    Serial.println("Usage: benchmark=<topic>");
+    return;
+    }
 
-    ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) 
+  boolean wasDebug=settings.debug;
+  settings.debug=false; //don't time the debug messages
+  volatile uint32 oldMatch=0;
+  volatile uint32 newMatch=0;
+
+  unsigned long start=micros();
+  for (int i=0;i<BENCHMARK_ITERATIONS;i++)
+    {
+    uint32 matched=0;
+    for (uint8 j=0;j<MAX_RULES;j++)
+      {
+      if (strlen(settings.rules[j].topic)>0 && mqttCompare(topic,settings.rules[j].topic))
+        matched|=1UL<<j;
+      }
+    oldMatch=matched;
+    if (i%1000==0)
+      yield(); //keep the watchdog happy
+    }
+  unsigned long oldTime=micros()-start;
+
+  start=micros();
+  for (int i=0;i<BENCHMARK_ITERATIONS;i++)
+    {
+    newMatch=matchTopic(topic);
+    if (i%1000==0)
+      yield();
+    }
+  unsigned long newTime=micros()-start;
+  settings.debug=wasDebug;
+
+  Serial.print("Matching \"");
+  Serial.print(topic);
+  Serial.print("\" ");
+  Serial.print(BENCHMARK_ITERATIONS);
+  Serial.println(" times:");
+  Serial.print("  mqttCompare: ");
+  Serial.print(oldTime);
+  Serial.print(" us, mask 0x");
+  Serial.println(oldMatch,HEX);
+  Serial.print("  topic trie:  ");
+  Serial.print(newTime);
+  Serial.print(" us, mask 0x");
+  Serial.println(newMatch,HEX);
+  if (oldMatch!=newMatch)
+    Serial.println("  ************ Results differ!");
+  }
+
+/// @brief Match a payload the way it would be done without compiled matchers,
+/// working out each rule's matcher again, for the benchmark
+uint32 interpretPayload(uint32 candidates, const char* payload, unsigned int length)
+  {
+  uint32 matched=0;
+  for (uint32 rules=candidates;rules!=0;rules&=rules-1)
+    {
+    int i=__builtin_ctz(rules);
+    const char* message=settings.rules[i].message;
+    payloadMatcher m;
+    compileMatcher(message,&m);
+    const char* value=payload;
+    unsigned int valueLength=length;
+    if (settings.jsonPaths[i][0]!='\0' && !jsonField(payload,length,settings.jsonPaths[i],&value,&valueLength))
+      continue;
+    if (matcherMatches(&m,message,value,valueLength))
+      matched|=1UL<<i;
+    }
+  return matched;
+  }
+
+/// @brief Time the compiled payload matchers against comparing each rule's 
+/// message and against interpreting it, and print the results to the serial port.
+/// @param payload the payload to match against the rule messages
+void benchmarkPayloadMatch(const char* payload)
+  {
+  unsigned int length=strlen(payload);
+  if (length==0)
+    {
+    Serial.println("Usage: benchmarkpayload=<payload>");
+    return;
+    }
+
+  volatile uint32 oldMatch=0;
+  volatile uint32 interpretedMatch=0;
+  volatile uint32 newMatch=0;
+
+  unsigned long start=micros();
+  for (int i=0;i<BENCHMARK_ITERATIONS;i++)
+    {
+    uint32 matched=0;
+    for (uint8 j=0;j<MAX_RULES;j++)
+      {
+      const char* message=settings.rules[j].message;
+      if ((activeRules&(1UL<<j)) && (strcmp(message,"*")==0 || payloadIs(payload,length,message)))
+        matched|=1UL<<j;
+      }
+    oldMatch=matched;
+    if (i%1000==0)
+      yield(); //keep the watchdog happy
+    }
+  unsigned long oldTime=micros()-start;
+
+  start=micros();
+  for (int i=0;i<BENCHMARK_ITERATIONS;i++)
+    {
+    interpretedMatch=interpretPayload(activeRules,payload,length);
+    if (i%1000==0)
+      yield();
+    }
+  unsigned long interpretedTime=micros()-start;
+
+  start=micros();
+  for (int i=0;i<BENCHMARK_ITERATIONS;i++)
+    {
+    newMatch=matchPayload(activeRules,payload,length);
+    if (i%1000==0)
+      yield();
+    }
+  unsigned long newTime=micros()-start;
+
+  Serial.printf("Matching payload \"%s\" %d times:\n",payload,BENCHMARK_ITERATIONS);
+  Serial.printf("  exact and * only: %lu us, mask 0x%lX\n",oldTime,(unsigned long)oldMatch);
+  Serial.printf("  interpreted:      %lu us, mask 0x%lX\n",interpretedTime,(unsigned long)interpretedMatch);
+  Serial.printf("  compiled:         %lu us, mask 0x%lX\n",newTime,(unsigned long)newMatch);
+  if (interpretedMatch!=newMatch)
+    Serial.println("  ************ Results differ!");
+  }
+
+void writeHistoryLine(Print& out, int number, uint8 ruleNumber, unsigned long thisTime)
+  {
+  char datebuff[32];
+  sprintf(datebuff,"\n%d. %02d/%02d %02d:%02d:%02d ",number,month(thisTime),day(thisTime),hour(thisTime),minute(thisTime),second(thisTime));
+  out.print(datebuff);
+
+  if (ruleNumber>=1 && ruleNumber<=MAX_RULES)
+    out.print(settings.rules[ruleNumber-1].description);
+  else
+    {
+    out.print("Unknown topic # ");
+    out.print(ruleNumber);
+    }
+  }
+
+/*
+Convert the history buffer from a binary format to something that
+is readable by humans, and write it to out. The output can be any
+Print, such as the serial port or an MQTT reply being streamed.
+*/
+void writeHistory(Print& out)
+  {
+  if (histEntryCount==0)
+    {
+    out.print("\nNo history yet.");
+    }
+  else
+    {
+    unsigned int tempPointer=0;
+    if (histEntryCount>=HISTORY_BUFFER_SIZE)
+      tempPointer=histPointer; //it's a circular buffer
+
+    for (int i=0;i<histEntryCount;i++)
+      {
+      writeHistoryLine(out,i+1,history[tempPointer].topicNumber,history[tempPointer].timestamp);
+      if (++tempPointer >= HISTORY_BUFFER_SIZE)
+        tempPointer=0; //circular buffer
+      }
+    }
+  }
+
+/// @brief Parse a date range for the "history=" command
+/// @param range "yyyy-mm-dd" for everything since that day, or "yyyy-mm-dd,yyyy-mm-dd" 
+/// for everything from the start of the first day to the end of the second
+/// @return true if the range was understood and set for writeHistoryRange()
+boolean setHistoryRange(const char* range)
+  {
+  int y1,m1,d1,y2,m2,d2;
+  int fields=sscanf(range,"%d-%d-%d,%d-%d-%d",&y1,&m1,&d1,&y2,&m2,&d2);
+  if (fields!=3 && fields!=6)
+    return false;
+  if (fields==3)
+    {
+    y2=2105; //as late as a 32 bit timestamp goes
+    m2=12;
+    d2=31;
+    }
+  if (y1<1970 || y2<1970 || y1>2105 || y2>2105 
+      || m1<1 || m1>12 || m2<1 || m2>12 || d1<1 || d1>31 || d2<1 || d2>31)
+    return false;
+
+  tmElements_t tm={0,0,0,0,(uint8_t)d1,(uint8_t)m1,(uint8_t)(y1-1970)};
+  historyFrom=makeTime(tm);
+  tm={59,59,23,0,(uint8_t)d2,(uint8_t)m2,(uint8_t)(y2-1970)};
+  historyTo=makeTime(tm);
+  return historyFrom<=historyTo;
+  }
+
+/*
+Write the records in the history log on flash that fall between historyFrom
+and historyTo. Only the segments that overlap the range are opened, and the
+first record in each is found with a binary search.
+*/
+void writeHistoryRange(Print& out)
+  {
+  int number=0;
+  logRecord rec;
+  char path[24];
+  for (int i=0;i<logSegmentCount;i++)
+    {
+    logSegment* seg=&logSegments[i];
+    if (seg->count==0 || seg->last<historyFrom || seg->first>historyTo)
+      continue;
+    segmentPath(path,seg->sequence);
+    File f=LittleFS.open(path,"r");
+    if (!f)
+      continue;
+
+    uint16 low=0;
+    uint16 high=seg->count;
+    while (low<high)
+      {
+      uint16 mid=(low+high)/2;
+      if (!readLogRecord(f,mid,&rec) || rec.timestamp<historyFrom)
+        low=mid+1;
+      else
+        high=mid;
+      }
+
+    for (uint16 j=low;j<seg->count;j++)
+      {
+      if (!readLogRecord(f,j,&rec))
+        continue;
+      if (rec.timestamp>historyTo)
+        break;
+      if (number==HISTORY_QUERY_MAX)
+        {
+        out.print("\n...");
+        return;
+        }
+      writeHistoryLine(out,++number,rec.ruleNumber,rec.timestamp);
+      }
+    }
+  if (number==0)
+    out.print("\nNo history in that range.");
+  }
+
+/// @brief Compare a payload that isn't null terminated with a string
+boolean payloadIs(const char* payload, unsigned int length, const char* text)
+  {
+  return strlen(text)==length && memcmp(payload,text,length)==0;
+  }
+
+/// @brief Append text to a fixed size buffer, keeping it null terminated
+/// @param buffer the buffer
+/// @param size the size of the buffer
+/// @param used the length of what's in the buffer so far, updated
+/// @param text what to add, doesn't need to be null terminated
+/// @param length the length of text
+/// @return false if it didn't fit, in which case the buffer is unchanged
+boolean appendBounded(char* buffer, size_t size, size_t* used, const char* text, size_t length)
+  {
+  if (*used+length+1>size)
+    return false;
+  memcpy(buffer+*used,text,length);
+  *used+=length;
+  buffer[*used]='\0';
+  return true;
+  }
+
+/// @brief Write the reply to the "status" command
+void writeStatus(Print& out)
+  {
+  out.print("Ready at ");
+  out.print(WiFi.localIP());
+  out.printf(", worst loop %lu us",worstLoopMicros);
+  out.printf(", play queue %u, last wait %lu ms, max wait %lu ms, coalesced %lu, dropped %lu",
+             playQueueCount,playWaitLast,playWaitMax,playCoalesced,playDropped);
+  out.printf(", settings generation %lu, ",(unsigned long)settingsGeneration);
+  writeTimeStatus(out);
+  out.print(", ");
+  writeMqttStatus(out);
+  out.print(", ");
+  writeHeapStatus(out);
+  writeRuleCounts(out);
+  }
+
+void writeRestarting(Print& out)
+  {
+  out.print("OK, restarting");
+  }
+
+/*
+ * A Print that only counts what is written to it.  Replies are generated twice,
+ * once into one of these to learn their length for the MQTT header, and once
+ * into the MQTT client.  That way no reply ever has to fit in memory.  Replies
+ * that can work out their own length, like the settings, skip the first pass.
+ */
+class lengthCounter : public Print
+  {
+  public:
+    size_t length=0;
+    size_t write(uint8_t) override { length++; return 1; }
+    size_t write(const uint8_t*, size_t size) override { length+=size; return size; }
+  };
+
+/*
+ * A Print that collects what is written to it into small chunks before handing
+ * them to the MQTT client, which would otherwise send each byte to the network
+ * on its own.
+ */
+class chunkedPublisher : public Print
+  {
+  public:
+    size_t write(uint8_t c) override 
+      {
+      if (used==sizeof(chunk))
+        flush();
+      chunk[used++]=c;
+      return 1;
+      }
+    size_t write(const uint8_t* data, size_t size) override
+      {
+      for (size_t i=0;i<size;i++)
+        write(data[i]);
+      return size;
+      }
+    void flush()
+      {
+      if (used>0 && mqttClient.write(chunk,used)!=used)
+        failed=true;
+      used=0;
+      }
+    boolean failed=false;
+  private:
+    uint8_t chunk[MQTT_CHUNK_SIZE];
+    size_t used=0;
+  };
+
+/// @brief Publish a reply of any length by streaming it to the broker.
+/// @param topic the topic to publish to
+/// @param writer the function that writes the reply
+/// @param retain true to have the broker retain it
+/// @param measure works out the length of the reply without writing it, NULL 
+/// to have the writer write it twice
+/// @return true if it was sent
+boolean publishStream(const char* topic, void (*writer)(Print&), boolean retain, size_t (*measure)())
+  {
+  replyMillis=millis(); //the same for both passes
+  size_t length;
+  if (measure!=NULL)
+    length=measure();
+  else
+    {
+    lengthCounter counter;
+    writer(counter);
+    length=counter.length;
+    }
+  Serial.print(topic);
+  Serial.print(" (");
+  Serial.print(length);
+  Serial.println(" bytes)");
+
+  if (!mqttClient.beginPublish(topic,length,retain))
+    return false;
+  chunkedPublisher out;
+  writer(out);
+  out.flush();
+  return mqttClient.endPublish() && !out.failed;
+  }
+
+/// @brief The packet id of a QoS 1 message, 0 for QoS 0.  PubSubClient leaves 
+/// it in its buffer between the topic's terminator and the payload.
+uint16 packetId(const char* topic, const byte* payload)
+  {
+  const byte* afterTopic=(const byte*)topic+strlen(topic)+1;
+  if (payload-afterTopic!=2)
+    return 0;
+  return (uint16)(payload[-2]<<8 | payload[-1]);
+  }
+
+/// @brief Check a QoS 1 message against the recent ones, and remember it.
+/// Only the start of the payload and its length go into the hash, because the
+/// packet id has to match too, so a long payload isn't read through for it.
+/// @return true if we've handled this one already
+boolean isRedelivery(uint16 id, const char* topic, const char* message, unsigned int length)
+  {
+  unsigned int hashed=length<REDELIVERY_HASH_BYTES?length:REDELIVERY_HASH_BYTES;
+  uint32 hash=(payloadHash(topic,strlen(topic))*31+payloadHash(message,hashed))*31+length;
+  for (int i=0;i<RECENT_PACKET_IDS;i++)
+    {
+    if (recentPackets[i].id==id && recentPackets[i].hash==hash)
+      return true;
+    }
+  recentPackets[recentPacketNext].id=id;
+  recentPackets[recentPacketNext].hash=hash;
+  recentPacketNext=(recentPacketNext+1)%RECENT_PACKET_IDS;
+  return false;
+  }
+
+/// @brief Decide whether a matched rule should alert, and count it if not.
+/// @param ruleNumber the index of the rule
+/// @param debounce false to skip the debounce time, for QoS 1 messages whose 
+/// repeats are caught by packet id instead
+/// @return true if it's outside the debounce time and within the rate limit
+boolean ruleAllows(int ruleNumber, boolean debounce)
+  {
+  rule* r=&settings.rules[ruleNumber];
+  rateLimit* limit=&settings.rates[ruleNumber];
+  ruleState* state=&ruleStates[ruleNumber];
+  unsigned long now=millis();
+
+  if (debounce && state->alerted && now-state->lastAlert<r->debounceMs)
+    {
+    state->debounced++;
+    return false;
+    }
+
+  if (limit->count>0)
+    {
+    //one token comes back every tokenMs, up to a full bucket
+    unsigned long tokenMs=(limit->seconds*1000UL)/limit->count;
+    if (!state->alerted)
+      {
+      state->tokens=limit->count;
+      state->lastRefill=now;
+      }
+    else if (tokenMs>0)
+      {
+      unsigned long earned=(now-state->lastRefill)/tokenMs;
+      if (earned>=(unsigned long)(limit->count-state->tokens))
+        {
+        state->tokens=limit->count;
+        state->lastRefill=now;
+        }
+      else
+        {
+        state->tokens+=earned;
+        state->lastRefill+=earned*tokenMs; //keep the part of a token already earned
+        }
+      }
+    if (state->tokens==0)
+      {
+      state->rateLimited++;
+      return false;
+      }
+    state->tokens--;
+    }
+
+  state->alerted=true;
+  state->lastAlert=now;
+  state->alerts++;
+  return true;
+  }
+
+/// @brief Write how many alerts each rule in use has made and suppressed
+void writeRuleCounts(Print& out)
+  {
+  for (int i=0;i<MAX_RULES;i++)
+    {
+    ruleState* state=&ruleStates[i];
+    if (state->alerts==0 && state->debounced==0 && state->rateLimited==0)
+      continue;
+    out.printf("\nrule %d: alerts %lu, debounced %lu, rate limited %lu",
+               i+1,state->alerts,state->debounced,state->rateLimited);
+    }
+  }
+
+/// @brief Find the histogram bucket for a time, the power of two below it
+int latencyBucket(unsigned long micros)
+  {
+  int bucket=0;
+  while (micros>1 && bucket<LATENCY_BUCKETS-1)
+    {
+    micros>>=1;
+    bucket++;
+    }
+  return bucket;
+  }
+
+void recordLatency(int stage, unsigned long micros)
+  {
+  latency[stage][latencyBucket(micros)]++;
+  }
+
+/// @brief Account for the time a section of loop() took, and note it if it
+/// went over its budget.
+/// @param section which one
+/// @param start micros() when it started
+/// @return micros() now, which is when the next section starts
+unsigned long profileSection(int section, unsigned long start)
+  {
+  unsigned long now=micros();
+  unsigned long elapsed=now-start;
+  sectionProfile* p=&profile[section];
+  p->calls++;
+  p->totalMicros+=elapsed;
+  if (elapsed>p->maxMicros)
+    p->maxMicros=elapsed;
+  p->histogram[latencyBucket(elapsed)]++;
+  if (elapsed>sectionBudgets[section] && bootStep==BOOT_DONE) //startup is allowed to be slow
+    {
+    p->stalls++;
+    lastStallSection=section;
+    lastStallMicros=elapsed;
+    lastStallAt=millis();
+    if (settings.debug)
+      Serial.printf("Stall in %s, %lu us\n",sectionNames[section],elapsed);
+    }
+  return now;
+  }
+
+void resetProfile()
+  {
+  memset(profile,0,sizeof(profile));
+  lastStallSection=-1;
+  }
+
+/*
+ * Write the loop() profile, one line per section.  The 99th percentile is the
+ * top of the histogram bucket it falls in, so it is an upper bound.
+ */
+void writeProfile(Print& out)
+  {
+  out.print("\nsection calls mean p99 max budget stalls (us)");
+  for (int section=0;section<SECTION_COUNT;section++)
+    {
+    sectionProfile* p=&profile[section];
+    unsigned long p99=0;
+    unsigned long long count=0;
+    for (int i=0;i<LATENCY_BUCKETS && p->calls>0;i++)
+      {
+      count+=p->histogram[i];
+      if (count*100>=(unsigned long long)p->calls*99)
+        {
+        p99=(2UL<<i)-1;
+        break;
+        }
+      }
+    if (p99>p->maxMicros)
+      p99=p->maxMicros; //the max is exact
+    out.printf("\n%s %lu %lu %lu %lu %lu %lu",sectionNames[section],p->calls,
+               p->calls==0?0:(unsigned long)(p->totalMicros/p->calls),p99,p->maxMicros,
+               sectionBudgets[section],p->stalls);
+    }
+  if (lastStallSection>=0)
+    out.printf("\nlast stall: %s, %lu us, %lu s ago",sectionNames[lastStallSection],
+               lastStallMicros,(replyMillis-lastStallAt)/1000);
+  else
+    out.print("\nno stalls");
+  }
+
+/*
+ * Write the telemetry as compact JSON.  Each histogram is a list of counts where
+ * entry n is for times from 2^n to 2^(n+1)-1 microseconds.  Empty buckets at the
+ * end are left off.
+ */
+void writeTelemetry(Print& out)
+  {
+  out.printf("{\"fw\":\"%s\",\"up\":%lu,\"gen\":%lu,\"matched\":%lu,\"suppressed\":%lu,\"unmatched\":%lu",
+             FIRMWARE_VERSION,replyMillis/1000,(unsigned long)settingsGeneration,
+             messagesMatched,messagesSuppressed,messagesUnmatched);
+  out.printf(",\"redelivered\":%lu",messagesRedelivered);
+  out.printf(",\"mqtt\":{\"attempts\":%lu,\"connects\":%lu,\"lost\":%lu}",
+             mqttAttempts,mqttConnects,mqttDisconnects);
+  out.printf(",\"serial\":{\"lines\":%lu,\"overruns\":%lu}",serialLines,serialOverruns);
+  out.printf(",\"heap\":{\"free\":%lu,\"block\":%lu,\"frag\":%u,\"minFree\":%lu,\"minBlock\":%lu}",
+             (unsigned long)heapFree,(unsigned long)heapBlock,heapFragmentation,
+             (unsigned long)heapFreeLowest,(unsigned long)heapBlockLowest);
+  for (int stage=0;stage<STAGE_COUNT;stage++)
+    {
+    int used=LATENCY_BUCKETS;
+    while (used>0 && latency[stage][used-1]==0)
+      used--;
+    out.printf(",\"%s\":[",stageNames[stage]);
+    for (int i=0;i<used;i++)
+      out.printf(i==0?"%lu":",%lu",(unsigned long)latency[stage][i]);
+    out.print("]");
+    }
+  out.print("}");
+  }
+
+/// @brief Publish the telemetry, retained, under the command topic
+void telemetryTask()
+  {
+  if (!mqttClient.connected())
+    return;
+  char topic[MQTT_MAX_TOPIC_SIZE+1];
+  size_t used=0;
+  if (appendBounded(topic,sizeof(topic),&used,settings.commandTopic,strlen(settings.commandTopic))
+      && appendBounded(topic,sizeof(topic),&used,"/" MQTT_TOPIC_TELEMETRY,strlen(MQTT_TOPIC_TELEMETRY)+1))
+    {
+    if (!publishStream(topic,writeTelemetry,true)) //retain
+      Serial.println("************ Failure when publishing telemetry!");
+    }
+  }
+
+/// @brief Check for commands that do something instead of changing a setting,
+/// which don't belong in a batch
+boolean isBatchAction(const char* name, size_t length)
+  {
+  const settingDescriptor* setting=findSetting(name,length);
+  return setting!=NULL && (setting->flags&SETTING_NOT_IN_BATCH);
+  }
+
+/*
+ * Apply a batch of settings, one name=value per line, as a single change.  If
+ * any line can't be applied, or the batch would leave a working device without
+ * complete settings, the settings are reloaded from EEPROM as they were before.
+ * Either way there is at most one commit to flash.  The reply is left in batchAck.
+ * Returns true if the device needs to restart for the new settings.
+ */
+boolean applyBatch(const char* lines, unsigned int length)
+  {
+  boolean wasComplete=settingsAreValid;
+  boolean needRestart=false;
+  const char* failure=NULL;
+  char command[MQTT_MAX_COMMAND_SIZE+1];
+  char keys[BATCH_ACK_SIZE-48]=""; //leaves room for the rest of the reply
+  size_t used=0;
+  int lineNumber=0;
+
+  commitSettings(); //anything still waiting, so that EEPROM has what to go back to
+  cancelTask(commitSettings);
+
+  unsigned int start=0;
+  while (start<length && failure==NULL)
+    {
+    unsigned int end=start;
+    while (end<length && lines[end]!='\n' && lines[end]!='\r')
+      end++;
+    const char* line=lines+start;
+    unsigned int lineLength=end-start;
+    start=end+1;
+    if (lineLength==0)
+      continue; //blank line, or the second half of a CR LF
+    lineNumber++;
+
+    const char* equals=(const char*)memchr(line,'=',lineLength);
+    size_t nameLength=equals==NULL?0:equals-line;
+    if (lineLength>MQTT_MAX_COMMAND_SIZE || nameLength==0 || isBatchAction(line,nameLength))
+      {
+      failure="not a setting";
+      break;
+      }
+    memcpy(command,line,lineLength);
+    command[lineLength]='\0';
+    unknownCommand=false;
+    badValue=false;
+    strictValues=true;
+    if (processCommand(command))
+      needRestart=true;
+    strictValues=false;
+    if (unknownCommand)
+      failure="unknown setting";
+    else if (badValue)
+      failure="bad value";
+    else if (used+1+nameLength+4<=sizeof(keys)) //leave room for a comma, and "..." if it's the last to fit
+      {
+      if (used>0)
+        appendBounded(keys,sizeof(keys),&used,",",1);
+      appendBounded(keys,sizeof(keys),&used,line,nameLength);
+      }
+    else if (keys[used-1]!='.')
+      appendBounded(keys,sizeof(keys),&used,"...",3);
+    }
+  if (failure==NULL && wasComplete && !settingsAreValid)
+    failure="the settings would be incomplete";
+
+  if (failure!=NULL)
+    {
+    revertSettings();
+    snprintf(batchAck,sizeof(batchAck),"FAILED at line %d, %s. Nothing was changed, settings generation %lu",
+             lineNumber,failure,(unsigned long)settingsGeneration);
+    Serial.println(batchAck);
+    return false;
+    }
+
+  refusedRule=-1;
+  commitSettings(); //the whole batch in one go
+  cancelTask(commitSettings);
+  if (refusedRule>=0)
+    {
+    snprintf(batchAck,sizeof(batchAck),"FAILED, rule %d won't fit in EEPROM. Nothing was changed, settings generation %lu",
+             refusedRule+1,(unsigned long)settingsGeneration);
+    Serial.println(batchAck);
+    return false;
+    }
+  needRestart=needRestart && settingsAreValid;
+  snprintf(batchAck,sizeof(batchAck),"OK, settings generation %lu%s: %s",
+           (unsigned long)settingsGeneration,needRestart?", restarting":"",keys);
+  Serial.println(batchAck);
+  return needRestart;
+  }
+
+void writeBatchAck(Print& out)
+  {
+  out.print(batchAck);
+  }
+
+/**
+ * Handler for incoming MQTT messages.  The payload is the command to perform. 
+ * The MQTT response message topic sent is the incoming topic plus the command.
+ * The incoming message should match the topic and message of one of the rules, 
+ * or be one of the implemented commands.
+ * 
+ * Some of the devices that send these MQTT messages do so rapid-fire with repeats,
+ * I guess just to make sure at least one gets through.  This code filters out all
+ * but the first one, with at least the rule's debounce time (REPEAT_LIMIT_MS by 
+ * default) required since the last one that was announced.  That only applies to
+ * QoS 0 messages.  Senders that publish with QoS 1 get each message delivered at 
+ * least once, and the extra copies are recognized by their packet id instead, so 
+ * a real second event right after the first one still alerts.  A rule can also 
+ * have a rate limit, see ruleAllows().
+ */
+void incomingMqttHandler(char* reqTopic, byte* payload, unsigned int length) 
+  {
+  unsigned long arrived=micros();
+  if (settings.debug)
+    {
+    Serial.println("====================================> Callback works.");
+    }
+  //The payload is used where it sits in the MQTT client's buffer. It isn't null
+  //terminated and there may be no room to terminate it, so it is only handled
+  //with its length. Both it and reqTopic are overwritten by the next publish.
+  const char* message=(const char*)payload;
+  void (*response)(Print&)=NULL; //writes the reply, if there is one
+  size_t (*responseLength)()=NULL; //and its length, if that can be worked out without writing it
+  const char* suffix=message;      //the reply goes to the request topic with this added
+  unsigned int suffixLength=length;
+  uint16 id=packetId(reqTopic,payload);
+
+  if (settings.debug)
+    {
+    Serial.print("========>Topic is \"");
+    Serial.print(reqTopic);
+    Serial.println("\"");
+    Serial.print("========>Payload is \"");
+    Serial.write(message,length);
+    Serial.println("\".");
+    }
+
+  boolean needRestart=false;
+  int ruleNumber;
+  if (id!=0 && isRedelivery(id,reqTopic,message,length))
+    {
+    messagesRedelivered++; //we missed the acknowledgement last time
+    if (settings.debug)
+      Serial.printf("Message %u was redelivered, ignored\n",id);
+    return;
+    }
+  if (payloadIs(message,length,"settings") &&
+      strcmp(reqTopic,settings.commandTopic)==0) //special case, send all settings
+    {
+    if (settings.debug)
+      Serial.println("Sending settings...");
+    response=writeSettings;
+    responseLength=settingsLength;
+    }
+  else if (payloadIs(message,length,"history") &&
+      strcmp(reqTopic,settings.commandTopic)==0) //another special case, send message history
+    {
+    if (settings.debug)
+      Serial.println("Sending history...");
+    response=writeHistory;
+    }
+  else if (payloadIs(message,length,"status") &&
+      strcmp(reqTopic,settings.commandTopic)==0) //report that we're alive
+    {
+    response=writeStatus;
+    }
+  else if (payloadIs(message,length,"profile") &&
+      strcmp(reqTopic,settings.commandTopic)==0) //where the time goes in loop()
+    {
+    response=writeProfile;
+    }
+  else if (length>8 && length<40 && strncmp(message,"history=",8)==0 &&
+      strcmp(reqTopic,settings.commandTopic)==0) //history from the log on flash for a date range
+    {
+    char range[40];
+    memcpy(range,message+8,length-8);
+    range[length-8]='\0';
+    if (setHistoryRange(range))
+      response=writeHistoryRange;
+    else
+      Serial.println("************ History range should be yyyy-mm-dd or yyyy-mm-dd,yyyy-mm-dd");
+    }   //check for target messages
+  else if (length>=5 && strncmp(message,"batch",5)==0 && (length==5 || message[5]=='\n' || message[5]=='\r') &&
+      strcmp(reqTopic,settings.commandTopic)==0) //many settings at once, one per line
+    {
+    needRestart=applyBatch(message+5,length-5);
+    response=writeBatchAck;
+    suffix="batch";
+    suffixLength=5;
+    }
+  else if ((ruleNumber=findRule(reqTopic,message,length))>=0)
+    {
+    recordLatency(STAGE_MATCH,micros()-arrived);
+    rule* r=&settings.rules[ruleNumber];
+    if (ruleAllows(ruleNumber,id==0))
+      {
+      messagesMatched++;
+      unsigned long start=micros();
+      addHistoryEntry(ruleNumber+1,localTime());
+      recordLatency(STAGE_HISTORY,micros()-start);
+      show(r->description,true);
+      queueTrack(r->track>0?r->track:ruleNumber+1,arrived);
+      }
+    else
+      messagesSuppressed++;
+//    response="OK";
+    }
+  else if (strcmp(reqTopic,settings.commandTopic)==0)
+    {
+    //commands are edited in place while they are parsed, so they get a copy
+    char command[MQTT_MAX_COMMAND_SIZE+1];
+    if (length>MQTT_MAX_COMMAND_SIZE)
+      {
+      Serial.println("************ Command is too long, ignored.");
+      return;
+      }
+    memcpy(command,message,length);
+    command[length]='\0';
+    needRestart=processCommand(command);
+    if (needRestart && settingsAreValid)
+      response=writeRestarting;
+//    else
+//      response="OK";
+    }
+  else
+    {
+    messagesUnmatched++;
+    // char badCmd[18];
+    // strcpy(badCmd,"(empty)");
+    // response=badCmd;
+    }
+
+  //prepare the response topic
+  if (response!=NULL)
+    { 
+    static char topic[MQTT_MAX_TOPIC_SIZE+1]; //reused, and off the stack
+    size_t used=0;
+    if (appendBounded(topic,sizeof(topic),&used,reqTopic,strlen(reqTopic))
+        && appendBounded(topic,sizeof(topic),&used,"/",1)
+        && appendBounded(topic,sizeof(topic),&used,suffix,suffixLength)) //usually the incoming command
+      {
+      if (!publishStream(topic,response,false,responseLength)) //do not retain
+        Serial.println("************ Failure when publishing status response!");
+      }
+    else
+      Serial.println("************ Response topic is too long!");
+    }
+  if (needRestart)
+    requestRestart(1000); //let all outgoing messages flush through
+  }
+
+
+boolean sendMessage(char* topic, char* value)
+  { 
+  boolean success=false;
+  if (!mqttClient.connected())
+    {
+    Serial.println("Not connected to MQTT broker!");
+    }
+  else
+    {
+    char topicBuf[MQTT_MAX_TOPIC_SIZE+MQTT_MAX_MESSAGE_SIZE];
+    char reading[18];
+//    boolean success=false; //only for the incoming topic and value
+
+    //publish the radio strength reading while we're at it
+    strcpy(topicBuf,settings.rules[0].topic);
+    strcat(topicBuf,MQTT_TOPIC_RSSI);
+    sprintf(reading,"%d",WiFi.RSSI()); 
+    success=publish(topicBuf,reading,true); //retain
+    if (!success)
+      Serial.println("************ Failed publishing rssi!");
+    
+    //publish the message
+    strcpy(topicBuf,settings.rules[0].topic);
+    strcat(topicBuf,topic);
+    success=publish(topicBuf,value,true); //retain
+    if (!success)
+      Serial.printf("************ Failed publishing %s! (%d)\n",topic,success);
+    }
+  return success;
+  }
+
+
+/// @brief Converts a 0-10 range for volume to 0-30 and sends it to the DFPlayer.
+/// @param volume int
+void adjustVolume(int volume)
+  {
+  if (volume>=0 && volume<=10)
+    {
+    int vol=volume*3;
+    myDFPlayer.volume(vol);
+    }
+  }
+
+/// @brief Run a function from loop() after a delay, and optionally keep running it
+/// @param function the task
+/// @param interval ms until it runs, and between runs if it repeats
+/// @param repeat false to run it only once
+/// @return false if there is no room for another task
+boolean scheduleTask(taskFunction function, unsigned long interval, boolean repeat)
+  {
+  task* slot=NULL;
+  for (int i=0;i<MAX_TASKS;i++)
+    {
+    if (tasks[i].function==function)
+      {
+      slot=&tasks[i]; //already scheduled, reschedule it
+      break;
+      }
+    if (slot==NULL && tasks[i].function==NULL)
+      slot=&tasks[i];
+    }
+  if (slot==NULL)
+    {
+    Serial.println("************ Task table is full!");
+    return false;
+    }
+  slot->function=function;
+  slot->interval=interval;
+  slot->lastRun=millis();
+  slot->repeat=repeat;
+  return true;
+  }
+
+void cancelTask(taskFunction function)
+  {
+  for (int i=0;i<MAX_TASKS;i++)
+    {
+    if (tasks[i].function==function)
+      tasks[i].function=NULL;
+    }
+  }
+
+/// @brief Run the tasks that are due. Called from loop(). The time arithmetic 
+/// is done with differences so it survives the millis() rollover.
+void runTasks()
+  {
+  for (int i=0;i<MAX_TASKS;i++)
+    {
+    task* t=&tasks[i];
+    if (t->function==NULL || millis()-t->lastRun<t->interval)
+      continue;
+    taskFunction function=t->function;
+    if (t->repeat)
+      {
+      t->lastRun+=t->interval; //stay on the original schedule
+      if (millis()-t->lastRun>=t->interval)
+        t->lastRun=millis(); //too far behind to catch up
+      }
+    else
+      t->function=NULL;
+    function(); //may reschedule or cancel itself
+    }
+  }
+
+void restartTask()
+  {
+  commitSettings(); //in case a change is still waiting
+  ESP.restart();
+  }
+
+/// @brief Restart after giving loop() time to flush outgoing messages
+void requestRestart(unsigned long ms)
+  {
+  scheduleTask(restartTask,ms,false);
+  }
+
+void otaSetup()
+  {
+  // Port defaults to 3232
+  // ArduinoOTA.setPort(3232);
+
+  // Hostname defaults to esp3232-[MAC]
+  // ArduinoOTA.setHostname("myesp32");
+
+  // No authentication by default
+  // ArduinoOTA.setPassword("admin");
+
+  // Password can be set with it's md5 value as well
+  // MD5(admin) = 21232f297a57a5a743894a0e4a801fc3
+  // ArduinoOTA.setPasswordHash("21232f297a57a5a743894a0e4a801fc3");
+
+  ArduinoOTA.onStart([]() 
+    {
+    const char* type;
+    if (ArduinoOTA.getCommand() == U_FLASH)
+      type = "sketch";
+    else // U_SPIFFS
+      type = "filesystem";
+
+    // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
+    Serial.print("Start updating ");
+    Serial.println(type);
+    });
+
+    ArduinoOTA.onEnd([]() {
+      Serial.println("\nEnd");
+    });
+
+    ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) 
       {
       Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
       });
@@ -763,11 +3141,22 @@ void setup()
   Serial.print(F("MP3 player baud rate is "));
   Serial.println(mySoftwareSerial.baudRate());
 
-  lcd.begin(DISPLAY_COLUMNS, DISPLAY_ROWS); //16 chars x 2 rows
+  lcd.begin(DISPLAY_COLUMNS, DISPLAY_ROWS); //16 chars x 2 rows, starts out clear
+  memset(lcdShadow,' ',sizeof(lcdShadow));
+  memset(frameBuffer,' ',sizeof(frameBuffer));
+  scheduleTask(flushDisplay,LCD_FLUSH_MS,true);
   show(const_cast<char*>("Starting..."),false,true);
 
-  EEPROM.begin(sizeof(settings)); //fire up the eeprom section of flash
-  commandString.reserve(200); // reserve 200 bytes of serial buffer space for incoming command string
+  EEPROM.begin(SETTINGS_STORE_SIZE); //fire up the eeprom section of flash
+
+  //Replies are streamed and don't need a big MQTT buffer, but an incoming batch of
+  //settings has to fit in it whole.  It is allocated here, before the heap has been
+  //broken up and before the first connect, so no batch arrives while it is still
+  //the default size.  If it can't be had the device still works, but batches over
+  //the default 256 bytes are dropped by PubSubClient.
+  if (!mqttClient.setBufferSize(MQTT_BUFFER_SIZE))
+    Serial.printf("************ Couldn't make the MQTT buffer %d bytes, batches are limited to %u.\n",
+                  MQTT_BUFFER_SIZE,mqttClient.getBufferSize());
 
   if (settings.debug)
     Serial.println(F("Loading settings"));
@@ -778,237 +3167,477 @@ void setup()
   Serial.print("Performing settings sanity check...");
   if ((settings.validConfig!=0 && 
       settings.validConfig!=VALID_SETTINGS_FLAG) || //should always be one or the other
-      settings.brokerPort<0 ||
-      settings.brokerPort>65535 ||
-      strlen(settings.mqttMessage1)>MQTT_MAX_MESSAGE_SIZE ||
-      strlen(settings.mqttMessage2)>MQTT_MAX_MESSAGE_SIZE ||
-      strlen(settings.mqttMessage3)>MQTT_MAX_MESSAGE_SIZE ||
-      strlen(settings.mqttMessage4)>MQTT_MAX_MESSAGE_SIZE ||
-      strlen(settings.description1)>DISPLAY_COLUMNS ||
-      strlen(settings.description2)>DISPLAY_COLUMNS ||
-      strlen(settings.description3)>DISPLAY_COLUMNS ||
-      strlen(settings.description4)>DISPLAY_COLUMNS)
+      !settingsAreSane())
     {
     Serial.println("\nSettings in eeprom failed sanity check, initializing.");
     initializeSettings(); //must be a new board or flash was erased
     }
   else
     Serial.println("passed.");
+
+  if (!historyStoreBegin())
+    Serial.println("************ The history log on flash is not available!");
+
+  sampleHeap(); //so there are numbers to report before the clock starts ticking
   
-  if (settings.debug)
-    Serial.println(F("Connecting to WiFi"));
-  
-  if (settings.validConfig==VALID_SETTINGS_FLAG)
+  if (settingsAreValid)
     {
-    scrollDisplay();
-    show(const_cast<char*>("Connecting WiFi"),false);
-    connectToWiFi(); //connect to the wifi
+    bootStep=BOOT_WIFI;
+    scheduleTask(bootTask,BOOT_STEP_MS,true); //the rest happens in loop()
     }
-  
-  if (settingsAreValid)
+  else
     {
-    if (WiFi.status() != WL_CONNECTED)
-      {
-      setupOK=false;
-      digitalWrite(LED_BUILTIN,LED_OFF);
-      scrollDisplay();
-      show(const_cast<char*>("WiFi error."),false);
-      }
-    else
-      {
+    setupOK=false;
+    show(const_cast<char*>("Settings are"),true,false,0);
+    show(const_cast<char*>("incomplete."),false,false,1);
+    }
+  }
+
+/*
+ * The part of startup that has to wait on the network or the mp3 player. It
+ * runs as a task so that loop() keeps servicing serial commands and OTA while
+ * the device comes up.  Each call does at most one step.
+ */
+void bootTask()
+  {
+  switch (bootStep)
+    {
+    case BOOT_WIFI:
+      if (settings.debug)
+        Serial.println(F("Connecting to WiFi"));
       scrollDisplay();
-      show(const_cast<char*>("Fetching time..."),false);
-  
-      if (setupOK && !refreshTime())
+      show(const_cast<char*>("Connecting WiFi"),false);
+      connectToWiFi(); //start connecting to the wifi
+      bootStep=BOOT_WAIT_WIFI;
+      break;
+
+    case BOOT_WAIT_WIFI:
+      if (wifiState==WIFI_CONNECTED)
+        {
+        scrollDisplay();
+        show(const_cast<char*>("Fetching time..."),false);
+        bootStep=BOOT_TIME;
+        }
+      break; //the wifi task reboots if it can't connect
+
+    case BOOT_TIME:
+      requestTimeSync();
+      bootStep=BOOT_WAIT_TIME;
+      break;
+
+    case BOOT_WAIT_TIME:
+      if (!timeIsSet && ntpFailures==0)
+        break; //still waiting for the answer
+      if (!timeIsSet)
         {
+        //ntpTask keeps trying, and the clock starts when it gets an answer
         Serial.println(F("Couldn't refresh time."));
         scrollDisplay();
         show(const_cast<char*>("Time error."),false);
-        setupOK=false;
         }
-      if (setupOK)
+      else if (setupOK)
         {
         scrollDisplay();
         show(const_cast<char*>("Updating Clock.."),false);
+        updateClock();
+        }
+      scheduleClockTick(); //the realtime clock
+      otaSetup(); //initialize the OTA stuff
+      bootStep=BOOT_MQTT;
+      break;
+
+    case BOOT_MQTT:
+      mqttReconnect(); // go ahead and connect to the MQTT broker
+      if (mqttClient.connected())
+        {
+        if (setupOK)
+          {
+          scrollDisplay();
+          show(const_cast<char*>("Init MP3 Player"),false);
+          }
+        bootStep=BOOT_PLAYER;
         }
-      if (setupOK && !updateClock())
+      break;
+
+    case BOOT_PLAYER:
+    case BOOT_PLAYER_RETRY:
+      if (setupOK && !myDFPlayer.begin(mySoftwareSerial)) 
         {
-        Serial.println(F("Couldn't update clock."));
+        Serial.print("Files on SD card: ");
+        Serial.println(myDFPlayer.readFileCounts());
+        if (bootStep==BOOT_PLAYER)
+          {
+          bootStep=BOOT_PLAYER_RETRY;
+          scheduleTask(bootTask,BOOT_PLAYER_RETRY_MS,true); //try again in a couple of seconds
+          break;
+          }
+        Serial.println(F("MP3 player is borked."));
         scrollDisplay();
-        show(const_cast<char*>("Clock error."),false);
+        show(const_cast<char*>("MP3 player error"),true);
         setupOK=false;
+        cancelTask(bootTask);
+        requestRestart(1000); //try rebooting
+        break;
         }
-      otaSetup(); //initialize the OTA stuff
-      mqttReconnect(); // go ahead and connect to the MQTT broker
+      myDFPlayer.setTimeOut(500); //Set serial communictaion time out 500ms
+      myDFPlayer.EQ(DFPLAYER_EQ_NORMAL); //normal equalization
+      myDFPlayer.outputDevice(DFPLAYER_DEVICE_SD); // it's really the input device (sd card)
+      adjustVolume(settings.volume);   //Set volume value (0~10).
+
+      if (setupOK)
+        {
+        IPAddress ip=WiFi.localIP();
+        char address[16];
+        snprintf(address,sizeof(address),"%u.%u.%u.%u",ip[0],ip[1],ip[2],ip[3]);
+        show(address,false,true,0);
+        show(const_cast<char*>("Startup complete"),false,false,1);
+        }
+      bootStep=BOOT_DONE;
+      cancelTask(bootTask);
+      worstLoopMicros=0; //only count the loop time from here on
+      resetProfile();
+      scheduleTask(telemetryTask,TELEMETRY_MS,true);
+      break;
+
+    default:
+      cancelTask(bootTask);
+      break;
+    }
+  }
+
+void loop()
+  {
+  unsigned long loopStart=micros();
+  unsigned long sectionStart=loopStart;
+
+  runTasks();
+  sectionStart=profileSection(SECTION_TASKS,sectionStart);
+  if (settings.validConfig==VALID_SETTINGS_FLAG
+      && WiFi.status() == WL_CONNECTED
+      && setupOK && bootStep==BOOT_DONE)
+    {
+    mqttReconnect(); //make sure we stay connected to the broker
+    } 
+  sectionStart=profileSection(SECTION_MQTT,sectionStart);
+  checkForCommand(); // Check for input in case something needs to be changed to work
+  sectionStart=profileSection(SECTION_SERIAL,sectionStart);
+  ArduinoOTA.handle(); //Check for new version
+  sectionStart=profileSection(SECTION_OTA,sectionStart);
+
+  if (setupOK && bootStep==BOOT_DONE)
+    servicePlayer(); //mp3 player events and the play queue
+  profileSection(SECTION_PLAYER,sectionStart);
+
+  unsigned long loopTime=micros()-loopStart;
+  if (loopTime>worstLoopMicros)
+    {
+    worstLoopMicros=loopTime;
+    if (settings.debug && bootStep==BOOT_DONE)
+      {
+      Serial.print("New worst loop time: ");
+      Serial.print(loopTime);
+      Serial.println(" us");
+      }
+    }
+  }
+
+
+/*
+ * If not connected to wifi, start connecting.  The connection attempt is 
+ * watched by wifiTask(), which reboots if it doesn't succeed in time.
+ * Returns true if the wifi is connected now.
+ */
+boolean connectToWiFi()
+  {
+  yield();
+  if (WiFi.status() == WL_CONNECTED)
+    {
+    digitalWrite(LED_BUILTIN,LED_OFF);
+    return true;
+    }
+  if (wifiState==WIFI_CONNECTING)
+    return false; //already on it
+
+  if (settings.debug)
+    {
+    Serial.print(F("Attempting to connect to WPA SSID \""));
+    Serial.print(settings.ssid);
+    Serial.print("\" with passphrase \"");
+    Serial.print(settings.wifiPassword);
+    Serial.println("\"");
+    }
+
+  WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
+  
+  // if (strlen(settings.hostName)>0)
+  //   WiFi.hostname(settings.hostName); //else use the default
+
+  WiFi.begin(settings.ssid, settings.wifiPassword);
+
+  digitalWrite(LED_BUILTIN,LED_ON); //blink the LED when attempting to connect
+  wifiState=WIFI_CONNECTING;
+  wifiAttempts=0;
+  scheduleTask(wifiTask,WIFI_CHECK_MS,true);
+  return false;
+  }
+
+/*
+ * Watch a wifi connection attempt started by connectToWiFi(), blinking the LED
+ * while we wait.  Gives up and reboots after WIFI_CONNECTION_ATTEMPTS checks.
+ */
+void wifiTask()
+  {
+  if (WiFi.status() == WL_CONNECTED)
+    {
+    digitalWrite(LED_BUILTIN,LED_ON); //show we're connected
+    if (settings.debug)
+      {
+      Serial.println(F("Connected to network."));
+      Serial.println();
+      }
+    //show the IP address
+    Serial.println(WiFi.localIP());
+    wifiState=WIFI_CONNECTED;
+    cancelTask(wifiTask);
+    }
+  else if (++wifiAttempts<WIFI_CONNECTION_ATTEMPTS)
+    {
+    if (settings.debug)
+      Serial.print(".");
+    digitalWrite(LED_BUILTIN,wifiAttempts%2==0?LED_ON:LED_OFF);
+    }
+  else //can't connect to wifi, try again next time
+    {
+    Serial.print("Wifi status is ");
+    Serial.println(WiFi.status());
+    Serial.println(F("WiFi connection unsuccessful. Rebooting..."));
+    digitalWrite(LED_BUILTIN,LED_OFF); //stay off until we connect
+    wifiState=WIFI_IDLE;
+    cancelTask(wifiTask);
+    requestRestart(5000); //time to read the message
+    }
+  }
+
+void showSub(char* topic, bool subgood)
+  {
+  Serial.print("++++++Subscribing to ");
+  Serial.print(topic);
+  Serial.print(":");
+  Serial.println(subgood?"ok":"failed");
+  }
+
+
+void showUnsub(const char* topic, bool unsubgood)
+  {
+  Serial.print("------Unsubscribing from ");
+  Serial.print(topic);
+  Serial.print(":");
+  Serial.println(unsubgood?"ok":"failed");
+  }
 
-      if (setupOK)
-        {
-        scrollDisplay();
-        show(const_cast<char*>("Init MP3 Player"),false);
-        }
-      if (setupOK && !myDFPlayer.begin(mySoftwareSerial)) 
-        {
-        Serial.print("Files on SD card: ");
-        Serial.println(myDFPlayer.readFileCounts());
-        delay(2000);
-        if (!myDFPlayer.begin(mySoftwareSerial))  //try again
-          {
-          Serial.print("Files on SD card: ");
-          Serial.println(myDFPlayer.readFileCounts());
-          Serial.println(F("MP3 player is borked."));
-          scrollDisplay();
-          show(const_cast<char*>("MP3 player error"),true);
-          setupOK=false;
-          delay(1000);
-          ESP.restart(); //try rebooting
-          }
-        }
-      myDFPlayer.setTimeOut(500); //Set serial communictaion time out 500ms
-      myDFPlayer.EQ(DFPLAYER_EQ_NORMAL); //normal equalization
-      myDFPlayer.outputDevice(DFPLAYER_DEVICE_SD); // it's really the input device (sd card)
-      adjustVolume(settings.volume);   //Set volume value (0~10).
+/// @brief Get the topic that a rule needs a subscription for
+/// @param ruleNumber the index of the rule
+/// @return the topic, or NULL if the rule isn't in use or its topic is already
+/// covered by the command topic or an earlier rule
+const char* ruleSubscription(int ruleNumber)
+  {
+  const char* topic=settings.rules[ruleNumber].topic;
+  if (strlen(topic)==0 || strcmp(topic,settings.commandTopic)==0)
+    return NULL;
+  for (int j=0;j<ruleNumber;j++) //only subscribe once per topic
+    {
+    if (strcmp(topic,settings.rules[j].topic)==0)
+      return NULL;
+    }
+  return topic;
+  }
 
-      if (setupOK)
-        {
-        if (!mqttClient.setBufferSize(MQTT_BUFFER_SIZE)) //default (256) isn't big enough
-          {
-          show(const_cast<char*>("MQTT buffer size"),false,false,0);
-          show(const_cast<char*>("failure. OOM"),false,false,1);
-          setupOK=false;
-          }
-        }
+boolean isSubscribed(const char* topic)
+  {
+  for (size_t pos=0;pos<subscriptionsUsed;pos+=strlen(subscriptions+pos)+1)
+    {
+    if (strcmp(subscriptions+pos,topic)==0)
+      return true;
+    }
+  return false;
+  }
 
-      if (setupOK)
-        {
-        show(const_cast<char*>(WiFi.localIP().toString().c_str()),false,true,0);
-        show(const_cast<char*>("Startup complete"),false,false,1);
-        }
-      }
+/// @brief Subscribe to a topic and remember it
+void addSubscription(const char* topic)
+  {
+  if (settings.debug)
+    {
+    Serial.print("Subscribing to topic \"");
+    Serial.print(topic);
+    Serial.println("\"");
     }
-  else
+  bool subgood=mqttClient.subscribe(topic,MQTT_SUBSCRIBE_QOS);
+  showSub(const_cast<char*>(topic),subgood);
+  if (!subgood)
+    return;
+  size_t length=strlen(topic)+1;
+  if (subscriptionsUsed+length>SUBSCRIPTION_POOL_SIZE)
     {
-    setupOK=false;
-    show(const_cast<char*>("Settings are"),true,false,0);
-    show(const_cast<char*>("incomplete."),false,false,1);
+    Serial.println("************ Too many topics to keep track of, changes to them will need a new session!");
+    subscriptionsOverflowed=true;
+    return;
     }
+  memcpy(subscriptions+subscriptionsUsed,topic,length);
+  subscriptionsUsed+=length;
   }
 
-void loop()
+/// @brief Hash the topics that the settings call for, the command topic first
+/// and then each rule's.  It is kept in the session record to say what the
+/// broker's session for us is subscribed to.
+/// @return the hash, never 0 because that means the session isn't known
+uint32 subscriptionSetHash()
   {
-  if (settings.validConfig==VALID_SETTINGS_FLAG
-      && WiFi.status() == WL_CONNECTED
-      && setupOK)
+  uint32 hash=payloadHash(settings.commandTopic,strlen(settings.commandTopic)+1);
+  for (int i=0;i<MAX_RULES;i++)
     {
-    mqttReconnect(); //make sure we stay connected to the broker
-    } 
-  checkForCommand(); // Check for input in case something needs to be changed to work
-  ArduinoOTA.handle(); //Check for new version
+    const char* topic=ruleSubscription(i);
+    if (topic!=NULL)
+      hash=(hash^payloadHash(topic,strlen(topic)+1))*16777619UL;
+    }
+  return hash==0?1:hash;
+  }
 
-  //update the realtime clock once per second
-  if (millis()%1000==0 && setupOK)
-    updateClock();
+/// @brief What the session record says the broker's session for us has
+/// @return the hash from subscriptionSetHash(), or 0 if it isn't known
+uint32 sessionTopics()
+  {
+  sessionRecord record={};
+  EEPROM.get(SETTINGS_RECORDS_END,record);
+  return record.flag==SESSION_RECORD_FLAG?record.topics:0;
+  }
 
-  if (setupOK && myDFPlayer.available()) //Print the detail message from DFPlayer for different errors and states.
-    printDetail(myDFPlayer.readType(), myDFPlayer.read()); 
+/// @brief Remember what the broker's session for us is subscribed to, so the
+/// next connection knows whether it can keep it.  If a settings commit is
+/// waiting the record goes along with it, otherwise it is committed now.
+/// @param hash from subscriptionSetHash(), or 0 if it isn't known
+void rememberSessionTopics(uint32 hash)
+  {
+  if (sessionTopics()==hash)
+    return;
+  sessionRecord record={SESSION_RECORD_FLAG,0,hash};
+  EEPROM.put(SETTINGS_RECORDS_END,record);
+  if (dirtySettings==0 && dirtyRules==0 && !EEPROM.commit())
+    Serial.println("************ Failure when committing the MQTT session to flash!");
   }
 
+/// @brief Whether syncSubscriptions() can bring the subscriptions up to date
+/// without a new connection
+boolean subscriptionsSyncInPlace()
+  {
+  return mqttClient.connected() && subscriptionsUsed>0 && !subscriptionsOverflowed
+         && strcmp(subscriptions,settings.commandTopic)==0;
+  }
 
 /*
- * If not connected to wifi, connect.
+ * Bring the subscriptions up to date with the rules: unsubscribe from the
+ * topics that no rule uses any more and subscribe to the new ones.  A new
+ * command topic takes a new connection because the will topic is under it,
+ * and so does a pool that overflowed because the topics that didn't fit can't
+ * be found to unsubscribe.  Either way the topics no longer match the session,
+ * so mqttReconnect() starts a clean one.
+ * This runs as a task, never from the MQTT callback, because subscribing
+ * overwrites the message that the callback is working on.
  */
-boolean connectToWiFi()
+void syncSubscriptions()
   {
-  yield();
-  static boolean retval=true; //assume connection to wifi is ok
-  if (WiFi.status() != WL_CONNECTED)
-    {
-    if (settings.debug)
-      {
-      Serial.print(F("Attempting to connect to WPA SSID \""));
-      Serial.print(settings.ssid);
-      Serial.print("\" with passphrase \"");
-      Serial.print(settings.wifiPassword);
-      Serial.println("\"");
-      }
-
-    WiFi.mode(WIFI_STA); //station mode, we are only a client in the wifi world
-    
-    // if (strlen(settings.hostName)>0)
-    //   WiFi.hostname(settings.hostName); //else use the default
-
-    WiFi.begin(settings.ssid, settings.wifiPassword);
+  if (!mqttClient.connected())
+    return; //mqttReconnect() sorts out the session when it connects
 
-    bool ledLit=true; //blink the LED when attempting to connect
-    digitalWrite(LED_BUILTIN,LED_ON);
+  if (!subscriptionsSyncInPlace())
+    {
+    Serial.println("The subscriptions can't be changed in place, reconnecting to the broker.");
+    mqttClient.disconnect();
+    mqttWasConnected=false; //not lost, so no need to wait
+    mqttWait=0;
+    return;
+    }
 
-    //try for a few seconds to connect to wifi
-    for (int i=0;i<WIFI_CONNECTION_ATTEMPTS;i++)  
+  //drop the topics that aren't wanted any more, packing the rest together
+  size_t kept=strlen(subscriptions)+1; //the command topic stays
+  boolean stale=false;
+  for (size_t pos=kept;pos<subscriptionsUsed;)
+    {
+    char* topic=subscriptions+pos;
+    size_t length=strlen(topic)+1;
+    boolean wanted=false;
+    for (int i=0;i<MAX_RULES && !wanted;i++)
       {
-      if (WiFi.status() == WL_CONNECTED)
-        {
-        digitalWrite(LED_BUILTIN,LED_ON); //show we're connected
-        break;  // got it
-        }
-      if (settings.debug)
-        Serial.print(".");
-      checkForCommand(); // Check for input in case something needs to be changed to work
-      delay(500);
-      if (ledLit)
-        digitalWrite(LED_BUILTIN,LED_OFF);
-      else
-        digitalWrite(LED_BUILTIN,LED_ON);
-      ledLit=!ledLit;
+      const char* ruleTopic=ruleSubscription(i);
+      wanted=ruleTopic!=NULL && strcmp(ruleTopic,topic)==0;
       }
-
-    if (WiFi.status() == WL_CONNECTED)
+    if (wanted)
       {
-      digitalWrite(LED_BUILTIN,LED_ON); //show we're connected
-      if (settings.debug)
-        {
-        Serial.println(F("Connected to network."));
-        Serial.println();
-        }
-      //show the IP address
-      Serial.println(WiFi.localIP());
-      retval=true;
-      }     
-    else //can't connect to wifi, try again next time
+      memmove(subscriptions+kept,topic,length);
+      kept+=length;
+      }
+    else
       {
-      retval=false;
-      Serial.print("Wifi status is ");
-      Serial.println(WiFi.status());
-      Serial.println(F("WiFi connection unsuccessful. Rebooting..."));
-      digitalWrite(LED_BUILTIN,LED_OFF); //stay off until we connect
-      delay(5000); //time to read the message
-      ESP.restart(); //reboot
+      boolean unsubgood=mqttClient.unsubscribe(topic);
+      showUnsub(topic,unsubgood);
+      stale|=!unsubgood;
       }
+    pos+=length;
+    }
+  subscriptionsUsed=kept;
+
+  //then add the new ones
+  for (int i=0;i<MAX_RULES;i++)
+    {
+    const char* topic=ruleSubscription(i);
+    if (topic!=NULL && !isSubscribed(topic))
+      addSubscription(topic);
     }
-  else
-    digitalWrite(LED_BUILTIN,LED_OFF);
 
-  return retval;
+  //a topic that couldn't be dropped stays in the session until a clean one
+  rememberSessionTopics(stale?0:subscriptionSetHash());
   }
 
-void showSub(char* topic, bool subgood)
+/// @brief A random number from 0 up to range.  It has its own generator, 
+/// seeded from the client ID, so every device gets a different sequence.
+uint32 mqttJitter(unsigned long range)
   {
-  Serial.print("++++++Subscribing to ");
-  Serial.print(topic);
-  Serial.print(":");
-  Serial.println(subgood?"ok":"failed");
+  if (mqttJitterState==0)
+    {
+    mqttJitterState=2166136261u; //FNV-1a
+    for (const char* c=settings.mqttClientId;*c!='\0';c++)
+      mqttJitterState=(mqttJitterState^(uint8)*c)*16777619u;
+    if (mqttJitterState==0)
+      mqttJitterState=1;
+    }
+  mqttJitterState^=mqttJitterState<<13; //xorshift
+  mqttJitterState^=mqttJitterState>>17;
+  mqttJitterState^=mqttJitterState<<5;
+  return range==0?0:mqttJitterState%range;
   }
 
-
 /*
- * Reconnect to the MQTT broker
+ * Reconnect to the MQTT broker. Makes one connection attempt at most each time 
+ * the wait is up, so it can be called on every pass through loop().
  */
 void mqttReconnect() 
   {
-  bool ledLit=true; //blink the LED when attempting to connect
-  digitalWrite(LED_BUILTIN,LED_ON);
+  static bool ledLit=true; //blink the LED when attempting to connect
+
+  if (mqttWasConnected && !mqttClient.connected())
+    {
+    //Lost it.  Wait a random part of a second so we don't all come back at once.
+    mqttWasConnected=false;
+    mqttDisconnects++;
+    mqttLastAttempt=millis();
+    mqttWait=mqttJitter(MQTT_RETRY_MS);
+    Serial.println("Lost the MQTT connection.");
+    }
     
-  // Loop until we're reconnected
-  while (!mqttClient.connected() && settings.validConfig==VALID_SETTINGS_FLAG) 
+  if (!mqttClient.connected() && settings.validConfig==VALID_SETTINGS_FLAG
+      && (mqttAttempts==0 || millis()-mqttLastAttempt>=mqttWait))
     {  
+    mqttAttempts++;
+    mqttLastAttempt=millis();
     if (ledLit)
       digitalWrite(LED_BUILTIN,LED_OFF);
     else
@@ -1017,118 +3646,86 @@ void mqttReconnect()
 
     Serial.print("Attempting MQTT connection...");
 
-    //mqttClient.setBufferSize(1000); //default (256) isn't big enough
-    mqttClient.setServer(settings.brokerAddress, settings.brokerPort);
-    mqttClient.setCallback(incomingMqttHandler);
+    if (strcmp(mqttServer,settings.brokerAddress)!=0 || mqttServerPort!=settings.brokerPort)
+      {
+      strcpy(mqttServer,settings.brokerAddress);
+      mqttServerPort=settings.brokerPort;
+      mqttClient.setServer(mqttServer, mqttServerPort); //keeps the pointer, not a copy
+      mqttClient.setCallback(incomingMqttHandler);
+      }
     
     // Attempt to connect
-    char willTopic[MQTT_MAX_TOPIC_SIZE]="";
-    strcpy(willTopic,settings.commandTopic);
-    strcat(willTopic,"/");
-    strcat(willTopic,MQTT_TOPIC_STATUS);
+    char willTopic[MQTT_MAX_TOPIC_SIZE+sizeof("/" MQTT_TOPIC_STATUS)]; //room for the longest command topic
+    size_t used=0;
+    appendBounded(willTopic,sizeof(willTopic),&used,settings.commandTopic,strlen(settings.commandTopic));
+    appendBounded(willTopic,sizeof(willTopic),&used,"/" MQTT_TOPIC_STATUS,strlen("/" MQTT_TOPIC_STATUS));
 
 
+    //Keep the session, so QoS 1 messages wait for us, unless the topics have
+    //changed since it was subscribed.  Then it may hold topics that nothing here
+    //knows about any more, and only a clean session gets rid of them.
+    uint32 topics=subscriptionSetHash();
+    boolean cleanSession=topics!=sessionTopics();
     if (mqttClient.connect(settings.mqttClientId,
                           settings.mqttUsername,
                           settings.mqttUserPassword,
                           willTopic,
                           0,                  //QOS
                           true,               //retain
-                          settings.mqttLWTMessage))
+                          settings.mqttLWTMessage,
+                          cleanSession))
       {
-      Serial.println("connected to MQTT broker.");
-
-      if (settings.debug)
-        {
-        Serial.print("Subscribing to topic \"");
-        Serial.print(settings.commandTopic);
-        Serial.println("\"");
-        }
-      bool subgood=mqttClient.subscribe(settings.commandTopic);
-      showSub(settings.commandTopic,subgood);
-
-      //resubscribe to the incoming message topic
-      if (strcmp(settings.mqttTopic1,settings.commandTopic)!=0) //only subscribe once per topic
-        {
-        if (settings.debug)
-          {
-          Serial.print("Subscribing to topic \"");
-          Serial.print(settings.mqttTopic1);
-          Serial.println("\"");
-          }
-        subgood=mqttClient.subscribe(settings.mqttTopic1);
-        showSub(settings.mqttTopic1,subgood);
-        }
-
-      if (strlen(settings.mqttTopic2)>0//only subscribe once per topic
-          && strcmp(settings.mqttTopic2,settings.commandTopic)!=0 
-          && strcmp(settings.mqttTopic2,settings.mqttTopic1)!=0)
-        {
-        if (settings.debug)
-          {
-          Serial.print("Subscribing to topic \"");
-          Serial.print(settings.mqttTopic2);
-          Serial.println("\"");
-          }
-        bool subgood=mqttClient.subscribe(settings.mqttTopic2);
-        showSub(settings.mqttTopic2,subgood);
-        }
+      Serial.println(cleanSession?"connected to MQTT broker with a new session."
+                                 :"connected to MQTT broker.");
+      mqttWasConnected=true;
+      mqttConnects++;
+      mqttFailuresInRow=0;
+      mqttConnectedAt=millis();
 
-      if (strlen(settings.mqttTopic3)>0//only subscribe once per topic
-          && strcmp(settings.mqttTopic3,settings.commandTopic)!=0 
-          && strcmp(settings.mqttTopic3,settings.mqttTopic1)!=0
-          && strcmp(settings.mqttTopic3,settings.mqttTopic2)!=0)
+      //subscribe to everything again, whether or not the session kept it, so the
+      //pool says what the session has
+      subscriptionsUsed=0;
+      subscriptionsOverflowed=false;
+      addSubscription(settings.commandTopic);
+      for (int i=0;i<MAX_RULES;i++)
         {
-        if (settings.debug)
-          {
-          Serial.print("Subscribing to topic \"");
-          Serial.print(settings.mqttTopic3);
-          Serial.println("\"");
-          }
-        bool subgood=mqttClient.subscribe(settings.mqttTopic3);
-        showSub(settings.mqttTopic3,subgood);
-        }
-
-      if (strlen(settings.mqttTopic4)>0//only subscribe once per topic
-          && strcmp(settings.mqttTopic4,settings.commandTopic)!=0 
-          && strcmp(settings.mqttTopic4,settings.mqttTopic1)!=0
-          && strcmp(settings.mqttTopic4,settings.mqttTopic2)!=0
-          && strcmp(settings.mqttTopic4,settings.mqttTopic3)!=0)
-        {
-        if (settings.debug)
-          {
-          Serial.print("Subscribing to topic \"");
-          Serial.print(settings.mqttTopic4);
-          Serial.println("\"");
-          }
-        bool subgood=mqttClient.subscribe(settings.mqttTopic4);
-        showSub(settings.mqttTopic4,subgood);
+        const char* topic=ruleSubscription(i);
+        if (topic!=NULL)
+          addSubscription(topic);
         }
+      if (cleanSession)
+        rememberSessionTopics(topics);
       digitalWrite(LED_BUILTIN,LED_ON);
       }
     else 
       {
+      mqttFailuresInRow++;
+      mqttLastState=mqttClient.state();
+      unsigned long backoff=MQTT_RETRY_MAX_MS;
+      if (mqttFailuresInRow<=16 && (MQTT_RETRY_MS<<(mqttFailuresInRow-1))<MQTT_RETRY_MAX_MS)
+        backoff=MQTT_RETRY_MS<<(mqttFailuresInRow-1);
+      mqttWait=backoff/2+mqttJitter(backoff/2);
       Serial.print("failed, rc=");
-      Serial.println(mqttClient.state());
-      Serial.println("Will try again in a second");
-      
-      // Wait a second before retrying
-      // In the meantime check for input in case something needs to be changed to make it work
-      checkForCommand(); 
-      
-      delay(1000);
+      Serial.println(mqttLastState);
+      Serial.printf("Will try again in %lu ms\n",mqttWait);
       }
     }
   mqttClient.loop(); //This has to happen every so often or we get disconnected for some reason
   }
 
+/// @brief How the connection to the broker has been going
+void writeMqttStatus(Print& out)
+  {
+  out.printf("mqtt attempts %lu, connects %lu, lost %lu, failures in a row %u, last rc %d",
+             mqttAttempts,mqttConnects,mqttDisconnects,mqttFailuresInRow,mqttLastState);
+  if (mqttClient.connected())
+    out.printf(", connected %lu s",(replyMillis-mqttConnectedAt)/1000);
+  }
+
 //Generate an MQTT client ID.  This should not be necessary very often
 char* generateMqttClientId(char* mqttId)
   {
-  String ext=String(random(0xffff), HEX);
-  const char* extc=ext.c_str();
-  strcpy(mqttId,MQTT_CLIENT_ID_ROOT);
-  strcat(mqttId,extc);
+  snprintf(mqttId,MQTT_CLIENTID_SIZE+1,"%s%lx",MQTT_CLIENT_ID_ROOT,(unsigned long)random(0xffff));
   if (settings.debug)
     {
     Serial.print("New MQTT userid is ");
@@ -1137,126 +3734,492 @@ char* generateMqttClientId(char* mqttId)
   return mqttId;
   }
 
+/// @brief Where a setting is in memory
+/// @param ruleNumber the rule, for rule settings
+char* settingField(const settingDescriptor* setting, int ruleNumber)
+  {
+  if (setting->flags&SETTING_RULE_TABLE)
+    return (char*)&settings+setting->offset+ruleNumber*(setting->type==SETTING_TEXT?setting->size+1:setting->size);
+  if (setting->flags&SETTING_RULE)
+    return (char*)&settings.rules[ruleNumber]+setting->offset;
+  return (char*)&settings+setting->offset;
+  }
+
+long long readSettingField(const settingDescriptor* setting, const char* field)
+  {
+  switch (setting->size)
+    {
+    case 1: return *(const uint8*)field;
+    case 2: return *(const uint16*)field;
+    case 4: return setting->min<0?(long long)*(const sint32*)field:(long long)*(const uint32*)field;
+    default: return *(const long long*)field;
+    }
+  }
+
+void writeSettingField(const settingDescriptor* setting, char* field, long long value)
+  {
+  switch (setting->size)
+    {
+    case 1: *(uint8*)field=value; break;
+    case 2: *(uint16*)field=value; break;
+    case 4: *(uint32*)field=value; break;
+    default: *(long long*)field=value; break;
+    }
+  }
+
+/// @brief Read a whole value as a number, with nothing before or after it
+boolean parseWholeNumber(const char* value, long long* number)
+  {
+  char* end=NULL;
+  errno=0;
+  *number=strtoll(value,&end,10);
+  return end!=value && *end=='\0' && errno==0 && !isspace((unsigned char)value[0]);
+  }
+
+/// @brief Store a value in a setting.  Numbers out of range are brought into
+/// it, and a rate that doesn't make sense turns the limit off, unless strict
+/// is set.  Then nothing is stored.
+/// @param strict refuse a value that isn't exactly one the setting can hold
+/// @return false if strict and the value was refused
+boolean applySetting(const settingDescriptor* setting, int ruleNumber, const char* value, boolean strict)
+  {
+  char* field=settingField(setting,ruleNumber);
+  switch (setting->type)
+    {
+    case SETTING_TEXT:
+      if (strict && strlen(value)>setting->size)
+        return false;
+      strncpy(field,value,setting->size);
+      field[setting->size]='\0';
+      break;
+    case SETTING_NUMBER:
+      {
+      long long number=0;
+      if (strict)
+        {
+        if (!parseWholeNumber(value,&number) || number<setting->min || number>setting->max)
+          return false;
+        }
+      else
+        number=strtoll(value,NULL,10);
+      if (number<setting->min)
+        number=setting->min;
+      if (number>setting->max)
+        number=setting->max;
+      writeSettingField(setting,field,number);
+      break;
+      }
+    case SETTING_BOOL:
+      if (strict && strcmp(value,"true")!=0 && strcmp(value,"false")!=0)
+        return false;
+      *(boolean*)field=strcmp(value,"false")!=0;
+      break;
+    case SETTING_RATE:
+      {
+      rateLimit* rate=(rateLimit*)field;
+      unsigned int count=0;
+      unsigned int seconds=0;
+      char extra;
+      if (strict && strcmp(value,"0")==0)
+        ; //no limit
+      else if (sscanf(value,"%u/%u%c",&count,&seconds,&extra)!=2 || count>255 || seconds>65535 || (count>0 && seconds==0))
+        {
+        if (strict)
+          return false;
+        count=seconds=0; //anything that doesn't make sense turns it off
+        }
+      rate->count=count;
+      rate->seconds=seconds;
+      break;
+      }
+    default:
+      break;
+    }
+  return true;
+  }
+
+/// @brief Check that one setting holds something it could have been set to
+boolean settingIsSane(const settingDescriptor* setting, int ruleNumber)
+  {
+  const char* field=settingField(setting,ruleNumber);
+  switch (setting->type)
+    {
+    case SETTING_TEXT:
+      return strnlen(field,setting->size+1)<=setting->size;
+    case SETTING_NUMBER:
+      {
+      long long number=readSettingField(setting,field);
+      return number>=setting->min && number<=setting->max;
+      }
+    case SETTING_RATE:
+      return ((const rateLimit*)field)->count==0 || ((const rateLimit*)field)->seconds>0;
+    default:
+      return true;
+    }
+  }
+
+/// @brief Check every setting and rule against the setting table, for settings
+/// that came from EEPROM
+boolean settingsAreSane()
+  {
+  for (const settingDescriptor& setting:settingTable)
+    {
+    int count=(setting.flags&SETTING_RULE)?MAX_RULES:1;
+    for (int i=0;i<count;i++)
+      {
+      if (!settingIsSane(&setting,i))
+        return false;
+      }
+    }
+  return true;
+  }
+
+/// @brief A rule is in use if it has a topic or a message
+boolean ruleInUse(int ruleNumber)
+  {
+  return settings.rules[ruleNumber].topic[0]!='\0' || settings.rules[ruleNumber].message[0]!='\0';
+  }
+
+/// @brief A setting's value as text, for the settings reply and the help
+/// @param buffer where numbers are formatted
+/// @return the text, which may be the field itself
+const char* settingText(const settingDescriptor* setting, int ruleNumber, char* buffer, size_t size)
+  {
+  const char* field=settingField(setting,ruleNumber);
+  switch (setting->type)
+    {
+    case SETTING_TEXT:
+      return field;
+    case SETTING_NUMBER:
+      snprintf(buffer,size,"%lld",readSettingField(setting,field));
+      return buffer;
+    case SETTING_BOOL:
+      return *(const boolean*)field?"true":"false";
+    case SETTING_RATE:
+      snprintf(buffer,size,"%u/%u",((const rateLimit*)field)->count,((const rateLimit*)field)->seconds);
+      return buffer;
+    default:
+      return "";
+    }
+  }
+
+/// @brief Check if a setting still has its default value, so it needn't be stored
+boolean settingIsDefault(const settingDescriptor* setting, int ruleNumber)
+  {
+  const char* field=settingField(setting,ruleNumber);
+  switch (setting->type)
+    {
+    case SETTING_TEXT:
+      return strcmp(field,setting->defaultText)==0;
+    case SETTING_NUMBER:
+      return readSettingField(setting,field)==setting->defaultNumber;
+    case SETTING_BOOL:
+      return *(const boolean*)field==(setting->defaultNumber!=0);
+    case SETTING_RATE:
+      return ((const rateLimit*)field)->count==0;
+    default:
+      return true;
+    }
+  }
+
+/// @brief Put a setting back to its default value
+void defaultSetting(const settingDescriptor* setting, int ruleNumber)
+  {
+  char* field=settingField(setting,ruleNumber);
+  switch (setting->type)
+    {
+    case SETTING_TEXT:
+      strcpy(field,setting->defaultText);
+      break;
+    case SETTING_NUMBER:
+      writeSettingField(setting,field,setting->defaultNumber);
+      break;
+    case SETTING_BOOL:
+      *(boolean*)field=setting->defaultNumber!=0;
+      break;
+    case SETTING_RATE:
+      *(rateLimit*)field=rateLimit();
+      break;
+    default:
+      break;
+    }
+  }
+
+/// @brief Put the settings back to their defaults
+/// @param everything false to leave the text alone, for settings about to be
+/// read from EEPROM where an empty string isn't stored
+void setSettingDefaults(boolean everything)
+  {
+  for (const settingDescriptor& setting:settingTable)
+    {
+    if (setting.type==SETTING_ACTION || (setting.type==SETTING_TEXT && !everything))
+      continue;
+    int count=(setting.flags&SETTING_RULE)?MAX_RULES:1;
+    for (int i=0;i<count;i++)
+      defaultSetting(&setting,i);
+    }
+  }
+
+/// @brief Write or measure the settings reply.  The rule fields are written
+/// together for each rule in use, where the first of them is in the table.
+/// @param out where to write it, NULL to only work out its length
+/// @return the length of the reply
+size_t settingsDump(Print* out)
+  {
+  char value[24];
+  char name[24];
+  size_t length=1;
+  if (out!=NULL)
+    out->print("\n");
+  for (int i=0;i<SETTING_COUNT;i++)
+    {
+    const settingDescriptor* setting=&settingTable[i];
+    int rules=1;
+    int fields=1;
+    if (setting->type==SETTING_ACTION)
+      continue;
+    if (setting->flags&SETTING_RULE)
+      {
+      if (setting!=&settingTable[0] && (setting-1)->flags&SETTING_RULE)
+        continue; //already written with the first rule field
+      rules=MAX_RULES;
+      while (i+fields<SETTING_COUNT && (settingTable[i+fields].flags&SETTING_RULE))
+        fields++;
+      }
+    for (int rule=0;rule<rules;rule++)
+      {
+      if ((setting->flags&SETTING_RULE) && !ruleInUse(rule))
+        continue;
+      for (int f=0;f<fields;f++)
+        {
+        const settingDescriptor* field=setting+f;
+        const char* text=settingText(field,rule,value,sizeof(value));
+        if (field->flags&SETTING_RULE)
+          snprintf(name,sizeof(name),"%s%d=",field->name,rule+1);
+        else
+          snprintf(name,sizeof(name),"%s=",field->name);
+        length+=strlen(name)+strlen(text)+1;
+        if (out!=NULL)
+          {
+          out->print(name);
+          out->print(text);
+          out->print("\n");
+          }
+        }
+      }
+    }
+  lengthCounter address;
+  address.print(WiFi.localIP());
+  length+=strlen("MQTT client ID=\nIP Address=")+strlen(settings.mqttClientId)+address.length;
+  if (out!=NULL)
+    {
+    out->print("MQTT client ID=");
+    out->print(settings.mqttClientId);
+    out->print("\nIP Address=");
+    out->print(WiFi.localIP());
+    }
+  return length;
+  }
+
+/// @brief Write all of the settings as name=value lines, for the "settings" command
+void writeSettings(Print& out)
+  {
+  settingsDump(&out);
+  }
+
+/// @brief The length of what writeSettings() writes, without writing it
+size_t settingsLength()
+  {
+  return settingsDump(NULL);
+  }
+
 void showSettings()
   {
-  Serial.print("ssid=<wifi ssid> (");
-  Serial.print(settings.ssid);
-  Serial.println(")");
-  Serial.print("wifipass=<wifi password> (");
-  Serial.print(settings.wifiPassword);
-  Serial.println(")");
-  Serial.print("broker=<address of MQTT broker> (");
-  Serial.print(settings.brokerAddress);
-  Serial.println(")");
-  Serial.print("brokerPort=<port number MQTT broker> (");
-  Serial.print(settings.brokerPort);
-  Serial.println(")");
-  Serial.print("userName=<user ID for MQTT broker> (");
-  Serial.print(settings.mqttUsername);
-  Serial.println(")");
-  Serial.print("userPass=<user password for MQTT broker> (");
-  Serial.print(settings.mqttUserPassword);
-  Serial.println(")");
-  Serial.print("topic1=<MQTT topic for which to subscribe> (");
-  Serial.print(settings.mqttTopic1);
-  Serial.println(")");
-  Serial.print("message1=<a message for topic 1> (");
-  Serial.print(settings.mqttMessage1);
-  Serial.println(")");
-  Serial.print("description1=<what to display when message1 is received> (");
-  Serial.print(settings.description1);
-  Serial.println(")");
-  Serial.print("topic2=<MQTT topic for which to subscribe> (");
-  Serial.print(settings.mqttTopic2);
-  Serial.println(")");
-  Serial.print("message2=<a message for topic 2> (");
-  Serial.print(settings.mqttMessage2);
-  Serial.println(")");
-  Serial.print("description2=<what to display when message2 is received> (");
-  Serial.print(settings.description2);
-  Serial.println(")");
-  Serial.print("topic3=<MQTT topic for which to subscribe> (");
-  Serial.print(settings.mqttTopic3);
-  Serial.println(")");
-  Serial.print("message3=<a message for topic 3> (");
-  Serial.print(settings.mqttMessage3);
-  Serial.println(")");
-  Serial.print("description3=<what to display when message3 is received> (");
-  Serial.print(settings.description3);
-  Serial.println(")");
-  Serial.print("topic4=<MQTT topic for which to subscribe> (");
-  Serial.print(settings.mqttTopic4);
-  Serial.println(")");
-  Serial.print("message4=<a message for topic 4> (");
-  Serial.print(settings.mqttMessage4);
-  Serial.println(")");
-  Serial.print("description4=<what to display when message4 is received> (");
-  Serial.print(settings.description4);
-  Serial.println(")");
-  Serial.print("lwtMessage=<status message to send when power is removed> (");
-  Serial.print(settings.mqttLWTMessage);
-  Serial.println(")");
-  Serial.print("commandTopic=<mqtt message for commands to this device> (");
-  Serial.print(settings.commandTopic);
-  Serial.println(")");
-  Serial.print("gmtOffset=<Time offset from GMT> (");
-  Serial.print(settings.gmtOffset);
-  Serial.println(")");
-  Serial.print("volume=<Speaker volume 0-10> (");
-  Serial.print(settings.volume);
-  Serial.println(")");
-  Serial.print("debug=<print debug messages to serial port> (");
-  Serial.print(settings.debug?"true":"false");
-  Serial.println(")");
+  char value[24];
+  int unused=-1; //first rule that isn't in use
+  for (int i=0;i<SETTING_COUNT;i++)
+    {
+    const settingDescriptor* setting=&settingTable[i];
+    if (setting->type==SETTING_ACTION)
+      continue;
+    if (!(setting->flags&SETTING_RULE))
+      {
+      Serial.printf("%s=<%s> (%s)\n",setting->name,setting->help,settingText(setting,0,value,sizeof(value)));
+      continue;
+      }
+    if (setting!=&settingTable[0] && (setting-1)->flags&SETTING_RULE)
+      continue; //the rule fields are shown together, at the first one
+    for (int rule=0;rule<MAX_RULES;rule++)
+      {
+      if (!ruleInUse(rule))
+        {
+        if (unused<0)
+          unused=rule;
+        continue;
+        }
+      for (int f=i;f<SETTING_COUNT && (settingTable[f].flags&SETTING_RULE);f++)
+        {
+        Serial.printf(settingTable[f].type==SETTING_RATE?"%s%d=%s (%s)\n":"%s%d=<%s> (%s)\n",
+                      settingTable[f].name,rule+1,settingTable[f].help,
+                      settingText(&settingTable[f],rule,value,sizeof(value)));
+        }
+      }
+    if (unused>=0)
+      {
+      for (int f=i;f<SETTING_COUNT && (settingTable[f].flags&SETTING_RULE);f++)
+        Serial.printf("%s%d, ",settingTable[f].name,unused+1);
+      Serial.printf("<next unused rule, up to %d>\n",MAX_RULES);
+      }
+    }
   Serial.print("MQTT client ID=<automatically generated client ID> (");
   Serial.print(settings.mqttClientId);
-  Serial.println(") **Use \"resetmqttid=yes\" to regenerate");
-  Serial.println("\n*** Use \"factorydefaults=yes\" to reset all settings ***");
+  Serial.println(")");
+  Serial.println();
+  for (const settingDescriptor& setting:settingTable)
+    {
+    if (setting.type==SETTING_ACTION)
+      Serial.printf("*** Use %s ***\n",setting.help);
+    }
   Serial.print("\nIP Address=");
   Serial.println(WiFi.localIP());
   }
 
-/*
- * Check for configuration input via the serial port.  Return a null string 
- * if no input is available or return the complete line otherwise.
- */
-String getConfigCommand()
+void subscriptionsChanged(int ruleNumber)
   {
-  if (commandComplete) 
-    {
-    String newCommand=commandString;
+  scheduleTask(syncSubscriptions,0,false);
+  }
+
+void clockChanged(int ruleNumber)
+  {
+  updateClock();
+  }
+
+void volumeChanged(int ruleNumber)
+  {
+  adjustVolume(settings.volume);
+  }
+
+void rateChanged(int ruleNumber)
+  {
+  //start with a full bucket, keeping the counts for the telemetry
+  ruleState* state=&ruleStates[ruleNumber];
+  state->tokens=0;
+  state->lastRefill=0;
+  state->alerted=false;
+  }
+
+boolean resetMqttIdAction(const char* value)
+  {
+  generateMqttClientId(settings.mqttClientId);
+  saveSettings(TAG_CLIENT_ID);
+  return true;
+  }
 
-    commandString = "";
-    commandComplete = false;
-    return newCommand;
+boolean historyAction(const char* value)
+  {
+  if (setHistoryRange(value))
+    {
+    writeHistoryRange(Serial);
+    Serial.println();
     }
-  else return "";
+  else
+    Serial.println("History range should be yyyy-mm-dd or yyyy-mm-dd,yyyy-mm-dd");
+  return false;
   }
 
-/// @brief Accepts a KV pair to change a setting or perform an action. Minimal input checking, be careful.
-/// @param cmd 
-/// @return true if a reset is needed to activate the change
-bool processCommand(String cmd)
+boolean timeAction(const char* value)
+  {
+  if (strcmp(value,"sync")==0)
+    requestTimeSync();
+  replyMillis=millis();
+  writeTimeStatus(Serial);
+  Serial.println();
+  return false;
+  }
+
+boolean profileAction(const char* value)
+  {
+  replyMillis=millis();
+  writeProfile(Serial);
+  Serial.println();
+  if (strcmp(value,"reset")==0)
+    resetProfile();
+  return false;
+  }
+
+boolean benchmarkAction(const char* value)
+  {
+  benchmarkTopicMatch(value);
+  return false;
+  }
+
+boolean benchmarkPayloadAction(const char* value)
   {
-  const char *str=cmd.c_str();
-  char *val=NULL;
-  char *nme=strtok((char *)str,"=");
-  if (nme!=NULL)
-    val=strtok(NULL,"=");
+  benchmarkPayloadMatch(value);
+  return false;
+  }
+
+boolean factoryDefaultsAction(const char* value)
+  {
+  Serial.println("\n*********************** Resetting EEPROM Values ************************");
+  initializeSettings();
+  saveSettings();
+  requestRestart(2000);
+  return true;
+  }
 
-  char zero[]=""; //zero length string
+boolean resetAction(const char* value)
+  {
+  Serial.println("\n*********************** Resetting Device ************************");
+  requestRestart(1000);
+  return true;
+  }
 
-  //Get rid of the carriage return and/or linefeed. Twice because could have both.
-  if (val!=NULL && strlen(val)>0 && (val[strlen(val)-1]==13 || val[strlen(val)-1]==10))
-    val[strlen(val)-1]=0; 
-  if (val!=NULL && strlen(val)>0 && (val[strlen(val)-1]==13 || val[strlen(val)-1]==10))
-    val[strlen(val)-1]=0; 
+/// @brief Accepts a KV pair to change a setting or perform an action. The command
+/// is split and looked up in one pass over it, and edited in place.
+/// @param cmd the command, null terminated
+/// @return true if a reset is needed to activate the change
+bool processCommand(char* cmd)
+  {
+  char* nme=cmd;
+  char* val=NULL;
+  uint32 hash=settingHashStart(settingHashSeed);
+  size_t nameLength=0;    //not counting the rule number
+  int ruleNumber=-1;
+  boolean badName=false;  //something after the rule number
 
-  //do it for the command as well.  Might not even have a value.
-  if (nme!=NULL && strlen(nme)>0 && (nme[strlen(nme)-1]==13 || nme[strlen(nme)-1]==10))
-    nme[strlen(nme)-1]=0; 
-  if (nme!=NULL && strlen(nme)>0 && (nme[strlen(nme)-1]==13 || nme[strlen(nme)-1]==10))
-    nme[strlen(nme)-1]=0; 
+  //The name is up to the '=' and the value after it.  A CR or LF ends the command.
+  for (char* p=nme;;p++)
+    {
+    char c=*p;
+    if (c=='\0' || c=='\r' || c=='\n')
+      {
+      *p='\0';
+      break;
+      }
+    if (val!=NULL)
+      continue;
+    if (c=='=')
+      {
+      *p='\0';
+      val=p+1;
+      }
+    else if (c>='0' && c<='9')
+      {
+      ruleNumber=(ruleNumber<0?0:ruleNumber)*10+(c-'0');
+      if (ruleNumber>MAX_RULES)
+        ruleNumber=MAX_RULES+1; //too big either way, and it can't overflow
+      }
+    else if (ruleNumber>=0)
+      badName=true;
+    else
+      {
+      hash=settingHashStep(hash,c);
+      nameLength++;
+      }
+    }
+  if (val==NULL)
+    val=nme+strlen(nme); //no value is an empty one
 
   if (settings.debug)
     {
@@ -1272,278 +4235,548 @@ bool processCommand(String cmd)
     Serial.println("\"\n");
     }
 
-  bool needRestart=true; //most changes will need a restart
-
-  if (val==NULL)
-    val=zero;
-
-  if (nme==NULL || val==NULL || strlen(nme)==0) //empty string is a valid val value
+  if (strlen(nme)==0) //empty string is a valid val value
     {
     showSettings();
     return false;   //not a valid command, or it's missing
     }
-  else if (strcmp(nme,"ssid")==0)
-    {
-    strncpy(settings.ssid,val,SSID_SIZE);
-    settings.ssid[SSID_SIZE]='\0';
-    saveSettings();
-    }
-  else if (strcmp(nme,"wifipass")==0)
-    {
-    strncpy(settings.wifiPassword,val,PASSWORD_SIZE);
-    settings.wifiPassword[PASSWORD_SIZE]='\0';
-    saveSettings();
-    }
-  else if (strcmp(nme,"broker")==0)
-    {
-    strncpy(settings.brokerAddress,val,ADDRESS_SIZE);
-    settings.brokerAddress[ADDRESS_SIZE]='\0';
-    saveSettings();
-    }
-  else if (strcmp(nme,"brokerPort")==0)
-    {
-    settings.brokerPort=atoi(val);
-    saveSettings();
-    }
-  else if (strcmp(nme,"userName")==0)
-    {
-    strncpy(settings.mqttUsername,val,USERNAME_SIZE);
-    settings.mqttUsername[USERNAME_SIZE]='\0';
-    saveSettings();
-    }
-  else if (strcmp(nme,"userPass")==0)
-    {
-    strncpy(settings.mqttUserPassword,val,PASSWORD_SIZE);
-    settings.mqttUserPassword[PASSWORD_SIZE]='\0';
-    saveSettings();
-    }
-  else if (strcmp(nme,"lwtMessage")==0)
-    {
-    strncpy(settings.mqttLWTMessage,val,MQTT_MAX_MESSAGE_SIZE);
-    settings.mqttLWTMessage[MQTT_MAX_MESSAGE_SIZE]='\0';
-    saveSettings();
-    }
-  else if (strcmp(nme,"topic1")==0)
-    {
-    strncpy(settings.mqttTopic1,val,MQTT_MAX_TOPIC_SIZE);
-    settings.mqttTopic1[MQTT_MAX_TOPIC_SIZE]='\0';
-    saveSettings();
-    }
-  else if (strcmp(nme,"topic2")==0)
-    {
-    strncpy(settings.mqttTopic2,val,MQTT_MAX_TOPIC_SIZE);
-    settings.mqttTopic2[MQTT_MAX_TOPIC_SIZE]='\0';
-    saveSettings();
-    }
-  else if (strcmp(nme,"topic3")==0)
+
+  const settingDescriptor* setting=badName?NULL:lookupSetting(hash,nme,nameLength);
+  boolean isRule=setting!=NULL && (setting->flags&SETTING_RULE);
+  if (setting==NULL 
+      || (isRule && (ruleNumber<1 || ruleNumber>MAX_RULES)) 
+      || (!isRule && ruleNumber>=0)
+      || ((setting->flags&SETTING_CONFIRM) && strcmp(val,"yes")!=0))
     {
-    strncpy(settings.mqttTopic3,val,MQTT_MAX_TOPIC_SIZE);
-    settings.mqttTopic3[MQTT_MAX_TOPIC_SIZE]='\0';
-    saveSettings();
+    showSettings();
+    unknownCommand=true;
+    return false;
     }
-  else if (strcmp(nme,"topic4")==0)
+
+  if (setting->type==SETTING_ACTION)
+    return setting->action(val);
+
+  ruleNumber--; //0-based from here on
+  if (!applySetting(setting,ruleNumber,val,strictValues))
     {
-    strncpy(settings.mqttTopic4,val,MQTT_MAX_TOPIC_SIZE);
-    settings.mqttTopic4[MQTT_MAX_TOPIC_SIZE]='\0';
-    saveSettings();
+    Serial.printf("Bad value \"%s\" for %s\n",val,setting->name);
+    badValue=true;
+    return false;
     }
-  else if (strcmp(nme,"message1")==0)
+  saveSettings(setting->tag,ruleNumber);
+  if (setting->changed!=NULL)
+    setting->changed(ruleNumber);
+  return (setting->flags&SETTING_RESTART)!=0;
+  }
+
+void initializeSettings()
+  {
+  settings.validConfig=0; 
+  setSettingDefaults(true);
+  strcpy(settings.rules[0].topic,DEFAULT_MQTT_TOPIC);
+  generateMqttClientId(settings.mqttClientId);
+  saveSettings();
+  }
+
+/// @brief Handle a line from the serial port, which is either a command or
+/// part of a batch
+void serialCommand(char* line)
+  {
+  if (serialBatching)
     {
-    strncpy(settings.mqttMessage1,val,MQTT_MAX_MESSAGE_SIZE);
-    settings.mqttMessage1[MQTT_MAX_MESSAGE_SIZE]='\0';
-    saveSettings();
+    if (strcmp(line,"end")!=0)
+      {
+      if (!serialBatchTooBig
+          && !(appendBounded(serialBatch,sizeof(serialBatch),&serialBatchUsed,line,strlen(line))
+               && appendBounded(serialBatch,sizeof(serialBatch),&serialBatchUsed,"\n",1)))
+        {
+        serialOverruns++;
+        serialBatchTooBig=true; //keep reading to the end, but don't apply any of it
+        }
+      return;
+      }
+    serialBatching=false;
+    if (serialBatchTooBig)
+      Serial.printf("************ Batch is longer than %d bytes, nothing was changed.\n",SERIAL_BATCH_SIZE-1);
+    else if (applyBatch(serialBatch,serialBatchUsed))
+      requestRestart(1000);
+    return;
     }
-  else if (strcmp(nme,"message2")==0)
+  if (strcmp(line,"batch")==0)
     {
-    strncpy(settings.mqttMessage2,val,MQTT_MAX_MESSAGE_SIZE);
-    settings.mqttMessage2[MQTT_MAX_MESSAGE_SIZE]='\0';
-    saveSettings();
+    serialBatching=true;
+    serialBatchTooBig=false;
+    serialBatchUsed=0;
+    serialBatch[0]='\0';
+    Serial.println("Send one setting per line, then \"end\".");
+    return;
     }
-  else if (strcmp(nme,"message3")==0)
+  processCommand(line);
+  }
+
+void checkForCommand()
+  {
+  incomingData();
+  while (readSerialLine())
     {
-    strncpy(settings.mqttMessage3,val,MQTT_MAX_MESSAGE_SIZE);
-    settings.mqttMessage3[MQTT_MAX_MESSAGE_SIZE]='\0';
-    saveSettings();
+    serialCommand(serialLine);
+    incomingData(); //more may have come while that was done
     }
-  else if (strcmp(nme,"message4")==0)
+  }
+  
+/*
+*  Initialize the settings from eeprom and determine if they are valid
+*/
+void loadSettings()
+  {
+  uint16 flag=0;
+  EEPROM.get(0,flag);
+  if (flag==TLV_SETTINGS_FLAG)
     {
-    strncpy(settings.mqttMessage4,val,MQTT_MAX_MESSAGE_SIZE);
-    settings.mqttMessage4[MQTT_MAX_MESSAGE_SIZE]='\0';
-    saveSettings();
+    if (!readSettings())
+      {
+      Serial.println("Settings in EEPROM are damaged, initializing.");
+      initializeSettings();
+      }
     }
-  else if (strcmp(nme,"description1")==0)
+  else
     {
-    strncpy(settings.description1,val,DISPLAY_COLUMNS);
-    settings.description1[DISPLAY_COLUMNS]='\0';
-    saveSettings();
+    //one of the fixed layouts from before the tag-length-value store, or nothing at all
+    unsigned int fixedFlag=0;
+    EEPROM.get(0,fixedFlag);
+    memset((void*)&settings,0,sizeof(settings));
+    setSettingDefaults(true);
+    if (fixedFlag==LEGACY_SETTINGS_FLAG)
+      migrateLegacySettings();
+    else if (fixedFlag==RULE_TABLE_SETTINGS_FLAG || fixedFlag==VALID_SETTINGS_FLAG)
+      {
+      Serial.println("Converting the settings to tag-length-value records.");
+      readFixedSettings(fixedFlag==VALID_SETTINGS_FLAG);
+      saveSettings();
+      }
     }
-  else if (strcmp(nme,"description2")==0)
+  if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
     {
-    strncpy(settings.description2,val,DISPLAY_COLUMNS);
-    settings.description2[DISPLAY_COLUMNS]='\0';
-    saveSettings();
+    compileTopicTrie();
+    compilePayloadIndex();
+    settingsAreValid=true;
+    if (settings.debug)
+      Serial.println("Loaded configuration values from EEPROM");
     }
-  else if (strcmp(nme,"description3")==0)
+  else
     {
-    strncpy(settings.description3,val,DISPLAY_COLUMNS);
-    settings.description3[DISPLAY_COLUMNS]='\0';
-    saveSettings();
+    Serial.println("Skipping load from EEPROM, device not configured.");    
+    settingsAreValid=false;
     }
-  else if (strcmp(nme,"description4")==0)
+  }
+
+/// @brief Fletcher-16 checksum of a range of EEPROM
+uint16 settingsChecksum(int start, int length)
+  {
+  uint16 sum1=0;
+  uint16 sum2=0;
+  for (int i=start;i<start+length;i++)
     {
-    strncpy(settings.description4,val,DISPLAY_COLUMNS);
-    settings.description4[DISPLAY_COLUMNS]='\0';
-    saveSettings();
+    sum1=(sum1+EEPROM.read(i))%255;
+    sum2=(sum2+sum1)%255;
     }
-  else if ((strcmp(nme,"resetmqttid")==0)&& (strcmp(val,"yes")==0))
+  return (sum2<<8)|sum1;
+  }
+
+void readSettingString(int pos, uint8 length, char* field, size_t size)
+  {
+  size_t count=length<size?length:size; //anything too long for the field is cut off
+  for (size_t i=0;i<count;i++)
+    field[i]=EEPROM.read(pos+i);
+  field[count]='\0';
+  }
+
+/// @brief Read a little endian number of up to four bytes
+uint32 readSettingNumber(int pos, uint8 length)
+  {
+  uint32 value=0;
+  for (int i=length<4?length-1:3;i>=0;i--)
+    value=(value<<8)|EEPROM.read(pos+i);
+  return value;
+  }
+
+/*
+ * Load the settings from the tag-length-value records in EEPROM.  Each record is
+ * found in the setting table by its tag.  Text that isn't there is left empty,
+ * anything else that isn't there is left at its default.
+ * Returns false if the records are damaged.
+ */
+boolean readSettings()
+  {
+  settingsHeader header={};
+  EEPROM.get(0,header);
+  int end=sizeof(header)+header.length;
+  if (end>SETTINGS_RECORDS_END || settingsChecksum(sizeof(header),header.length)!=header.checksum)
+    return false;
+
+  memset((void*)&settings,0,sizeof(settings));
+  setSettingDefaults(false);
+
+  int pos=sizeof(header);
+  while (pos+TLV_RECORD_OVERHEAD<=end)
     {
-    generateMqttClientId(settings.mqttClientId);
-    saveSettings();
+    uint8 tag=EEPROM.read(pos);
+    uint8 index=EEPROM.read(pos+1);
+    uint8 length=EEPROM.read(pos+2);
+    int value=pos+TLV_RECORD_OVERHEAD;
+    if (tag==TAG_END || value+length>end)
+      break;
+    pos=value+length;
+
+    if (tag==TAG_CLIENT_ID) //not a setting anyone can change
+      {
+      readSettingString(value,length,settings.mqttClientId,MQTT_CLIENTID_SIZE);
+      continue;
+      }
+    int found=tag<SETTING_TAG_SLOTS?settingsByTag.setting[tag]:-1;
+    if (found<0)
+      continue; //written by a different build, not for us
+    const settingDescriptor* setting=&settingTable[found];
+    if ((setting->flags&SETTING_RULE) && index>=MAX_RULES)
+      continue; //a later build may have more rules
+    char* field=settingField(setting,(setting->flags&SETTING_RULE)?index:0);
+    switch (setting->type)
+      {
+      case SETTING_TEXT:
+        readSettingString(value,length,field,setting->size);
+        break;
+      case SETTING_NUMBER:
+        {
+        uint32 number=readSettingNumber(value,length);
+        if (setting->min<0)
+          writeSettingField(setting,field,(sint32)number);
+        else
+          writeSettingField(setting,field,number);
+        break;
+        }
+      case SETTING_BOOL:
+        *(boolean*)field=readSettingNumber(value,length)!=0;
+        break;
+      case SETTING_RATE:
+        if (length==3)
+          {
+          ((rateLimit*)field)->count=EEPROM.read(value);
+          ((rateLimit*)field)->seconds=readSettingNumber(value+1,2);
+          }
+        break;
+      default:
+        break;
+      }
     }
-  else if (strcmp(nme,"commandTopic")==0)
+
+  settingsGeneration=header.generation;
+  dirtySettings=0;
+  dirtyRules=0;
+  compileTopicTrie();
+  compilePayloadIndex();
+  settings.validConfig=settingsComplete()?VALID_SETTINGS_FLAG:0;
+  return true;
+  }
+
+/*
+ * Writes tag-length-value records into the EEPROM buffer, only touching the bytes
+ * that are different from what's already there.
+ */
+class recordWriter
+  {
+  public:
+    int pos=sizeof(settingsHeader);
+    boolean changed=false;  //some byte was different
+    boolean full=false;     //ran out of room
+    boolean measuring=false; //only find out where the records would end
+    void put(uint8 b)
+      {
+      if (pos>=SETTINGS_RECORDS_END)
+        {
+        full=true;
+        return;
+        }
+      if (!measuring && EEPROM.read(pos)!=b)
+        {
+        EEPROM.write(pos,b);
+        changed=true;
+        }
+      sum1=(sum1+b)%255;
+      sum2=(sum2+sum1)%255;
+      pos++;
+      }
+    void record(uint8 tag, uint8 index, const uint8* value, uint8 length)
+      {
+      put(tag);
+      put(index);
+      put(length);
+      for (int i=0;i<length;i++)
+        put(value[i]);
+      }
+    void text(uint8 tag, uint8 index, const char* value)
+      {
+      size_t length=strlen(value);
+      if (length>0) //empty strings aren't stored
+        record(tag,index,(const uint8*)value,length>255?255:length);
+      }
+    void number(uint8 tag, uint8 index, uint32 value, uint8 length)
+      {
+      uint8 bytes[4];
+      for (int i=0;i<4;i++)
+        bytes[i]=value>>(8*i);
+      record(tag,index,bytes,length);
+      }
+    uint16 checksum() { return (sum2<<8)|sum1; }
+  private:
+    uint16 sum1=0;
+    uint16 sum2=0;
+  };
+
+/// @brief Write one setting's record, or nothing if it's a rule field that needn't be stored
+void writeSettingRecord(recordWriter& out, const settingDescriptor* setting, int ruleNumber)
+  {
+  int i=ruleNumber<0?0:ruleNumber;
+  if (ruleNumber>=0 && settingIsDefault(setting,i))
+    return; //rule fields come back as their defaults when they aren't stored
+  const char* field=settingField(setting,i);
+  switch (setting->type)
     {
-    strcpy(settings.commandTopic,val);
-    saveSettings();
+    case SETTING_TEXT:
+      out.text(setting->tag,i,field);
+      break;
+    case SETTING_NUMBER:
+      out.number(setting->tag,i,readSettingField(setting,field),setting->size<4?setting->size:4);
+      break;
+    case SETTING_BOOL:
+      out.number(setting->tag,i,*(const boolean*)field,1);
+      break;
+    case SETTING_RATE:
+      {
+      const rateLimit* limit=(const rateLimit*)field;
+      uint8 rate[3]={limit->count,(uint8)(limit->seconds&0xFF),(uint8)(limit->seconds>>8)};
+      out.record(setting->tag,i,rate,sizeof(rate));
+      break;
+      }
+    default:
+      break;
     }
-  else if (strcmp(nme,"gmtOffset")==0)
+  }
+
+/// @brief Write all of the settings records, the device's own first and then each
+/// rule's together, so that running out of room can be blamed on a rule
+/// @return the rule that didn't fit, or -1 if they all did
+int writeSettingsRecords(recordWriter& out)
+  {
+  int lastRule=-1;
+  out.text(TAG_CLIENT_ID,0,settings.mqttClientId);
+  for (const settingDescriptor& setting:settingTable)
+    if (setting.type!=SETTING_ACTION && !(setting.flags&SETTING_RULE))
+      writeSettingRecord(out,&setting,-1);
+  for (int i=0;i<MAX_RULES;i++)
     {
-    settings.gmtOffset=atoi(val);
-    saveSettings();
-    updateClock();
-    needRestart=false;
+    if (!ruleInUse(i))
+      continue;
+    for (const settingDescriptor& setting:settingTable)
+      if (setting.flags&SETTING_RULE)
+        writeSettingRecord(out,&setting,i);
+    if (out.full)
+      return i;
+    lastRule=i;
     }
-  else if (strcmp(nme,"volume")==0)
+  out.put(TAG_END);
+  return out.full?lastRule:-1;
+  }
+
+/// @brief Go back to the settings last committed to EEPROM, dropping any changes
+/// that haven't been committed yet
+/// @return false if there weren't any to go back to
+boolean revertSettings()
+  {
+  cancelTask(commitSettings);
+  boolean reverted=readSettings();
+  if (!reverted)
+    Serial.println("************ Failure when reloading settings!");
+  settingsAreValid=settings.validConfig==VALID_SETTINGS_FLAG;
+  adjustVolume(settings.volume);
+  scheduleTask(syncSubscriptions,0,false); //in case a topic was changed
+  return reverted;
+  }
+
+/*
+ * Write the settings to EEPROM and commit them to flash.  saveSettings() only
+ * marks what changed and schedules this for when the changes stop coming, so
+ * configuring a device a setting at a time costs one flash write instead of one
+ * per setting.  Nothing is written if the records come out the same as before.
+ * The records are measured first: if a rule would run past the end of EEPROM the
+ * change is refused and the settings go back to what was last committed, with
+ * the rule left in refusedRule.
+ */
+void commitSettings()
+  {
+  if (dirtySettings==0 && dirtyRules==0)
+    return;
+
+  recordWriter measure;
+  measure.measuring=true;
+  int overflow=writeSettingsRecords(measure);
+  if (measure.full)
     {
-    settings.volume=atoi(val);
-    if (settings.volume>10) 
-      settings.volume=10;
-    if (settings.volume<0) 
-      settings.volume=0;
-    adjustVolume(settings.volume);
-    saveSettings();
-    needRestart=false;
+    refusedRule=overflow;
+    Serial.printf("************ Rule %d won't fit in EEPROM, the change is refused.\n",overflow+1);
+    if (!revertSettings() && overflow>=0)
+      {
+      //nothing committed to go back to, so the rule itself has to go
+      for (const settingDescriptor& setting:settingTable)
+        if (setting.flags&SETTING_RULE)
+          defaultSetting(&setting,overflow);
+      dirtyRules|=1UL<<overflow;
+      compileTopicTrie();
+      compilePayloadIndex();
+      commitSettings();
+      }
+    return;
     }
-  else if (strcmp(nme,"debug")==0)
+
+  recordWriter out;
+  writeSettingsRecords(out);
+
+  settingsHeader header={};
+  EEPROM.get(0,header);
+  uint16 length=out.pos-sizeof(header);
+  int changedSettings=__builtin_popcount(dirtySettings);
+  int changedRules=__builtin_popcount(dirtyRules);
+  dirtySettings=0;
+  dirtyRules=0;
+  if (!out.changed && header.flag==TLV_SETTINGS_FLAG && header.length==length)
     {
-    settings.debug=strcmp(val,"false")==0?false:true;
-    saveSettings();
-    needRestart=false;
+    if (settings.debug)
+      Serial.println("Settings are the same as in EEPROM, nothing to commit.");
+    return;
     }
-  else if ((strcmp(nme,"factorydefaults")==0) && (strcmp(val,"yes")==0)) //reset all eeprom settings
+
+  header={TLV_SETTINGS_FLAG,SETTINGS_VERSION,0,settingsGeneration+1,length,out.checksum()};
+  EEPROM.put(0,header);
+  if (subscriptionsSyncInPlace())
     {
-    Serial.println("\n*********************** Resetting EEPROM Values ************************");
-    initializeSettings();
-    saveSettings();
-    delay(2000);
-    ESP.restart();
+    //syncSubscriptions() is about to make the session match the new topics, so
+    //the session record can go along with this commit instead of taking its own
+    sessionRecord record={SESSION_RECORD_FLAG,0,subscriptionSetHash()};
+    EEPROM.put(SETTINGS_RECORDS_END,record);
     }
-  else if ((strcmp(nme,"reset")==0) && (strcmp(val,"yes")==0)) //reset the device
+  if (EEPROM.commit())
     {
-    Serial.println("\n*********************** Resetting Device ************************");
-    delay(1000);
-    ESP.restart();
+    settingsGeneration++;
+    if (settings.debug)
+      Serial.printf("Committed settings generation %lu, %u bytes, %d settings and %d rules changed.\n",
+                    (unsigned long)settingsGeneration,length,changedSettings,changedRules);
     }
   else
-    {
-    showSettings();
-    needRestart=false;
-    }
-  return needRestart;
+    Serial.println("************ Failure when committing settings to flash!");
   }
 
-void initializeSettings()
+/// @brief Read the settings that are at the start of every fixed layout
+void readFixedConnection()
   {
-  settings.validConfig=0; 
-  strcpy(settings.ssid,"");
-  strcpy(settings.wifiPassword,"");
-  strcpy(settings.brokerAddress,"");
-  settings.brokerPort=DEFAULT_MQTT_BROKER_PORT;
-  strcpy(settings.mqttLWTMessage,DEFAULT_MQTT_LWT_MESSAGE);
-  strcpy(settings.mqttMessage1,"");
-  strcpy(settings.mqttMessage2,"");
-  strcpy(settings.mqttMessage3,"");
-  strcpy(settings.mqttMessage4,"");
-  strcpy(settings.description1,"");
-  strcpy(settings.description2,"");
-  strcpy(settings.description3,"");
-  strcpy(settings.description4,"");
-  strcpy(settings.mqttTopic1,DEFAULT_MQTT_TOPIC);
-  strcpy(settings.mqttTopic2,"");
-  strcpy(settings.mqttTopic3,"");
-  strcpy(settings.mqttTopic4,"");
-  strcpy(settings.mqttUsername,"");
-  strcpy(settings.mqttUserPassword,"");
-  strcpy(settings.commandTopic,DEFAULT_MQTT_TOPIC);
-  generateMqttClientId(settings.mqttClientId);
-  settings.debug=false;
-  settings.gmtOffset=DEFAULT_GMT_OFFSET;
-  settings.volume=DEFAULT_VOLUME;
-  saveSettings();
+  readSettingString(offsetof(fixedConf,ssid),FIXED_SSID_SIZE,settings.ssid,SSID_SIZE);
+  readSettingString(offsetof(fixedConf,wifiPassword),FIXED_PASSWORD_SIZE,settings.wifiPassword,PASSWORD_SIZE);
+  readSettingString(offsetof(fixedConf,brokerAddress),FIXED_ADDRESS_SIZE,settings.brokerAddress,ADDRESS_SIZE);
+  EEPROM.get(offsetof(fixedConf,brokerPort),settings.brokerPort);
+  readSettingString(offsetof(fixedConf,mqttUsername),FIXED_USERNAME_SIZE,settings.mqttUsername,USERNAME_SIZE);
+  readSettingString(offsetof(fixedConf,mqttUserPassword),FIXED_PASSWORD_SIZE,settings.mqttUserPassword,PASSWORD_SIZE);
   }
 
-void checkForCommand()
+/*
+ * Read the settings from the fixed rule table layout, with or without the rate
+ * limits after it.  The fields are read out of EEPROM one at a time, because
+ * the whole layout is too big to put on the stack.
+ */
+void readFixedSettings(boolean withRates)
   {
-  incomingData();
-  String cmd=getConfigCommand();
-  if (cmd.length()>0)
+  readFixedConnection();
+  readSettingString(offsetof(fixedConf,mqttLWTMessage),FIXED_MESSAGE_SIZE,settings.mqttLWTMessage,MQTT_MAX_MESSAGE_SIZE);
+  readSettingString(offsetof(fixedConf,commandTopic),FIXED_TOPIC_SIZE,settings.commandTopic,MQTT_MAX_TOPIC_SIZE);
+  EEPROM.get(offsetof(fixedConf,debug),settings.debug);
+  readSettingString(offsetof(fixedConf,mqttClientId),FIXED_CLIENTID_SIZE,settings.mqttClientId,MQTT_CLIENTID_SIZE);
+  EEPROM.get(offsetof(fixedConf,gmtOffset),settings.gmtOffset);
+  EEPROM.get(offsetof(fixedConf,volume),settings.volume);
+  for (int i=0;i<FIXED_RULES && i<MAX_RULES;i++)
     {
-    processCommand(cmd);
+    int pos=offsetof(fixedConf,rules)+i*sizeof(fixedRule);
+    rule* r=&settings.rules[i];
+    readSettingString(pos+offsetof(fixedRule,topic),FIXED_TOPIC_SIZE,r->topic,MQTT_MAX_TOPIC_SIZE);
+    readSettingString(pos+offsetof(fixedRule,message),FIXED_MESSAGE_SIZE,r->message,MQTT_MAX_MESSAGE_SIZE);
+    readSettingString(pos+offsetof(fixedRule,description),FIXED_DESCRIPTION_SIZE,r->description,DISPLAY_COLUMNS);
+    EEPROM.get(pos+offsetof(fixedRule,track),r->track);
+    unsigned long debounceMs=0;
+    EEPROM.get(pos+offsetof(fixedRule,debounceMs),debounceMs);
+    r->debounceMs=debounceMs;
+    if (withRates)
+      {
+      fixedRate rate={};
+      EEPROM.get(offsetof(fixedConf,rates)+i*sizeof(fixedRate),rate);
+      settings.rates[i].count=rate.count;
+      settings.rates[i].seconds=rate.seconds;
+      }
     }
   }
-  
+
 /*
-*  Initialize the settings from eeprom and determine if they are valid
-*/
-void loadSettings()
+ * Bring settings saved before there was a rule table into the new layout. The
+ * four fixed topics, messages and descriptions become rules 1 through 4.
+ */
+void migrateLegacySettings()
   {
-  EEPROM.get(0,settings);
-  if (settings.validConfig==VALID_SETTINGS_FLAG)    //skip loading stuff if it's never been written
-    {
-    settingsAreValid=true;
-    if (settings.debug)
-      Serial.println("Loaded configuration values from EEPROM");
-    }
-  else
+  Serial.println("Converting settings from the four-topic layout.");
+  readFixedConnection();
+  readSettingString(offsetof(legacyConf,mqttTopic1),FIXED_TOPIC_SIZE,settings.rules[0].topic,MQTT_MAX_TOPIC_SIZE);
+  readSettingString(offsetof(legacyConf,mqttTopic2),FIXED_TOPIC_SIZE,settings.rules[1].topic,MQTT_MAX_TOPIC_SIZE);
+  readSettingString(offsetof(legacyConf,mqttTopic3),FIXED_TOPIC_SIZE,settings.rules[2].topic,MQTT_MAX_TOPIC_SIZE);
+  readSettingString(offsetof(legacyConf,mqttTopic4),FIXED_TOPIC_SIZE,settings.rules[3].topic,MQTT_MAX_TOPIC_SIZE);
+  readSettingString(offsetof(legacyConf,mqttMessage1),FIXED_MESSAGE_SIZE,settings.rules[0].message,MQTT_MAX_MESSAGE_SIZE);
+  readSettingString(offsetof(legacyConf,mqttMessage2),FIXED_MESSAGE_SIZE,settings.rules[1].message,MQTT_MAX_MESSAGE_SIZE);
+  readSettingString(offsetof(legacyConf,mqttMessage3),FIXED_MESSAGE_SIZE,settings.rules[2].message,MQTT_MAX_MESSAGE_SIZE);
+  readSettingString(offsetof(legacyConf,mqttMessage4),FIXED_MESSAGE_SIZE,settings.rules[3].message,MQTT_MAX_MESSAGE_SIZE);
+  readSettingString(offsetof(legacyConf,description1),FIXED_DESCRIPTION_SIZE,settings.rules[0].description,DISPLAY_COLUMNS);
+  readSettingString(offsetof(legacyConf,description2),FIXED_DESCRIPTION_SIZE,settings.rules[1].description,DISPLAY_COLUMNS);
+  readSettingString(offsetof(legacyConf,description3),FIXED_DESCRIPTION_SIZE,settings.rules[2].description,DISPLAY_COLUMNS);
+  readSettingString(offsetof(legacyConf,description4),FIXED_DESCRIPTION_SIZE,settings.rules[3].description,DISPLAY_COLUMNS);
+  readSettingString(offsetof(legacyConf,mqttLWTMessage),FIXED_MESSAGE_SIZE,settings.mqttLWTMessage,MQTT_MAX_MESSAGE_SIZE);
+  readSettingString(offsetof(legacyConf,commandTopic),FIXED_TOPIC_SIZE,settings.commandTopic,MQTT_MAX_TOPIC_SIZE);
+  EEPROM.get(offsetof(legacyConf,debug),settings.debug);
+  readSettingString(offsetof(legacyConf,mqttClientId),FIXED_CLIENTID_SIZE,settings.mqttClientId,MQTT_CLIENTID_SIZE);
+  EEPROM.get(offsetof(legacyConf,gmtOffset),settings.gmtOffset);
+  EEPROM.get(offsetof(legacyConf,volume),settings.volume);
+  saveSettings(); //sets the new valid flag if everything made it across
+  }
+
+/// @brief Check that every setting needed to run is filled in and makes sense.
+/// The rules must be compiled first.
+boolean settingsComplete()
+  {
+  if (!settingsAreSane() || activeRules==0) //need at least one complete rule
+    return false;
+  for (const settingDescriptor& setting:settingTable)
     {
-    Serial.println("Skipping load from EEPROM, device not configured.");    
-    settingsAreValid=false;
+    if ((setting.flags&SETTING_REQUIRED) && settingField(&setting,0)[0]=='\0')
+      return false;
     }
+  return true;
   }
 
 /*
- * Save the settings to EEPROM. Set the valid flag if everything is filled in.
+ * Note that settings have changed and arrange for them to be saved to EEPROM.
+ * Set the valid flag if everything is filled in.  The parameters say which
+ * setting changed: a tag, and the rule index for a rule field.
  */
-boolean saveSettings()
+boolean saveSettings(uint8 changed, int ruleNumber)
   {
   static boolean wasIncomplete=false;
   static boolean shouldReboot=false;
-  if (strlen(settings.ssid)>0 &&
-    strlen(settings.ssid)<=SSID_SIZE &&
-    strlen(settings.wifiPassword)>0 &&
-    strlen(settings.wifiPassword)<=PASSWORD_SIZE &&
-    strlen(settings.brokerAddress)>0 &&
-    strlen(settings.brokerAddress)<ADDRESS_SIZE &&
-    strlen(settings.mqttLWTMessage)>0 &&
-    strlen(settings.mqttLWTMessage)<MQTT_MAX_MESSAGE_SIZE &&
-    strlen(settings.mqttMessage1)>0 &&
-    strlen(settings.mqttMessage1)<MQTT_MAX_MESSAGE_SIZE &&
-    strlen(settings.mqttMessage2)<MQTT_MAX_MESSAGE_SIZE &&
-    strlen(settings.mqttMessage3)<MQTT_MAX_MESSAGE_SIZE &&
-    strlen(settings.mqttMessage4)<MQTT_MAX_MESSAGE_SIZE &&
-    strlen(settings.description1)<=DISPLAY_COLUMNS &&
-    strlen(settings.description2)<=DISPLAY_COLUMNS &&
-    strlen(settings.description3)<=DISPLAY_COLUMNS &&
-    strlen(settings.description4)<=DISPLAY_COLUMNS &&
-    strlen(settings.mqttTopic1)>0 &&
-    strlen(settings.mqttTopic1)<MQTT_MAX_TOPIC_SIZE &&
-    strlen(settings.mqttTopic2)<MQTT_MAX_TOPIC_SIZE &&
-    strlen(settings.mqttTopic3)<MQTT_MAX_TOPIC_SIZE &&
-    strlen(settings.mqttTopic4)<MQTT_MAX_TOPIC_SIZE &&
-    strlen(settings.commandTopic)>0 &&
-    strlen(settings.commandTopic)<MQTT_MAX_TOPIC_SIZE &&
-    settings.brokerPort>0 && settings.brokerPort<65535 &&
-    settings.gmtOffset>-24 && settings.gmtOffset<24 &&
-    settings.volume>=0 && settings.volume<=10)
+
+  compileTopicTrie(); //the rules may have changed
+  compilePayloadIndex();
+
+  if (settingsComplete())
     {
     Serial.println("Settings deemed complete");
     settings.validConfig=VALID_SETTINGS_FLAG;
@@ -1566,10 +4799,19 @@ boolean saveSettings()
   if (strlen(settings.mqttClientId)==0)
     {
     generateMqttClientId(settings.mqttClientId);
+    dirtySettings|=1UL<<TAG_CLIENT_ID;
     }
 
-  EEPROM.put(0,settings);
-  return EEPROM.commit();
+  if (changed==SETTINGS_ALL)
+    {
+    dirtySettings=(2UL<<TAG_VOLUME)-2; //every tag from 1 to the last one
+    dirtyRules=MAX_RULES==32?0xFFFFFFFF:(1UL<<MAX_RULES)-1;
+    }
+  else if (ruleNumber>=0)
+    dirtyRules|=1UL<<ruleNumber;
+  else
+    dirtySettings|=1UL<<changed;
+  return scheduleTask(commitSettings,SETTINGS_COMMIT_MS,false); //wait for the rest of the changes
 
   if (shouldReboot)
     {
@@ -1581,31 +4823,61 @@ boolean saveSettings()
   }
 
 /*
-  SerialEvent occurs whenever a new data comes in the hardware serial RX. This
-  routine is run between each time loop() runs, so using delay inside loop can
-  delay response. Multiple bytes of data may be available.
-  This didn't work correctly when I first used it so I renamed the function to
-  incomingData() and the above statement no longer applies.
-*/
+ * Move whatever has come in on the serial port to the ring buffer, echoing it.
+ * Anything that doesn't fit stays in the serial port's own buffer until
+ * readSerialLine() has made room.
+ */
 void incomingData() 
   {
-  while (Serial.available()) 
+  while (Serial.available() && (uint16)(serialHead-serialTail)<SERIAL_RING_SIZE) 
     {
-    // get the new byte
-    char inChar = (char)Serial.read();
+    char inChar=(char)Serial.read();
     Serial.print(inChar);
+    serialRing[serialHead++&(SERIAL_RING_SIZE-1)]=inChar;
+    }
+  }
 
-    // if the incoming character is a newline, set a flag so the main loop can
-    // do something about it 
-    if (inChar == '\n') 
+/*
+ * Frame the next line in the ring buffer into serialLine.  A line ends with a CR,
+ * an LF or both, since blank lines are skipped.  A line too long for a command is
+ * dropped, up to its end, and counted as an overrun.
+ * Returns false if there is no complete line yet.
+ */
+boolean readSerialLine()
+  {
+  while (serialScan!=serialHead)
+    {
+    char c=serialRing[serialScan&(SERIAL_RING_SIZE-1)];
+    if (c!='\r' && c!='\n')
       {
-      commandComplete = true;
+      serialScan++;
+      if ((uint16)(serialScan-serialTail)>MQTT_MAX_COMMAND_SIZE)
+        {
+        if (!serialDiscarding)
+          {
+          serialOverruns++;
+          Serial.println("\n************ Line is too long, ignored.");
+          }
+        serialDiscarding=true;
+        serialTail=serialScan; //there's no need to keep what will be dropped
+        }
+      continue;
       }
-    else
+
+    uint16 length=serialScan-serialTail;
+    for (uint16 i=0;i<length;i++)
+      serialLine[i]=serialRing[(serialTail+i)&(SERIAL_RING_SIZE-1)];
+    serialLine[length]='\0';
+    serialTail=++serialScan;
+    if (serialDiscarding)
       {
-      // add it to the inputString 
-      commandString += inChar;
+      serialDiscarding=false; //that was the end of the long line
+      continue;
       }
+    if (length==0)
+      continue; //a blank line, or the LF of a CR LF
+    serialLines++;
+    return true;
     }
+  return false;
   }
-
@@ -0,0 +1,240 @@
+/*
+ * Tests for the payload matching: the JSON field search, and the rule
+ * messages as exact text, globs and number tests.  The rules are set up with
+ * commands the way a user would, so the matchers are compiled the same way.
+ *   pio test -e native
+ */
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <unity.h>
+#include "mqttListener.h"
+
+boolean jsonField(const char* json, unsigned int length, const char* path,
+                  const char** value, unsigned int* valueLength);
+
+/// @brief Find a field and check its value
+boolean fieldIs(const char* json, const char* path, const char* expected)
+  {
+  const char* value=NULL;
+  unsigned int valueLength=0;
+  if (!jsonField(json,strlen(json),path,&value,&valueLength))
+    return false;
+  return valueLength==strlen(expected) && memcmp(value,expected,valueLength)==0;
+  }
+
+/// @brief Check that a field isn't found
+boolean noField(const char* json, const char* path)
+  {
+  const char* value=NULL;
+  unsigned int valueLength=0;
+  return !jsonField(json,strlen(json),path,&value,&valueLength);
+  }
+
+/// @brief Set a setting with a command, as typed on the serial port
+void command(const char* name, int ruleNumber, const char* value)
+  {
+  char cmd[MQTT_MAX_COMMAND_SIZE+1];
+  snprintf(cmd,sizeof(cmd),"%s%d=%s",name,ruleNumber,value);
+  processCommand(cmd);
+  }
+
+/// @brief Make rule 1 match a message on the test topic
+void rule(const char* message, const char* jsonPath="")
+  {
+  command("topic",1,"test/match");
+  command("message",1,message);
+  command("json",1,jsonPath);
+  }
+
+/// @brief Check a payload against rule 1
+boolean matches(const char* payload)
+  {
+  return findRule("test/match",payload,strlen(payload))==0;
+  }
+
+void setUp()
+  {
+  for (int i=1;i<=MAX_RULES;i++)
+    {
+    command("topic",i,"");
+    command("message",i,"");
+    command("json",i,"");
+    }
+  }
+
+void tearDown()
+  {
+  }
+
+void test_json_top_level_fields()
+  {
+  const char* json=" { \"state\" : \"on\", \"level\":42,\"ok\":true , \"none\":null }";
+  TEST_ASSERT_TRUE(fieldIs(json,"state","on"));
+  TEST_ASSERT_TRUE(fieldIs(json,"level","42"));
+  TEST_ASSERT_TRUE(fieldIs(json,"ok","true"));
+  TEST_ASSERT_TRUE(fieldIs(json,"none","null"));
+  TEST_ASSERT_TRUE(noField(json,"stat"));
+  TEST_ASSERT_TRUE(noField(json,"missing"));
+  TEST_ASSERT_TRUE(noField("[1,2]","state"));
+  TEST_ASSERT_TRUE(noField("on","state"));
+  }
+
+void test_json_string_escapes()
+  {
+  //a string's value is returned with its escapes as they are
+  const char* json="{\"say\":\"a \\\"quoted\\\" word\",\"path\":\"c:\\\\\",\"state\":\"on\"}";
+  TEST_ASSERT_TRUE(fieldIs(json,"say","a \\\"quoted\\\" word"));
+  TEST_ASSERT_TRUE(fieldIs(json,"path","c:\\\\"));
+  TEST_ASSERT_TRUE(fieldIs(json,"state","on"));
+  TEST_ASSERT_TRUE(noField("{\"state\":\"on","state")); //the string doesn't end
+  }
+
+void test_json_brackets_inside_strings()
+  {
+  TEST_ASSERT_TRUE(fieldIs("{\"note\":\"}\",\"state\":\"on\"}","state","on"));
+  TEST_ASSERT_TRUE(fieldIs("{\"list\":[\"]\",\"}\"],\"state\":\"on\"}","state","on"));
+  TEST_ASSERT_TRUE(fieldIs("{\"inner\":{\"a\":\"{\"},\"state\":\"on\"}","state","on"));
+  }
+
+void test_json_nested_objects_and_arrays()
+  {
+  //a field with the same name further in isn't the one on the path
+  const char* json="{\"list\":[{\"state\":\"off\"},[1,{\"state\":\"off\"}]],"
+                   "\"update\":{\"state\":\"off\",\"more\":{\"state\":\"deep\"}},\"state\":\"on\"}";
+  TEST_ASSERT_TRUE(fieldIs(json,"state","on"));
+  TEST_ASSERT_TRUE(fieldIs(json,"update.state","off"));
+  TEST_ASSERT_TRUE(fieldIs(json,"update.more.state","deep"));
+  TEST_ASSERT_TRUE(fieldIs(json,"list","[{\"state\":\"off\"},[1,{\"state\":\"off\"}]]"));
+  TEST_ASSERT_TRUE(noField(json,"list.state"));
+  TEST_ASSERT_TRUE(noField(json,"update.missing"));
+  TEST_ASSERT_TRUE(noField(json,"state.more"));
+  }
+
+void test_exact_messages()
+  {
+  rule("open");
+  TEST_ASSERT_TRUE(matches("open"));
+  TEST_ASSERT_FALSE(matches("opened"));
+  TEST_ASSERT_FALSE(matches("ope"));
+  TEST_ASSERT_FALSE(matches(""));
+
+  //= takes the rest exactly, whatever it looks like
+  rule("=abc*");
+  TEST_ASSERT_TRUE(matches("abc*"));
+  TEST_ASSERT_FALSE(matches("abcd"));
+  rule("=>80");
+  TEST_ASSERT_TRUE(matches(">80"));
+  TEST_ASSERT_FALSE(matches("81"));
+  rule("=abc");
+  TEST_ASSERT_TRUE(matches("abc"));
+  TEST_ASSERT_FALSE(matches("=abc"));
+  }
+
+void test_globs()
+  {
+  rule("*");
+  TEST_ASSERT_TRUE(matches("anything"));
+  TEST_ASSERT_TRUE(matches(""));
+  rule("open*");
+  TEST_ASSERT_TRUE(matches("open"));
+  TEST_ASSERT_TRUE(matches("opened"));
+  TEST_ASSERT_FALSE(matches("reopened"));
+  rule("*door");
+  TEST_ASSERT_TRUE(matches("front door"));
+  TEST_ASSERT_FALSE(matches("doors"));
+  rule("a?c*");
+  TEST_ASSERT_TRUE(matches("abc"));
+  TEST_ASSERT_TRUE(matches("axcyz"));
+  TEST_ASSERT_FALSE(matches("ac"));
+  rule("*door*open*");
+  TEST_ASSERT_TRUE(matches("the door is open"));
+  TEST_ASSERT_TRUE(matches("dooropen"));
+  TEST_ASSERT_FALSE(matches("open door"));
+  rule("front door opened by the ?????? keypad*");
+  TEST_ASSERT_TRUE(matches("front door opened by the garage keypad at 10"));
+  TEST_ASSERT_FALSE(matches("front door opened by the side keypad"));
+  }
+
+void test_number_comparisons()
+  {
+  rule(">80");
+  TEST_ASSERT_TRUE(matches("81"));
+  TEST_ASSERT_TRUE(matches("80.001"));
+  TEST_ASSERT_TRUE(matches(" 90 "));
+  TEST_ASSERT_FALSE(matches("80"));
+  TEST_ASSERT_FALSE(matches("80.0009")); //past the thousandths doesn't count
+  TEST_ASSERT_FALSE(matches("81abc"));
+  TEST_ASSERT_FALSE(matches("abc"));
+  TEST_ASSERT_FALSE(matches(""));
+  rule(">=80");
+  TEST_ASSERT_TRUE(matches("80"));
+  TEST_ASSERT_FALSE(matches("79.999"));
+  rule("<-5");
+  TEST_ASSERT_TRUE(matches("-5.001"));
+  TEST_ASSERT_FALSE(matches("-5"));
+  rule("<=0.5");
+  TEST_ASSERT_TRUE(matches("+.5"));
+  TEST_ASSERT_FALSE(matches("0.501"));
+  }
+
+void test_number_ranges()
+  {
+  rule("10..20");
+  TEST_ASSERT_TRUE(matches("10"));
+  TEST_ASSERT_TRUE(matches("20"));
+  TEST_ASSERT_TRUE(matches("15.5"));
+  TEST_ASSERT_FALSE(matches("20.001"));
+  TEST_ASSERT_FALSE(matches("9.999"));
+  TEST_ASSERT_FALSE(matches("15x"));
+  rule("20..10"); //either way round
+  TEST_ASSERT_TRUE(matches("15"));
+  rule("-1.5..1.5");
+  TEST_ASSERT_TRUE(matches("-1.5"));
+  TEST_ASSERT_FALSE(matches("-1.501"));
+  rule("10..abc"); //not a number test, so taken exactly
+  TEST_ASSERT_TRUE(matches("10..abc"));
+  TEST_ASSERT_FALSE(matches("10"));
+  }
+
+void test_json_rules()
+  {
+  rule("on","update.state");
+  TEST_ASSERT_TRUE(matches("{\"state\":\"off\",\"update\":{\"state\":\"on\"}}"));
+  TEST_ASSERT_FALSE(matches("{\"state\":\"on\",\"update\":{\"state\":\"off\"}}"));
+  TEST_ASSERT_FALSE(matches("on"));
+  rule(">80","temp");
+  TEST_ASSERT_TRUE(matches("{\"note\":\"}\",\"temp\":81}"));
+  TEST_ASSERT_FALSE(matches("{\"temp\":\"81abc\"}"));
+  TEST_ASSERT_FALSE(matches("{\"list\":[{\"temp\":90}],\"temp\":70}"));
+  rule("10..20","level");
+  TEST_ASSERT_TRUE(matches("{\"level\":\"20\"}"));
+  TEST_ASSERT_FALSE(matches("{\"level\":20.001}"));
+  }
+
+void test_lowest_rule_wins()
+  {
+  command("topic",3,"test/match");
+  command("message",3,"*");
+  command("topic",2,"test/match");
+  command("message",2,"open");
+  TEST_ASSERT_TRUE(findRule("test/match","open",4)==1);
+  TEST_ASSERT_TRUE(findRule("test/match","shut",4)==2);
+  TEST_ASSERT_TRUE(findRule("test/other","open",4)==-1);
+  }
+
+int main(int argc, char** argv)
+  {
+  WiFi.begin("test");
+  UNITY_BEGIN();
+  RUN_TEST(test_json_top_level_fields);
+  RUN_TEST(test_json_string_escapes);
+  RUN_TEST(test_json_brackets_inside_strings);
+  RUN_TEST(test_json_nested_objects_and_arrays);
+  RUN_TEST(test_exact_messages);
+  RUN_TEST(test_globs);
+  RUN_TEST(test_number_comparisons);
+  RUN_TEST(test_number_ranges);
+  RUN_TEST(test_json_rules);
+  RUN_TEST(test_lowest_rule_wins);
+  return UNITY_END();
+  }
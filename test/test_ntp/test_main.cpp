@@ -0,0 +1,144 @@
+/*
+ * Tests for the SNTP client, run against the pretend NTP server in
+ * hal/NativeHal.  The clock is moved by hand instead of following the host's,
+ * so hours of retries and days of syncs take a moment.
+ *   pio test -e native
+ */
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+#include <PubSubClient.h>
+#include <TimeLib.h>
+#include <unity.h>
+#include "mqttListener.h"
+
+extern boolean timeIsSet;
+extern long driftPpm;
+extern unsigned long ntpFailures;
+void ntpFailed(const char* why);
+
+/// @brief Run the tasks for a while, a poll interval at a time
+void runFor(unsigned long ms)
+  {
+  for (unsigned long waited=0;waited<ms;waited+=NTP_POLL_MS)
+    {
+    nativeClockAdvance(NTP_POLL_MS);
+    runTasks();
+    }
+  }
+
+/// @brief Run the tasks until the next request goes out to the server
+/// @return the millis() that took
+unsigned long runUntilRequest(unsigned long limit)
+  {
+  unsigned long requests=WiFiUDP::ntpRequests;
+  unsigned long start=millis();
+  while (WiFiUDP::ntpRequests==requests && millis()-start<limit)
+    {
+    nativeClockAdvance(NTP_POLL_MS);
+    runTasks();
+    }
+  return millis()-start;
+  }
+
+/// @brief Sync the given number of times, leaving the last answer applied
+void runSyncs(int syncs)
+  {
+  requestTimeSync();
+  for (int i=0;i<syncs;i++)
+    runUntilRequest(2*NTP_REFRESH_MS);
+  runFor(NTP_TIMEOUT_MS);
+  }
+
+/// @brief The server answers nothing from now on
+void stopAnswering()
+  {
+  char answers[16];
+  snprintf(answers,sizeof(answers),"%lu",WiFiUDP::ntpRequests);
+  setenv("NATIVE_NTP_ANSWERS",answers,1);
+  }
+
+/// @brief How far utcMillis() is from the true time, in ms
+long clockError()
+  {
+  return (long)((long long)utcMillis()-(long long)(nativeRealtimeMicros()/1000));
+  }
+
+void setUp()
+  {
+  unsetenv("NATIVE_NTP_ANSWERS");
+  ntpFailed("next test"); //drops any request in flight and leaves the client idle
+  cancelTask(ntpTask);
+  ntpFailures=0;
+  timeIsSet=false;
+  driftPpm=0;
+  }
+
+void tearDown()
+  {
+  }
+
+void test_backoff_doubles_up_to_the_limit()
+  {
+  nativeClockManual(0);
+  stopAnswering();
+  requestTimeSync();
+  runUntilRequest(NTP_POLL_MS); //the first one goes out right away
+
+  //each request times out, then the wait before the next one doubles
+  unsigned long wait=NTP_RETRY_MIN_MS;
+  boolean reachedLimit=false;
+  for (int i=0;i<14;i++)
+    {
+    unsigned long gap=runUntilRequest(2*NTP_RETRY_MAX_MS);
+    TEST_ASSERT_UINT32_WITHIN(2*NTP_POLL_MS,NTP_TIMEOUT_MS+wait,gap);
+    reachedLimit|=wait==NTP_RETRY_MAX_MS;
+    wait=wait*2<NTP_RETRY_MAX_MS?wait*2:NTP_RETRY_MAX_MS;
+    }
+  TEST_ASSERT_TRUE(reachedLimit);
+  TEST_ASSERT_FALSE(timeIsSet);
+  }
+
+void test_drift_converges_on_a_fast_crystal()
+  {
+  nativeClockManual(500);
+  runSyncs(10);
+  TEST_ASSERT_TRUE(timeIsSet);
+  TEST_ASSERT_INT_WITHIN(5,500,driftPpm);
+  }
+
+void test_drift_converges_on_a_slow_crystal()
+  {
+  nativeClockManual(-300);
+  runSyncs(10);
+  TEST_ASSERT_TRUE(timeIsSet);
+  TEST_ASSERT_INT_WITHIN(5,-300,driftPpm);
+  }
+
+void test_time_holds_through_an_outage()
+  {
+  nativeClockManual(-300);
+  runSyncs(10);
+  TEST_ASSERT_INT_WITHIN(50,0,clockError());
+
+  //300 ppm uncorrected would be 26 s off after a day
+  stopAnswering();
+  for (int hour=1;hour<=24;hour++)
+    {
+    runFor(3600000);
+    TEST_ASSERT_INT_WITHIN(500,0,clockError());
+    }
+  TEST_ASSERT_TRUE(ntpFailures>0);
+  TEST_ASSERT_TRUE(timeIsSet);
+  }
+
+int main(int argc, char** argv)
+  {
+  WiFi.begin("test");
+  UNITY_BEGIN();
+  RUN_TEST(test_backoff_doubles_up_to_the_limit);
+  RUN_TEST(test_drift_converges_on_a_fast_crystal);
+  RUN_TEST(test_drift_converges_on_a_slow_crystal);
+  RUN_TEST(test_time_holds_through_an_outage);
+  return UNITY_END();
+  }